@@ -0,0 +1,163 @@
+/*
+ * app_tasks.c
+ *
+ * static storage and creation of the application tasks, and the stack auditor
+ * (see app_tasks.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "app_tasks.h"
+#include "sensor_acquisition.h"
+#include "trace.h"
+
+static const char *TAG = "app_tasks";  // for logging
+
+/*
+ * a stack and task control block for each table entry (a 1 byte placeholder for
+ * tasks not used in this build)
+ */
+#define APP_TASK_STORAGE(name, task_name, stack, prio, core) \
+    static StackType_t stack_##name[((stack) > 0) ? ((stack) / sizeof(StackType_t)) : 1]; \
+    static StaticTask_t tcb_##name;
+APP_TASK_TABLE(APP_TASK_STORAGE)
+#undef APP_TASK_STORAGE
+
+typedef struct {
+    const char *name;
+    uint32_t stack;  // bytes, 0 if not used
+    UBaseType_t priority;
+    BaseType_t core;
+    StackType_t *stack_buf;
+    StaticTask_t *tcb;
+} app_task_config_t;
+
+#define APP_TASK_ENTRY(name, task_name, stack, prio, core) \
+    [APP_TASK_##name] = { task_name, stack, prio, core, stack_##name, &tcb_##name },
+static const app_task_config_t app_task_config[APP_TASK_COUNT] = {
+    APP_TASK_TABLE(APP_TASK_ENTRY)
+};
+#undef APP_TASK_ENTRY
+
+static TaskHandle_t app_task_handles[APP_TASK_COUNT];
+
+/*
+ * create a table task from its static storage (each task once)
+ * returns its handle, or NULL if it has no stack in this build or was already created
+ */
+TaskHandle_t app_task_create(app_task_t id, TaskFunction_t fcn, void *arg)  {
+    const app_task_config_t *t;
+
+    if((id < 0) || (id >= APP_TASK_COUNT))
+        return(NULL);
+    t = &app_task_config[id];
+    if(t->stack == 0)  {
+        ESP_LOGE(TAG, "error: %s has no stack in APP_TASK_TABLE", t->name);
+        return(NULL);
+    }
+    if(app_task_handles[id] != NULL)  {
+        ESP_LOGE(TAG, "error: %s already created", t->name);
+        return(NULL);
+    }
+
+    app_task_handles[id] = xTaskCreateStaticPinnedToCore(fcn, t->name, t->stack, arg, t->priority,
+                                                         t->stack_buf, t->tcb, t->core);
+    return(app_task_handles[id]);
+}
+
+const char *app_task_name(app_task_t id)  {
+    if((id < 0) || (id >= APP_TASK_COUNT))
+        return("?");
+    return(app_task_config[id].name);
+}
+
+TaskHandle_t app_task_handle(app_task_t id)  {
+    if((id < 0) || (id >= APP_TASK_COUNT))
+        return(NULL);
+    return(app_task_handles[id]);
+}
+
+#if TASK_AUDIT_ENABLE
+/*
+ * least free stack (bytes) each task has had since it started
+ */
+static uint32_t audit_boot_free[APP_TASK_COUNT];
+
+static uint32_t audit_recommend(uint32_t used)  {
+    uint32_t margin = (used * APP_TASK_AUDIT_MARGIN_PCT) / 100;
+
+    if(margin < APP_TASK_AUDIT_MARGIN_MIN)
+        margin = APP_TASK_AUDIT_MARGIN_MIN;
+    return(((used + margin + APP_TASK_AUDIT_ROUND - 1) / APP_TASK_AUDIT_ROUND) * APP_TASK_AUDIT_ROUND);
+}
+
+static void audit_report(void)  {
+    const app_task_config_t *t;
+    uint32_t free_bytes, used, recommend;
+    uint32_t configured = 0, recommended = 0;
+
+    ESP_LOGI(TAG, "audit: task               stack  boot peak  load peak  recommend");
+    for(int id = 0; id < APP_TASK_COUNT; id++)  {
+        t = &app_task_config[id];
+        if((app_task_handles[id] == NULL) || (id == APP_TASK_AUDIT))
+            continue;
+        free_bytes = uxTaskGetStackHighWaterMark(app_task_handles[id]) * sizeof(StackType_t);
+        used = t->stack - free_bytes;
+        recommend = audit_recommend(used);
+        configured += t->stack;
+        recommended += recommend;
+        ESP_LOGI(TAG, "audit: %-18s %5" PRIu32 "  %9" PRIu32 "  %9" PRIu32 "  %9" PRIu32,
+                 t->name, t->stack, t->stack - audit_boot_free[id], used, recommend);
+    }
+    ESP_LOGI(TAG, "audit: stacks %" PRIu32 " bytes configured, %" PRIu32 " recommended (%" PRId32 " reclaimable)",
+             configured, recommended, (int32_t)(configured - recommended));
+    ESP_LOGI(TAG, "audit: heap free %u, min free %u, largest block %u",
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT), (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+/*
+ * the load test: every sensor published each cycle, a trace dump to serial and one
+ * to mqtt (the deepest paths of the idle priority tasks), the rest as it normally runs
+ */
+static void audit_task(void *pvParameters)  {
+    bool publish[SENSOR_COUNT];
+
+    vTaskDelay(APP_TASK_AUDIT_START_MS / portTICK_PERIOD_MS);
+    for(int id = 0; id < APP_TASK_COUNT; id++)
+        if(app_task_handles[id] != NULL)
+            audit_boot_free[id] = uxTaskGetStackHighWaterMark(app_task_handles[id]) * sizeof(StackType_t);
+
+    ESP_LOGI(TAG, "audit: load test for %d mS", APP_TASK_AUDIT_MS);
+    for(int i = 0; i < SENSOR_COUNT; i++)  {
+        publish[i] = sensors[i].publish;
+        sensor_set_publish(i, true);
+    }
+    vTaskDelay((APP_TASK_AUDIT_MS / 3) / portTICK_PERIOD_MS);
+    trace_dump(TRACE_SINK_SERIAL);
+    vTaskDelay((APP_TASK_AUDIT_MS / 3) / portTICK_PERIOD_MS);
+    trace_dump(TRACE_SINK_MQTT);
+    vTaskDelay((APP_TASK_AUDIT_MS / 3) / portTICK_PERIOD_MS);
+    for(int i = 0; i < SENSOR_COUNT; i++)
+        sensor_set_publish(i, publish[i]);
+
+    audit_report();
+    vTaskSuspend(NULL);  // static task: nothing to free, just stop
+}
+#endif
+
+/*
+ * start the auditor (call after all the other tasks are created)
+ */
+void app_task_audit_start(void)  {
+#if TASK_AUDIT_ENABLE
+    app_task_create(APP_TASK_AUDIT, audit_task, NULL);
+#endif
+}
@@ -0,0 +1,88 @@
+/*
+ * app_tasks.h
+ *
+ * every application task in one table, created from static storage: the stack and
+ * task control block of each are sized here at build time, so nothing is taken
+ * from the heap and the ram they use shows up in the map file.
+ *
+ * a module starts its task with app_task_create(APP_TASK_<name>, fcn, arg), which
+ * uses the name, stack, priority and core from the table.  a stack of 0 means the
+ * task isn't used in this build (e.g. a sensor group without members, or a second
+ * i2c port): no storage is reserved and app_task_create() refuses it.
+ * (queues and semaphores are created static by the module that owns them)
+ *
+ * the stack sizes are bytes, estimated rather than measured.  to measure them, build
+ * with TASK_AUDIT_ENABLE (monitoring_zimknives.h): it runs a load test after boot, then
+ * logs each task's peak stack use and a recommended size for this table.
+ */
+
+#ifndef __APP_TASKS_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"  // for types (at least)
+
+#include "monitoring_zimknives.h"
+#include "sensor_acquisition.h"
+
+/*
+ * X(name, task name, stack (bytes), priority, core (or tskNO_AFFINITY))
+ *
+ * the stacks are round estimates, not yet checked on the target: replace them with
+ * the auditor's recommended sizes (see below) once it has been run
+ *
+ * priorities: the i2c bus task runs above the acquisition tasks using it; the
+ * wifi supervisor mostly sleeps, but a reconnect shouldn't wait behind sampling; the
+ * trace dump, deferred log and auditor only use time nobody else wants
+ */
+#define APP_TASK_TABLE(X) \
+  X(WIFI_SUP,    "wifi_sup",          3072,                            tskIDLE_PRIORITY + 1, tskNO_AFFINITY) \
+  X(I2C_BUS0,    "i2c_bus0",          3072,                            tskIDLE_PRIORITY + 2, tskNO_AFFINITY) \
+  X(I2C_BUS1,    "i2c_bus1",          0,                               tskIDLE_PRIORITY + 2, tskNO_AFFINITY) \
+  X(ACQ_FAST,    "acq_fast",          SENSOR_GROUP_STACK(FAST, 4096),   tskIDLE_PRIORITY + 1, 1)              \
+  X(ACQ_MEDIUM,  "acq_medium",        SENSOR_GROUP_STACK(MEDIUM, 4096), tskIDLE_PRIORITY + 1, tskNO_AFFINITY) \
+  X(ACQ_SLOW,    "acq_slow",          SENSOR_GROUP_STACK(SLOW, 4096),   tskIDLE_PRIORITY,     tskNO_AFFINITY) \
+  X(FAST_STREAM, "fast_stream_task",  FAST_STREAM_ENABLE ? 4096 : 0,   tskIDLE_PRIORITY + 1, tskNO_AFFINITY) \
+  X(FAST_ACQ,    "fast_acq_sim_task", 3072,                            tskIDLE_PRIORITY,     tskNO_AFFINITY) \
+  X(NEOPIXEL,    "neopixel_example",  4096,                            tskIDLE_PRIORITY,     tskNO_AFFINITY) \
+  X(TRACE,       "trace_task",        3072,                            tskIDLE_PRIORITY,     tskNO_AFFINITY) \
+  X(PUB_SCHED,   "pub_sched",         PUB_SCHED_ENABLE ? 3072 : 0,     tskIDLE_PRIORITY + 1, tskNO_AFFINITY) \
+  X(DLOG,        "dlog_task",         DLOG_DEFERRED ? 3072 : 0,        tskIDLE_PRIORITY,     tskNO_AFFINITY) \
+  X(AUDIT,       "audit_task",        TASK_AUDIT_ENABLE ? 3072 : 0,    tskIDLE_PRIORITY,     tskNO_AFFINITY)
+
+/*
+ * a sensor group's task only gets a stack if the group has members
+ */
+#define SENSOR_GROUP_STACK(group, stack) (SENSOR_GROUP_USED(SENSOR_GROUP_##group) ? (stack) : 0)
+
+/*
+ * task ids: APP_TASK_I2C_BUS0, ...
+ */
+typedef enum {
+#define APP_TASK_ID(name, ...) APP_TASK_##name,
+  APP_TASK_TABLE(APP_TASK_ID)
+#undef APP_TASK_ID
+  APP_TASK_COUNT,
+} app_task_t;
+
+/*
+ * auditor: APP_TASK_AUDIT_START_MS after boot it notes each task's stack high water
+ * mark ("boot peak"), runs the load test for APP_TASK_AUDIT_MS (every sensor published
+ * each cycle, trace dumps to serial and mqtt) and logs the high water marks again
+ * ("load peak") with a recommended stack size and the heap state.
+ * recommended = peak use + APP_TASK_AUDIT_MARGIN_PCT % (at least
+ * APP_TASK_AUDIT_MARGIN_MIN bytes), rounded up to APP_TASK_AUDIT_ROUND
+ */
+#define APP_TASK_AUDIT_START_MS 10000
+#define APP_TASK_AUDIT_MS 60000
+#define APP_TASK_AUDIT_MARGIN_PCT 25
+#define APP_TASK_AUDIT_MARGIN_MIN 512
+#define APP_TASK_AUDIT_ROUND 256
+
+TaskHandle_t app_task_create(app_task_t id, TaskFunction_t fcn, void *arg);
+const char *app_task_name(app_task_t id);
+TaskHandle_t app_task_handle(app_task_t id);
+void app_task_audit_start(void);
+
+#define __APP_TASKS_H__
+#endif
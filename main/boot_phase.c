@@ -0,0 +1,69 @@
+/*
+ * boot_phase.c
+ *
+ * startup phase timestamps (see boot_phase.h)
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boot_phase.h"
+
+static const char *TAG = "boot_phase";  // for logging
+
+static int64_t phase_us[BOOT_PHASE_COUNT];  // 0: not reached
+static portMUX_TYPE phase_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define BOOT_PHASE_LABEL(name, label) label,
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    BOOT_PHASE_TABLE(BOOT_PHASE_LABEL)
+};
+#undef BOOT_PHASE_LABEL
+
+/*
+ * log the phases reached, in the order of the table
+ */
+static void boot_report(void)  {
+    for(int p = 0; p < BOOT_PHASE_COUNT; p++)
+        if(phase_us[p] != 0)
+            ESP_LOGI(TAG, "%-14s %7" PRId64 ".%03" PRId64 " mS", phase_names[p], phase_us[p] / 1000, phase_us[p] % 1000);
+        else
+            ESP_LOGI(TAG, "%-14s (not yet)", phase_names[p]);
+}
+
+/*
+ * note that a phase has been reached (only the first call for each counts, so it
+ * can be called from paths that run again later)
+ */
+void boot_mark(boot_phase_t phase)  {
+    int64_t now_us;
+    bool first = false;
+
+    if((phase < 0) || (phase >= BOOT_PHASE_COUNT) || (phase_us[phase] != 0))
+        return;
+
+    now_us = esp_timer_get_time();
+    taskENTER_CRITICAL(&phase_lock);
+    if(phase_us[phase] == 0)  {
+        phase_us[phase] = now_us;
+        first = true;
+    }
+    taskEXIT_CRITICAL(&phase_lock);
+
+    if(first && (phase == BOOT_PHASE_FIRST_PUBLISH))
+        boot_report();
+}
+
+/*
+ * when a phase was reached (mS since boot), -1 if it hasn't been
+ */
+int32_t boot_phase_ms(boot_phase_t phase)  {
+    if((phase < 0) || (phase >= BOOT_PHASE_COUNT) || (phase_us[phase] == 0))
+        return(-1);
+    return((int32_t)(phase_us[phase] / 1000));
+}
@@ -0,0 +1,45 @@
+/*
+ * boot_phase.h
+ *
+ * timestamps of the startup phases, to keep boot-to-first-sample short and see
+ * where the time to first publish goes.
+ *
+ * each phase is marked once, the first time it is reached (boot_mark()), in uS of
+ * esp_timer (so from boot).  when the first publish goes out the whole list is
+ * logged; telemetry carries it as "boot" (mS, -1 for a phase not reached yet).
+ *
+ * the network comes up in the background: app_main() only starts wifi and mqtt,
+ * then brings up the sensors and display without waiting for them, so the order of
+ * the later phases varies from boot to boot.
+ */
+
+#ifndef __BOOT_PHASE_H__
+
+#include "esp_system.h"  // for types (at least)
+
+/*
+ * X(name, label)
+ */
+#define BOOT_PHASE_TABLE(X) \
+    X(APP_MAIN,      "app_main")       /* app_main() entered */                  \
+    X(NVS,           "nvs")            /* nvs initialized */                     \
+    X(WIFI_START,    "wifi_start")     /* wifi driver started, connecting */     \
+    X(SENSORS,       "sensors")        /* sensors initialized, groups started */ \
+    X(TASKS,         "tasks")          /* every application task created */      \
+    X(FIRST_SAMPLE,  "first_sample")   /* first sensor sample stored */          \
+    X(WIFI_UP,       "wifi_up")        /* got an ip address */                   \
+    X(MQTT_UP,       "mqtt_up")        /* broker connected */                    \
+    X(FIRST_PUBLISH, "first_publish")  /* first publish accepted by the client */
+
+typedef enum {
+#define BOOT_PHASE_ID(name, label) BOOT_PHASE_##name,
+    BOOT_PHASE_TABLE(BOOT_PHASE_ID)
+#undef BOOT_PHASE_ID
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+void boot_mark(boot_phase_t phase);
+int32_t boot_phase_ms(boot_phase_t phase);
+
+#define __BOOT_PHASE_H__
+#endif
@@ -0,0 +1,388 @@
+/*
+ * device_cmd.c
+ *
+ * in place parsing and staging of the runtime configuration commands (see device_cmd.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "device_cmd.h"
+#include "sensor_acquisition.h"
+#include "htu21d.h"
+#include "display_neopixel.h"
+#include "mqtt_pub.h"
+#include "trace.h"
+
+static const char *TAG = "device_cmd";  // for logging
+
+/*
+ * a token: where it is in the message, and its length (not nul terminated)
+ */
+typedef struct {
+    const char *p;
+    int len;
+} span_t;
+
+#define DEVICE_CMD_SENSOR_NAME(name, ...) #name,
+static const char *const sensor_names[SENSOR_COUNT] = {
+    SENSOR_TABLE(DEVICE_CMD_SENSOR_NAME)
+};
+#undef DEVICE_CMD_SENSOR_NAME
+
+typedef struct {
+    const char *name;
+    uint8_t value;
+} name_value_t;
+
+static const name_value_t resolutions[] = {
+    { "rh12", HTU21D_RES_RH12_TEMP14 },
+    { "rh8",  HTU21D_RES_RH8_TEMP12 },
+    { "rh10", HTU21D_RES_RH10_TEMP13 },
+    { "rh11", HTU21D_RES_RH11_TEMP11 },
+};
+
+/*
+ * the display modes the display task's loop drives
+ */
+static const name_value_t display_modes[] = {
+    { "excel",    EXCEL_COLOR_VALUE },
+    { "register", SIM_REG_EXAMPLE },
+    { "waveform", FAST_WAVEFORM },
+};
+
+/*
+ * staged settings, waiting to be taken
+ */
+static device_cmd_sensor_t pending[SENSOR_COUNT];
+static bool pending_resolution_set = false;
+static uint8_t pending_resolution;
+static bool pending_display_set = false;
+static uint8_t pending_display;
+static portMUX_TYPE pending_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * span helpers
+ */
+static bool span_is(const span_t *s, const char *word)  {
+    return((s->len == (int)strlen(word)) && (strncasecmp(s->p, word, s->len) == 0));
+}
+
+/*
+ * decimal, or hex with 0x
+ */
+static bool span_u32(const span_t *s, uint32_t *v)  {
+    uint32_t n = 0, base = 10, digit;
+    int k = 0;
+    char c;
+
+    if((s->len > 2) && (s->p[0] == '0') && ((s->p[1] == 'x') || (s->p[1] == 'X')))  {
+        base = 16;
+        k = 2;
+    }
+    if(k == s->len)
+        return(false);
+    for(; k < s->len; k++)  {
+        c = s->p[k];
+        if((c >= '0') && (c <= '9'))
+            digit = c - '0';
+        else if((base == 16) && (c >= 'a') && (c <= 'f'))
+            digit = c - 'a' + 10;
+        else if((base == 16) && (c >= 'A') && (c <= 'F'))
+            digit = c - 'A' + 10;
+        else
+            return(false);
+        if(n > (UINT32_MAX - digit) / base)
+            return(false);
+        n = (n * base) + digit;
+    }
+    *v = n;
+    return(true);
+}
+
+/*
+ * non-negative decimal, e.g. "0.25", "3", ".5"
+ */
+static bool span_float(const span_t *s, float *v)  {
+    float n = 0, scale = 1;
+    bool point = false, digits = false;
+
+    for(int k = 0; k < s->len; k++)  {
+        if((s->p[k] == '.') && !point)
+            point = true;
+        else if((s->p[k] >= '0') && (s->p[k] <= '9'))  {
+            digits = true;
+            if(point)
+                n += (s->p[k] - '0') * (scale /= 10);
+            else
+                n = (n * 10) + (s->p[k] - '0');
+        }
+        else
+            return(false);
+    }
+    if(!digits)
+        return(false);
+    *v = n;
+    return(true);
+}
+
+static bool span_lookup(const span_t *s, const name_value_t *table, int n, uint8_t *value)  {
+    for(int k = 0; k < n; k++)
+        if(span_is(s, table[k].name))  {
+            *value = table[k].value;
+            return(true);
+        }
+    return(false);
+}
+
+static int span_sensor(const span_t *s)  {
+    uint32_t i;
+
+    if(span_u32(s, &i))
+        return((i < SENSOR_COUNT) ? (int)i : -1);
+    for(int k = 0; k < SENSOR_COUNT; k++)
+        if(span_is(s, sensor_names[k]))
+            return(k);
+    return(-1);
+}
+
+/*
+ * split one command into tokens, returns the count (or -1 if there are too many)
+ */
+static int tokenize(const char *p, const char *end, span_t *tok)  {
+    int n = 0;
+
+    while(p < end)  {
+        while((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+            p++;
+        if(p == end)
+            break;
+        if(n == DEVICE_CMD_TOKENS_MAX)
+            return(-1);
+        tok[n].p = p;
+        while((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\r'))
+            p++;
+        tok[n].len = p - tok[n].p;
+        n++;
+    }
+    return(n);
+}
+
+/*
+ * a message's own copy of the settings, until all of it has been checked
+ */
+typedef struct {
+    device_cmd_sensor_t sensor[SENSOR_COUNT];
+    bool resolution_set;
+    uint8_t resolution;
+    bool display_set;
+    uint8_t display;
+    span_t trace;  // "serial", "mqtt" or "mask <n>", len 0 if none
+} device_cmd_stage_t;
+
+/*
+ * check one command and stage it
+ * returns NULL, or what is wrong with it
+ */
+static const char *stage_command(device_cmd_stage_t *st, const span_t *tok, int n)  {
+    device_cmd_sensor_t *s;
+    uint32_t u, u2, min_ms;
+    int i;
+
+    if(span_is(&tok[0], "resolution"))  {
+        if((n != 2) || !span_lookup(&tok[1], resolutions, sizeof(resolutions) / sizeof(resolutions[0]), &st->resolution))
+            return("usage: resolution rh12|rh8|rh10|rh11");
+        st->resolution_set = true;
+        return(NULL);
+    }
+    if(span_is(&tok[0], "display"))  {
+        if((n != 2) || !span_lookup(&tok[1], display_modes, sizeof(display_modes) / sizeof(display_modes[0]), &st->display))
+            return("usage: display excel|register|waveform");
+        st->display_set = true;
+        return(NULL);
+    }
+    if(span_is(&tok[0], "trace"))  {
+        if(!(((n == 2) && (span_is(&tok[1], "serial") || span_is(&tok[1], "mqtt"))) ||
+             ((n == 3) && span_is(&tok[1], "mask") && span_u32(&tok[2], &u))))
+            return("usage: trace serial|mqtt|mask <n>");
+        st->trace.p = tok[1].p;
+        st->trace.len = (tok[n - 1].p + tok[n - 1].len) - tok[1].p;
+        return(NULL);
+    }
+
+    // the rest are per sensor
+    if(!span_is(&tok[0], "interval") && !span_is(&tok[0], "deadband") && !span_is(&tok[0], "publish"))
+        return("unknown command");
+    if((n < 2) || ((i = span_sensor(&tok[1])) < 0))
+        return("unknown sensor");
+    s = &st->sensor[i];
+
+    if(span_is(&tok[0], "interval"))  {
+        if((n < 3) || (n > 4) || !span_u32(&tok[2], &u))
+            return("usage: interval <sensor> <ms> [<max ms>]");
+        u2 = u;
+        if((n == 4) && (!span_u32(&tok[3], &u2) || (u == 0) || (u2 < u)))
+            return("interval: max must be >= ms (and ms > 0)");
+        min_ms = DEVICE_CMD_INTERVAL_MIN_MS;
+        if((sensors[i].driver != NULL) && (sensors[i].driver->conversion_ms() > min_ms))
+            min_ms = sensors[i].driver->conversion_ms();
+        if((u != 0) && (u < min_ms))
+            return("interval: ms is below the minimum (DEVICE_CMD_INTERVAL_MIN_MS or the conversion time)");
+        s->floor_ms = u;
+        s->ceiling_ms = u2;
+        s->set |= DEVICE_CMD_SET_INTERVAL;
+    }
+    else if(span_is(&tok[0], "deadband"))  {
+        if((n < 4) || (n > 5) || !span_float(&tok[2], &s->deadband.abs) || !span_float(&tok[3], &s->deadband.rel))
+            return("usage: deadband <sensor> <abs> <rel> [<max silence ms>]");
+        if(n == 5)  {
+            if(!span_u32(&tok[4], &u))
+                return("deadband: max silence is in mS (0: no heartbeat)");
+            s->deadband.max_silence_ms = u;
+            s->set |= DEVICE_CMD_SET_SILENCE;
+        }
+        s->set |= DEVICE_CMD_SET_DEADBAND;
+    }
+    else  {
+        if((n != 3) || !(span_is(&tok[2], "on") || span_is(&tok[2], "off")))
+            return("usage: publish <sensor> on|off");
+        s->publish = span_is(&tok[2], "on");
+        s->set |= DEVICE_CMD_SET_PUBLISH;
+    }
+    return(NULL);
+}
+
+/*
+ * hand the staged message over to the takers (only once all of it checked out)
+ */
+static void commit(const device_cmd_stage_t *st)  {
+    const device_cmd_sensor_t *s;
+    bool wake = st->resolution_set;
+
+    taskENTER_CRITICAL(&pending_lock);
+    for(int i = 0; i < SENSOR_COUNT; i++)  {
+        s = &st->sensor[i];
+        if(s->set & DEVICE_CMD_SET_INTERVAL)  {
+            pending[i].floor_ms = s->floor_ms;
+            pending[i].ceiling_ms = s->ceiling_ms;
+        }
+        if(s->set & DEVICE_CMD_SET_DEADBAND)  {
+            pending[i].deadband.abs = s->deadband.abs;
+            pending[i].deadband.rel = s->deadband.rel;
+        }
+        if(s->set & DEVICE_CMD_SET_SILENCE)
+            pending[i].deadband.max_silence_ms = s->deadband.max_silence_ms;
+        if(s->set & DEVICE_CMD_SET_PUBLISH)
+            pending[i].publish = s->publish;
+        pending[i].set |= s->set;
+        wake |= (s->set != 0);
+    }
+    if(st->resolution_set)  {
+        pending_resolution = st->resolution;
+        pending_resolution_set = true;
+    }
+    if(st->display_set)  {
+        pending_display = st->display;
+        pending_display_set = true;
+    }
+    taskEXIT_CRITICAL(&pending_lock);
+
+    if(wake)
+        sensor_groups_wake();  // taken at the start of the next cycle, not after the current sleep
+    if(st->trace.len > 0)
+        trace_command(st->trace.p, st->trace.len);  // only queues a request for the trace task
+}
+
+static void reply(const char *msg, int command)  {
+    char *payload;
+    int len;
+
+    if((payload = mqtt_pub_buf_get()) == NULL)
+        return;
+    if(msg == NULL)
+        len = snprintf(payload, MQTT_PUB_BUF_LEN, "ok");
+    else
+        len = snprintf(payload, MQTT_PUB_BUF_LEN, "error: %s (command %d), nothing applied", msg, command);
+    mqtt_pub_send_now(DEVICE_CMD_RESULT_TOPIC, payload, len, 0, 0);
+    mqtt_pub_buf_put(payload);
+}
+
+/*
+ * a DEVICE_CMD_TOPIC message (called from the mqtt event handler with the event's
+ * data, which is only valid for the call)
+ */
+void device_cmd_handle(const char *data, int len)  {
+    device_cmd_stage_t st;
+    span_t tok[DEVICE_CMD_TOKENS_MAX];
+    const char *p = data, *end = data + len, *eol;
+    const char *err = NULL;
+    int n, command = 0;
+
+    if((data == NULL) || (len <= 0))
+        return;
+
+    memset(&st, 0, sizeof(st));
+    while((p < end) && (err == NULL))  {
+        for(eol = p; (eol < end) && (*eol != '\n') && (*eol != ';'); eol++)
+            ;
+        n = tokenize(p, eol, tok);
+        p = eol + 1;
+        if(n == 0)
+            continue;  // blank
+        command++;
+        err = (n < 0) ? "too many arguments" : stage_command(&st, tok, n);
+    }
+
+    if(err != NULL)  {
+        ESP_LOGI(TAG, "command %d rejected: %s", command, err);
+        reply(err, command);
+        return;
+    }
+    commit(&st);
+    ESP_LOGI(TAG, "%d command(s) accepted", command);
+    reply(NULL, command);
+}
+
+/*
+ * take (and clear) the staged settings of sensors[i], false if there are none
+ */
+bool device_cmd_take_sensor(int i, device_cmd_sensor_t *cfg)  {
+    if((i < 0) || (i >= SENSOR_COUNT) || (pending[i].set == 0))
+        return(false);  // (the common case, checked without the lock)
+    taskENTER_CRITICAL(&pending_lock);
+    *cfg = pending[i];
+    pending[i].set = 0;
+    taskEXIT_CRITICAL(&pending_lock);
+    return(cfg->set != 0);
+}
+
+bool device_cmd_take_resolution(uint8_t *resolution)  {
+    bool set;
+
+    if(!pending_resolution_set)
+        return(false);
+    taskENTER_CRITICAL(&pending_lock);
+    set = pending_resolution_set;
+    *resolution = pending_resolution;
+    pending_resolution_set = false;
+    taskEXIT_CRITICAL(&pending_lock);
+    return(set);
+}
+
+bool device_cmd_take_display(uint8_t *mode)  {
+    bool set;
+
+    if(!pending_display_set)
+        return(false);
+    taskENTER_CRITICAL(&pending_lock);
+    set = pending_display_set;
+    *mode = pending_display;
+    pending_display_set = false;
+    taskEXIT_CRITICAL(&pending_lock);
+    return(set);
+}
@@ -0,0 +1,67 @@
+/*
+ * device_cmd.h
+ *
+ * runtime configuration over mqtt: tune a node in the field without a reflash.
+ *
+ * a message on DEVICE_CMD_TOPIC holds one or more commands, separated by newlines
+ * or ';'.  <sensor> is a SENSOR_TABLE name (any case, e.g. "humidity") or its index.
+ *   interval <sensor> <ms> [<max ms>]      sampling interval: fixed, or the adaptive
+ *                                          floor/ceiling (0: every group period, otherwise
+ *                                          at least DEVICE_CMD_INTERVAL_MIN_MS and the
+ *                                          sensor's conversion time)
+ *   deadband <sensor> <abs> <rel> [<max silence ms>]   publish suppression (sensor_deadband_t),
+ *                                          the heartbeat is left as it is without max silence
+ *   publish <sensor> on|off                raw sample publishing
+ *   resolution rh12|rh8|rh10|rh11          HTU21D resolution (HTU21D_RES_*)
+ *   display excel|register|waveform        neopixel display mode
+ *   trace serial|mqtt|mask <n>             trace capture, as on TRACE_CMD_TOPIC
+ *
+ * the message is parsed in place in the mqtt event buffer (tokens are pointer and
+ * length spans, numbers are converted from the span), nothing is copied.  the whole
+ * message is checked before anything is taken: one bad command rejects all of it.
+ * "ok" or the error is published on DEVICE_CMD_RESULT_TOPIC.
+ *
+ * accepted settings are staged, not applied: each sensor group task takes the ones
+ * for its members between acquisition cycles (device_cmd_take_sensor()), so a
+ * conversion in flight never sees a half changed configuration; the display task
+ * takes a mode change at the top of its loop.  a later message for the same setting
+ * replaces one not yet taken.
+ */
+
+#ifndef __DEVICE_CMD_H__
+
+#include "esp_system.h"  // for types (at least)
+
+#include "sensor_acquisition.h"
+
+#define DEVICE_CMD_TOPIC "esp32/cmd"
+#define DEVICE_CMD_RESULT_TOPIC "esp32/cmd/result"
+#define DEVICE_CMD_TOKENS_MAX 6  // per command, including the command itself
+#define DEVICE_CMD_INTERVAL_MIN_MS 100  // shortest sampling interval accepted
+
+/*
+ * which settings of a device_cmd_sensor_t are present
+ */
+#define DEVICE_CMD_SET_INTERVAL 0x01
+#define DEVICE_CMD_SET_DEADBAND 0x02
+#define DEVICE_CMD_SET_PUBLISH  0x04
+#define DEVICE_CMD_SET_SILENCE  0x08  // deadband.max_silence_ms (DEVICE_CMD_SET_DEADBAND: abs and rel)
+
+/*
+ * staged settings of one sensor
+ */
+typedef struct {
+    uint8_t set;          // DEVICE_CMD_SET_* bits
+    bool publish;
+    uint32_t floor_ms;    // interval: floor_ms == ceiling_ms is fixed, 0 is every group period
+    uint32_t ceiling_ms;
+    sensor_deadband_t deadband;
+} device_cmd_sensor_t;
+
+void device_cmd_handle(const char *data, int len);
+bool device_cmd_take_sensor(int i, device_cmd_sensor_t *cfg);
+bool device_cmd_take_resolution(uint8_t *resolution);
+bool device_cmd_take_display(uint8_t *mode);
+
+#define __DEVICE_CMD_H__
+#endif
@@ -25,7 +25,11 @@
 #include "driver/gptimer.h"
 #include "driver/gpio.h"
 
+#include "monitoring_zimknives.h"
 #include "display_neopixel.h"
+#include "fast_filter.h"
+#include "fast_stream.h"
+#include "trace.h"
 
 #define BLINK_GPIO CONFIG_BLINK_GPIO  // set the gpio line for neopixel data output
 
@@ -41,6 +45,52 @@ static uint8_t s_led_state = 0;
  */
 static led_strip_handle_t led_strip;
 
+/*
+ * the strip is shared by the display task(s) and the alarm engine (which runs in
+ * the acquisition task), so each complete frame (clear .. refresh) holds this mutex.
+ * frames only take ~1 mS to send.  the alarm engine calls in with sensor_data_mutex
+ * held, so it only waits DISPLAY_ALARM_WAIT_MS for the strip: if that runs out the new
+ * state is left in strip_alarm_pending and the holder sends it as it lets go.
+ */
+static SemaphoreHandle_t strip_mutex = NULL;
+static StaticSemaphore_t strip_mutex_buf;
+static volatile bool strip_alarm = false;  // state of the alarm segment
+static volatile bool strip_alarm_pending = false;  // strip_alarm changed but not sent yet
+static display_stats_t display_stats;  // (isr_count is only written by the isr)
+
+static void strip_take(void)  {
+    if(strip_mutex != NULL)
+        xSemaphoreTake(strip_mutex, portMAX_DELAY);
+}
+
+static void strip_refresh(void);
+
+static void strip_give(void)  {
+    if(strip_alarm_pending)  {
+        strip_alarm_pending = false;
+        strip_refresh();  // the alarm changed during this frame
+    }
+    if(strip_mutex != NULL)
+        xSemaphoreGive(strip_mutex);
+}
+
+/*
+ * overlay the alarm segment on the in-memory frame and send it to the strip
+ * (called with strip_mutex held)
+ */
+static void strip_refresh(void)  {
+    for(uint8_t i = DISPLAY_ALARM_LED_FIRST; i < (DISPLAY_ALARM_LED_FIRST + DISPLAY_ALARM_LEDS); i++)  {
+        if(strip_alarm)
+            led_strip_set_pixel(led_strip, i, DISPLAY_ALARM_COLOR);
+        else
+            led_strip_set_pixel(led_strip, i, 0, 0, 0);
+    }
+    TRACE_BEGIN(DISPLAY_REFRESH, 0);
+    display_stats.frames_sent++;
+    led_strip_refresh(led_strip);
+    TRACE_END(DISPLAY_REFRESH, 0);
+}
+
 /*
  * simple OG example to blink a single neopixel
  * (code not used in chase example)
@@ -50,9 +100,11 @@ static void blink_led(void)
     /* If the addressable LED is enabled */
     if (s_led_state) {
         /* Set the LED pixel using RGB from 0 (0%) to 255 (100%) for each color */
+        strip_take();
         led_strip_set_pixel(led_strip, 0, 16, 16, 16);
         /* Refresh the strip to send data */
-        led_strip_refresh(led_strip);
+        strip_refresh();
+        strip_give();
     } else {
         /* Set all LED off to clear all pixels */
         led_strip_clear(led_strip);
@@ -94,7 +146,8 @@ void display_neopixel_update(uint8_t display_neopixel_mode, int32_t value)  {
 static int8_t cur_led = -1;  // the led that is currently lit
 static uint8_t led_dir = 1;  // 1 = fwd, 0 = rev
 static uint8_t r = 16, g = 0, b = 0;
-#define NUM_LEDS 20  // temporary hack TODO
+#define NUM_LEDS DISPLAY_NUM_LEDS  // temporary hack TODO
+#define BAR_LEDS (NUM_LEDS - DISPLAY_ALARM_LEDS)  // bar graph modes leave the alarm segment alone
 void led_next_pong(void)
 {
     if(led_dir == 1)
@@ -117,9 +170,11 @@ void led_next_pong(void)
         
     }
 
+    strip_take();
     led_strip_clear(led_strip);
     led_strip_set_pixel(led_strip, cur_led, r, g, b);
-    led_strip_refresh(led_strip);
+    strip_refresh();
+    strip_give();
 }
 
 /*
@@ -139,6 +194,7 @@ void led_next_reg(void)  {
     int8_t end_idx = LED_REG_MSG_SIZE - 1;  // to know we are at end of message
     uint8_t mask = 0x01;  // anded with ascii value to assign bit values
 
+    strip_take();
     led_strip_clear(led_strip);
 
     led_idx++;  // move to the next character in the message
@@ -162,7 +218,8 @@ void led_next_reg(void)  {
         mask = mask << 1;
     }
 
-    led_strip_refresh(led_strip);
+    strip_refresh();
+    strip_give();
 
 }
 
@@ -253,6 +310,7 @@ void led_bargraph_update(int32_t value)  {
 
     if(value <= 0)  value = 0;
 
+    strip_take();
     led_strip_clear(led_strip);
 
     /*
@@ -269,8 +327,8 @@ void led_bargraph_update(int32_t value)  {
      * then index through the pixels turning on those below the top_on_pixel,
      * and turning off those above (on means on color, ditto off)
      */
-    top_on_pixel = led_segment / ((led_bargraph_max - led_bargraph_min)/NUM_LEDS);
-    for(uint8_t i = 0; i < NUM_LEDS; i++)  {
+    top_on_pixel = led_segment / ((led_bargraph_max - led_bargraph_min)/BAR_LEDS);
+    for(uint8_t i = 0; i < BAR_LEDS; i++)  {
         if(i < top_on_pixel)
             led_strip_set_pixel(led_strip, i, led_bargraph_on_colors[i][LED_R], 
                                 led_bargraph_on_colors[i][LED_G],
@@ -281,7 +339,8 @@ void led_bargraph_update(int32_t value)  {
                                 led_bargraph_off_colors[i][LED_B]);
     }
 
-    led_strip_refresh(led_strip);
+    strip_refresh();
+    strip_give();
 }
 
 /*
@@ -304,7 +363,6 @@ int32_t led_bargraph_map(float value, float min_value, float max_value)  {
 /*
  * ekg waveform  (543 samples) 
  */
-#define FAST_BG_ALARM_COUNT 2000 // 2000 counts on 1 uS clock = 2 mS counts between samples
 #define EKG_NUM_SAMPLES 543
 const short  ekg_data[] = {
 939, 940, 941, 942, 944, 945, 946, 947, 951, 956, 
@@ -364,8 +422,10 @@ const short  ekg_data[] = {
 1005, 1008, 1012};
 
 int32_t led_bargraph_fast_index = 0; // index into waveform array
+int32_t led_bargraph_fast_value = 0; // latest display rate (filtered) value
 SemaphoreHandle_t bgf_Semaphore = NULL;  // bargraph fast data index semaphore
 SemaphoreHandle_t disphold_Semaphore = NULL;  // display hold index semaphore
+static StaticSemaphore_t bgf_Semaphore_buf, disphold_Semaphore_buf;
 
 /*
  * callback to increment the waveform index
@@ -373,10 +433,13 @@ SemaphoreHandle_t disphold_Semaphore = NULL;  // display hold index semaphore
 static uint8_t led_state = 0;  // for instrumentation
 static int32_t last_disp_data = 0;  // remember the last value for delta calculation
 static int32_t delta = 0;  // global so it doesn't need to be created on the stack
+static fast_filter_out_t filter_out;  // ditto
+static uint8_t filter_flags = 0;  // which filter outputs were updated this sample
 static bool IRAM_ATTR fast_bg_cbs(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_data)  {
     BaseType_t high_task_awoken = pdFALSE;
 
-
+    TRACE_BEGIN(FAST_ISR, 0);
+    display_stats.isr_count++;
 
     /*
      * take the data index semaphore so it can be updated with protection
@@ -392,19 +455,43 @@ static bool IRAM_ATTR fast_bg_cbs(gptimer_handle_t timer, const gptimer_alarm_ev
         led_bargraph_fast_index++;
         if(led_bargraph_fast_index >= EKG_NUM_SAMPLES)
             led_bargraph_fast_index = 0; // to the next data value
+
+        /*
+         * run the new sample through the multi-rate filter so each consumer
+         * below only sees samples at the rate it needs
+         */
+#if FAST_FILTER_ENABLE
+        filter_flags = fast_filter_process(ekg_data[led_bargraph_fast_index], &filter_out);
+#else
+        filter_out.full = filter_out.display = filter_out.publish = ekg_data[led_bargraph_fast_index];
+        filter_flags = FAST_FILTER_OUT_ALL;
+#endif
+        if(filter_flags & FAST_FILTER_OUT_DISPLAY)
+            led_bargraph_fast_value = filter_out.display;
         xSemaphoreGiveFromISR(bgf_Semaphore, pdFALSE);
 
-        delta = abs(last_disp_data - ekg_data[led_bargraph_fast_index]);
-        if(delta > DISPLAY_HOLD_DELTA)   {
-            last_disp_data = ekg_data[led_bargraph_fast_index];
-            xSemaphoreGiveFromISR(disphold_Semaphore, pdFALSE);
+#if FAST_STREAM_ENABLE
+        if(filter_flags & FAST_STREAM_SOURCE)
+            fast_stream_put_from_isr(fast_filter_value(&filter_out, FAST_STREAM_SOURCE), &high_task_awoken);
+#endif
+
+        /*
+         * only wake the display if the display rate value moved enough to matter
+         */
+        if(filter_flags & FAST_FILTER_OUT_DISPLAY)  {
+            delta = abs(last_disp_data - filter_out.display);
+            if(delta > DISPLAY_HOLD_DELTA)   {
+                last_disp_data = filter_out.display;
+                xSemaphoreGiveFromISR(disphold_Semaphore, pdFALSE);
+            }
+            else
+                xSemaphoreTakeFromISR(disphold_Semaphore, pdFALSE);
         }
-        else
-            xSemaphoreTakeFromISR(disphold_Semaphore, pdFALSE);
 
         gpio_set_level(GPIO_OUTPUT_IO_0, led_state);
     }
 
+    TRACE_END(FAST_ISR, 0);
     return (high_task_awoken == pdTRUE);
 }
 
@@ -425,7 +512,7 @@ void led_bargraph_fast_timer_init(void)  {
      *  provided INCLUDE_vTaskSuspend is set to 1 in FreeRTOSConfig.h)
      * use xSemaphoreGive(xSemaphore) to give
      */
-    bgf_Semaphore = xSemaphoreCreateBinary();
+    bgf_Semaphore = xSemaphoreCreateBinaryStatic(&bgf_Semaphore_buf);
 
     if( bgf_Semaphore != NULL )  {
         ESP_LOGI(TAG, "bargraph fast data index semaphore created successfully");
@@ -434,7 +521,7 @@ void led_bargraph_fast_timer_init(void)  {
     else
         ESP_LOGE(TAG, "bargraph fast data index semaphore create failed");
 
-    disphold_Semaphore = xSemaphoreCreateBinary();
+    disphold_Semaphore = xSemaphoreCreateBinaryStatic(&disphold_Semaphore_buf);
 
     if( disphold_Semaphore != NULL )  {
         ESP_LOGI(TAG, "display hold semaphore created successfully");
@@ -443,6 +530,11 @@ void led_bargraph_fast_timer_init(void)  {
     else
         ESP_LOGE(TAG, "display hold semaphore create failed");
 
+    /*
+     * reset the filter stages before the first sample arrives
+     */
+    fast_filter_init();
+
     /*
      * set up the timer
      */
@@ -481,7 +573,8 @@ void led_bargraph_fast_timer_init(void)  {
 
 
 /*
- * light a single pixel based on ekg_data[led_bargraph_fast_index] data.
+ * light a single pixel based on the display rate output of the fast filter
+ * (led_bargraph_fast_value, fed from ekg_data[led_bargraph_fast_index]).
  * the index is updated externally to simulate data acquisition.
  * (NOTE: no background led intensity is used in this simulation)
  * 
@@ -514,13 +607,14 @@ void led_bargraph_update_fast_display (void)  {
      * when available, copy the data value to a local variable for further processing
      */
     xSemaphoreTake(bgf_Semaphore, portMAX_DELAY);  // block waiting for the data index
-    value = ekg_data[led_bargraph_fast_index];  // save a little bit of indirection
+    value = led_bargraph_fast_value;  // display rate output of the fast filter
     xSemaphoreGive(bgf_Semaphore);
 
     /*
      * little instrumentation: start display update
      */
     gpio_set_level(GPIO_OUTPUT_IO_1, 1);
+    TRACE_BEGIN(DISPLAY_RENDER, 0);
 
     if(value <= 0)  value = 0; // haven't tested for negative numbers
 
@@ -534,9 +628,9 @@ void led_bargraph_update_fast_display (void)  {
     if(led_segment > led_bargraph_max)
         led_segment = led_bargraph_max;
 
-    top_on_pixel = led_segment / ((led_bargraph_max - led_bargraph_min)/NUM_LEDS);
+    top_on_pixel = led_segment / ((led_bargraph_max - led_bargraph_min)/BAR_LEDS);
     if(top_on_pixel < 0)  top_on_pixel = 0;
-    if(top_on_pixel >= NUM_LEDS)  top_on_pixel = NUM_LEDS - 1;
+    if(top_on_pixel >= BAR_LEDS)  top_on_pixel = BAR_LEDS - 1;
 
     /*
      * if the value has not changed enough, given the small number of neo_pixels,
@@ -544,22 +638,47 @@ void led_bargraph_update_fast_display (void)  {
      */
     if(top_on_pixel != cur_top_on_pixel)  { 
         cur_top_on_pixel = top_on_pixel;
+        strip_take();
         led_strip_clear(led_strip);
 
         led_strip_set_pixel(led_strip, top_on_pixel, led_bargraph_on_colors[top_on_pixel][LED_R], 
                     led_bargraph_on_colors[top_on_pixel][LED_G],
                     led_bargraph_on_colors[top_on_pixel][LED_B]);
 
-        led_strip_refresh(led_strip);
+        strip_refresh();
+        strip_give();
     }
+    else
+        display_stats.frames_skipped++;
     /*
      * little instrumentation: end display update
      */
+    TRACE_END(DISPLAY_RENDER, top_on_pixel);
     gpio_set_level(GPIO_OUTPUT_IO_1, 0);
 }
 
 // end of display mode functions
 
+/*
+ * turn the alarm segment on/off and send it to the strip right away
+ * (doesn't wait for the next display frame, so the latency from the alarm
+ * engine to the led is one strip refresh plus at most one frame in progress;
+ * the caller is never held up for more than DISPLAY_ALARM_WAIT_MS)
+ */
+void display_alarm_set(bool active)  {
+    strip_alarm = active;
+    if(led_strip == NULL)
+        return;  // display not up yet, applied on the first frame
+
+    if((strip_mutex != NULL) && (xSemaphoreTake(strip_mutex, pdMS_TO_TICKS(DISPLAY_ALARM_WAIT_MS)) != pdTRUE))  {
+        strip_alarm_pending = true;  // sent by whoever holds the strip
+        return;
+    }
+    strip_alarm_pending = false;
+    strip_refresh();
+    strip_give();
+}
+
 
 /*
  * configure_led()
@@ -582,6 +701,10 @@ void led_bargraph_update_fast_display (void)  {
 void configure_led(void)
 {
     ESP_LOGI(TAG, "Example configured to blink addressable LED!");
+    strip_mutex = xSemaphoreCreateMutexStatic(&strip_mutex_buf);
+    if(strip_mutex == NULL)
+        ESP_LOGE(TAG, "led strip mutex create failed");
+
     /* LED strip initialization with the GPIO and pixels number*/
     led_strip_config_t strip_config = {
         .strip_gpio_num = BLINK_GPIO,
@@ -627,3 +750,11 @@ void instru_gpio_init(void)  {
     //configure GPIO with the given settings
     gpio_config(&io_conf);
 }
+
+/*
+ * snapshot of the display counters (each is a single 32 bit word, a torn
+ * snapshot across them is fine for telemetry)
+ */
+void display_get_stats(display_stats_t *stats)  {
+    *stats = display_stats;
+}
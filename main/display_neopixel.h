@@ -27,8 +27,33 @@ enum Neo_pixel_disp_mode  {
  */
 #define DISPLAY_HOLD_DELTA 200
 
+/*
+ * FAST_WAVEFORM: the timer runs on a 1 uS clock, so this is also the sample period in uS
+ */
+#define FAST_BG_ALARM_COUNT 2000 // 2000 counts on 1 uS clock = 2 mS counts between samples
+
+
+/*
+ * alarm segment: the top of the strip is reserved for the local alarm indication
+ * (bar graph modes scale to the leds below it)
+ */
+#define DISPLAY_NUM_LEDS 20  // leds in the strip
+#define DISPLAY_ALARM_LEDS 1
+#define DISPLAY_ALARM_LED_FIRST (DISPLAY_NUM_LEDS - DISPLAY_ALARM_LEDS)
+#define DISPLAY_ALARM_COLOR 64, 0, 0  // r, g, b
+#define DISPLAY_ALARM_WAIT_MS 5  // longest display_alarm_set() waits for the strip
+
+/*
+ * counters for telemetry
+ */
+typedef struct {
+    uint32_t isr_count;       // fast acquisition timer interrupts
+    uint32_t frames_sent;     // frames sent to the strip
+    uint32_t frames_skipped;  // fast display updates that didn't change the strip
+} display_stats_t;
 
 void configure_led(void);  // called once to initialize the led_strip
+void display_alarm_set(bool active);  // turn the alarm segment on/off immediately
 
 void display_neopixel_update(uint8_t display_neopixel_mode, int32_t value);  // call the appropriate update function based on mode
 
@@ -56,6 +81,7 @@ int32_t led_bargraph_map(float value, float min_value, float max_value);
 #define GPIO_OUTPUT_IO_1    19
 #define GPIO_OUTPUT_PIN_SEL  ((1ULL<<GPIO_OUTPUT_IO_0) | (1ULL<<GPIO_OUTPUT_IO_1))
 void instru_gpio_init(void);
+void display_get_stats(display_stats_t *stats);
 
 
 #define __DISPLAY_NEOPIXEL_H__
@@ -0,0 +1,192 @@
+/*
+ * dlog.c
+ *
+ * deferred log ring and the task that formats it (see dlog.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "dlog.h"
+#include "app_tasks.h"
+
+static const char *TAG = "dlog";  // for logging
+
+#define DLOG_RING_MASK (DLOG_RING_LEN - 1)
+#define DLOG_SPEC_LEN 12  // flags, width and precision of one conversion, e.g. "%-08.3"
+
+static dlog_rec_t ring[DLOG_RING_LEN];
+static uint32_t ring_head = 0;  // written by the loggers (under ring_lock)
+static uint32_t ring_tail = 0;  // written by the dlog task
+static uint32_t dropped = 0;    // lines lost to a full ring
+static portMUX_TYPE ring_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t dlog_task_handle = NULL;
+
+/*
+ * store one line: no formatting, just a copy under a short critical section
+ */
+void dlog_write(uint8_t level, const char *tag, const char *fmt, int nargs, const dlog_arg_t *args)  {
+    dlog_rec_t *r;
+    uint32_t ms = esp_log_timestamp();
+
+    if(nargs > DLOG_ARGS_MAX)
+        nargs = DLOG_ARGS_MAX;
+
+    taskENTER_CRITICAL(&ring_lock);
+    if((ring_head - ring_tail) >= DLOG_RING_LEN)  {
+        dropped++;
+        taskEXIT_CRITICAL(&ring_lock);
+        return;
+    }
+    r = &ring[ring_head & DLOG_RING_MASK];
+    r->tag = tag;
+    r->fmt = fmt;
+    r->ms = ms;
+    r->level = level;
+    r->nargs = (uint8_t)nargs;
+    memcpy(r->args, args, nargs * sizeof(dlog_arg_t));
+    ring_head++;
+    taskEXIT_CRITICAL(&ring_lock);
+}
+
+/*
+ * lines lost so far because the ring was full
+ */
+uint32_t dlog_dropped(void)  {
+    return(dropped);
+}
+
+/*
+ * format one stored argument.  spec is "%[flags][width][.precision]" (without the
+ * caller's length modifier); the length used is chosen here to match the slot
+ */
+static int format_arg(char *out, size_t size, const char *spec, char conv, bool wide, const dlog_arg_t *a)  {
+    char f[DLOG_SPEC_LEN + 4];
+
+    switch(conv)  {
+    case 'd': case 'i':
+        snprintf(f, sizeof(f), "%sll%c", spec, conv);
+        return(snprintf(out, size, f, wide ? (long long)a->i : (long long)(int32_t)a->i));
+    case 'u': case 'x': case 'X': case 'o':
+        snprintf(f, sizeof(f), "%sll%c", spec, conv);
+        return(snprintf(out, size, f, wide ? (unsigned long long)a->i : (unsigned long long)(uint32_t)a->i));
+    case 'c':
+        snprintf(f, sizeof(f), "%sc", spec);
+        return(snprintf(out, size, f, (int)a->i));
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        snprintf(f, sizeof(f), "%s%c", spec, conv);
+        return(snprintf(out, size, f, a->d));
+    case 's':
+        snprintf(f, sizeof(f), "%ss", spec);
+        return(snprintf(out, size, f, (a->p != NULL) ? (const char *)a->p : "(null)"));
+    case 'p':
+        return(snprintf(out, size, "%p", a->p));
+    default:
+        return(snprintf(out, size, "?"));
+    }
+}
+
+/*
+ * printf a stored line: walk the format, copying text and formatting each
+ * conversion with the next stored argument
+ */
+static void format_rec(const dlog_rec_t *r, char *out, size_t size)  {
+    const char *p = r->fmt;
+    char spec[DLOG_SPEC_LEN];
+    size_t n = 0, spec_len;
+    int arg = 0, len;
+    bool wide;
+
+    while((*p != '\0') && (n < (size - 1)))  {
+        if(*p != '%')  {
+            out[n++] = *p++;
+            continue;
+        }
+        if(p[1] == '%')  {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+
+        /*
+         * %[flags][width][.precision][length]conv: keep all but the length
+         */
+        spec_len = 0;
+        spec[spec_len++] = *p++;
+        while((*p != '\0') && strchr("-+ #0123456789.", *p))  {
+            if(spec_len < (sizeof(spec) - 1))
+                spec[spec_len++] = *p;
+            p++;
+        }
+        spec[spec_len] = '\0';
+        wide = false;
+        while((*p != '\0') && strchr("hlLqjzt", *p))  {
+            if((*p == 'j') || (*p == 'q') || ((*p == 'l') && (p[1] == 'l')))
+                wide = true;
+            p++;
+        }
+        if(*p == '\0')
+            break;
+
+        if(arg < r->nargs)
+            len = format_arg(&out[n], size - n, spec, *p, wide, &r->args[arg++]);
+        else
+            len = snprintf(&out[n], size - n, "?");
+        if(len > 0)
+            n += ((size_t)len < (size - n)) ? (size_t)len : (size - n - 1);
+        p++;
+    }
+    out[n] = '\0';
+}
+
+static char level_char(uint8_t level)  {
+    switch(level)  {
+    case ESP_LOG_ERROR:   return('E');
+    case ESP_LOG_WARN:    return('W');
+    case ESP_LOG_INFO:    return('I');
+    case ESP_LOG_DEBUG:   return('D');
+    default:              return('V');
+    }
+}
+
+/*
+ * drain the ring every DLOG_FLUSH_MS, at idle priority so the formatting only
+ * uses time nobody else wants
+ */
+static void dlog_task(void *pvParameters)  {
+    static char line[DLOG_LINE_LEN];
+    dlog_rec_t r;
+    uint32_t reported = 0, lost;
+
+    while(1)  {
+        while(__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != ring_tail)  {
+            r = ring[ring_tail & DLOG_RING_MASK];
+            __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+
+            format_rec(&r, line, sizeof(line));
+            printf("%c (%" PRIu32 ") %s: %s\n", level_char(r.level), r.ms, r.tag, line);
+
+            lost = dropped;
+            if(lost != reported)  {
+                printf("W (%" PRIu32 ") %s: %" PRIu32 " deferred log lines dropped (ring full)\n", r.ms, TAG, lost - reported);
+                reported = lost;
+            }
+        }
+        vTaskDelay(DLOG_FLUSH_MS / portTICK_PERIOD_MS);
+    }
+}
+
+/*
+ * start the dlog task (lines logged before this just wait in the ring)
+ */
+void dlog_init(void)  {
+    if(!DLOG_DEFERRED || (dlog_task_handle != NULL))
+        return;
+    dlog_task_handle = app_task_create(APP_TASK_DLOG, dlog_task, NULL);
+    ESP_LOGI(TAG, "deferred logging %s (%d lines buffered)", DLOG_DEFERRED ? "on" : "off", DLOG_RING_LEN);
+}
@@ -0,0 +1,108 @@
+/*
+ * dlog.h
+ *
+ * deferred logging: takes the printf formatting and the uart wait off the hot paths.
+ *
+ * DLOGI()/DLOGD() take the same arguments as ESP_LOGI()/ESP_LOGD().  with DLOG_DEFERRED
+ * (monitoring_zimknives.h) set, the call only stores the format string pointer (which
+ * identifies the message), the log time and the raw arguments into a ring; the dlog
+ * task, at idle priority, formats and prints them later as a normal log line stamped
+ * with the original time.  with DLOG_DEFERRED clear they are just ESP_LOGx().
+ *
+ * because the arguments are formatted later:
+ *   - at most DLOG_ARGS_MAX arguments, each an integer, float/double or pointer
+ *   - a %s argument must still be valid when the line is printed: a literal or a
+ *     string from a static table (e.g. sensors[i].label), never a stack buffer
+ *   - only task context (the fast isr has the tracer, see trace.h)
+ * if the ring is full the new line is dropped and counted; the task reports the
+ * count with the next line it prints.
+ */
+
+#ifndef __DLOG_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"  // for types (at least)
+#include "esp_log.h"
+
+#include "monitoring_zimknives.h"
+
+#define DLOG_RING_LEN 64       // lines waiting to be formatted (power of 2)
+#define DLOG_ARGS_MAX 6
+#define DLOG_LINE_LEN 160      // formatted message (longer is truncated)
+#define DLOG_FLUSH_MS 100      // how often the dlog task drains the ring
+
+typedef union {
+    int64_t i;
+    double d;
+    const void *p;
+} dlog_arg_t;
+
+typedef struct {
+    const char *tag;
+    const char *fmt;        // the message id: formatted by the dlog task
+    uint32_t ms;            // esp_log_timestamp() when logged
+    uint8_t level;          // esp_log_level_t
+    uint8_t nargs;
+    dlog_arg_t args[DLOG_ARGS_MAX];
+} dlog_rec_t;
+
+void dlog_init(void);
+void dlog_write(uint8_t level, const char *tag, const char *fmt, int nargs, const dlog_arg_t *args);
+uint32_t dlog_dropped(void);
+
+static inline dlog_arg_t dlog_arg_i(int64_t v)  { dlog_arg_t a = { .i = v };  return(a); }
+static inline dlog_arg_t dlog_arg_d(double v)   { dlog_arg_t a = { .d = v };  return(a); }
+static inline dlog_arg_t dlog_arg_p(const void *v)  { dlog_arg_t a = { .p = v };  return(a); }
+
+/*
+ * store one argument in a slot according to its type (anything else is an integer)
+ */
+#define DLOG_ARG(x) _Generic((x),   \
+    float: dlog_arg_d,              \
+    double: dlog_arg_d,             \
+    char *: dlog_arg_p,             \
+    const char *: dlog_arg_p,       \
+    void *: dlog_arg_p,             \
+    const void *: dlog_arg_p,       \
+    default: dlog_arg_i)(x)
+
+#define DLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+#define DLOG_NARGS(...) DLOG_NARGS_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define DLOG_MAP_0()
+#define DLOG_MAP_1(a)                DLOG_ARG(a)
+#define DLOG_MAP_2(a, b)             DLOG_ARG(a), DLOG_ARG(b)
+#define DLOG_MAP_3(a, b, c)          DLOG_ARG(a), DLOG_ARG(b), DLOG_ARG(c)
+#define DLOG_MAP_4(a, b, c, d)       DLOG_ARG(a), DLOG_ARG(b), DLOG_ARG(c), DLOG_ARG(d)
+#define DLOG_MAP_5(a, b, c, d, e)    DLOG_ARG(a), DLOG_ARG(b), DLOG_ARG(c), DLOG_ARG(d), DLOG_ARG(e)
+#define DLOG_MAP_6(a, b, c, d, e, f) DLOG_ARG(a), DLOG_ARG(b), DLOG_ARG(c), DLOG_ARG(d), DLOG_ARG(e), DLOG_ARG(f)
+#define DLOG_MAP__(n, ...) DLOG_MAP_##n(__VA_ARGS__)
+#define DLOG_MAP_(n, ...) DLOG_MAP__(n, ##__VA_ARGS__)
+
+/*
+ * never called: the if(0) call lets the compiler check the arguments against the
+ * format (-Wformat) as it would for ESP_LOGx(), without evaluating them twice
+ */
+static inline void __attribute__((format(printf, 1, 2))) dlog_check_format(const char *fmt, ...)  { }
+
+/*
+ * the leading slot only keeps the initializer valid with no arguments
+ */
+#define DLOG_WRITE(level, tag, fmt, ...)                                                    \
+    do {                                                                                    \
+        if(0)                                                                               \
+            dlog_check_format(fmt, ##__VA_ARGS__);                                          \
+        dlog_write((level), (tag), (fmt), DLOG_NARGS(__VA_ARGS__),                          \
+                   &((const dlog_arg_t []){ dlog_arg_i(0), DLOG_MAP_(DLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__) })[1]); \
+    } while(0)
+
+#if DLOG_DEFERRED
+#define DLOGI(tag, fmt, ...) DLOG_WRITE(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define DLOGD(tag, fmt, ...) do { if(LOG_LOCAL_LEVEL >= ESP_LOG_DEBUG) DLOG_WRITE(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__); } while(0)
+#else
+#define DLOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#define DLOGD(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+#endif
+
+#define __DLOG_H__
+#endif
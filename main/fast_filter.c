@@ -0,0 +1,153 @@
+/*
+ * fast_filter.c
+ *
+ * multi-rate filter stage for the fast acquisition path (see fast_filter.h)
+ *
+ * NOTE: the fir is written as int16 x int16 -> int32 multiply/accumulates over a
+ * contiguous window (doubled delay line, no modulo in the loop), which is the form
+ * the xtensa compiler maps onto its 16 bit multiply (MUL16S/MULL) instructions.
+ * the taps are symmetric, so the pairs are added first and only half the
+ * multiplies are done.
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+
+#include "fast_filter.h"
+
+/*
+ * cic droop compensating low pass, Q15, symmetric (sums to 32768 for unity dc gain)
+ * only the first half (plus the center) is stored
+ */
+#define FIR_HALF ((FAST_FILTER_FIR_TAPS + 1) / 2)
+static const DRAM_ATTR int16_t fir_coef[FIR_HALF] = { -1101, -3887, 10243, 22258 };
+
+/*
+ * one cic + fir decimation stage
+ * the cic arithmetic is done unsigned so the integrator wrap around is well defined
+ * (it always unwinds in the combs as long as the register is wider than the output growth)
+ */
+typedef struct {
+    uint32_t integ[FAST_FILTER_CIC_ORDER];
+    uint32_t comb[FAST_FILTER_CIC_ORDER];   // previous comb inputs
+    uint8_t log2_r;                         // decimation is 2^this
+    uint8_t phase;                          // input count within the current output period
+    int16_t delay[2 * FAST_FILTER_FIR_TAPS]; // doubled so the fir window is always contiguous
+    uint8_t delay_idx;
+} fast_decimator_t;
+
+static DRAM_ATTR fast_decimator_t display_stage;
+static DRAM_ATTR fast_decimator_t publish_stage;
+
+static void decimator_init(fast_decimator_t *d, uint8_t log2_r)  {
+    memset(d, 0, sizeof(*d));
+    d->log2_r = log2_r;
+}
+
+static inline int16_t IRAM_ATTR saturate16(int32_t v)  {
+    if(v > INT16_MAX)  return(INT16_MAX);
+    if(v < INT16_MIN)  return(INT16_MIN);
+    return((int16_t)v);
+}
+
+/*
+ * push one sample through the stage
+ * returns true (and the output in *out) once every 2^log2_r inputs
+ */
+static bool IRAM_ATTR decimate(fast_decimator_t *d, int16_t in, int16_t *out)  {
+    uint32_t v = (uint32_t)(int32_t)in;
+    int32_t acc;
+    const int16_t *w;
+
+    for(uint8_t i = 0; i < FAST_FILTER_CIC_ORDER; i++)  {
+        d->integ[i] += v;
+        v = d->integ[i];
+    }
+
+    if(++d->phase < (1 << d->log2_r))
+        return(false);
+    d->phase = 0;
+
+    for(uint8_t i = 0; i < FAST_FILTER_CIC_ORDER; i++)  {
+        uint32_t c = v - d->comb[i];
+        d->comb[i] = v;
+        v = c;
+    }
+
+    /*
+     * cic gain is R^N, a power of 2 here, so normalize with a shift
+     */
+    int16_t cic_out = saturate16((int32_t)v >> (FAST_FILTER_CIC_ORDER * d->log2_r));
+
+    /*
+     * compensating fir on the decimated stream
+     */
+    d->delay_idx = (d->delay_idx == 0) ? (FAST_FILTER_FIR_TAPS - 1) : (d->delay_idx - 1);
+    d->delay[d->delay_idx] = cic_out;
+    d->delay[d->delay_idx + FAST_FILTER_FIR_TAPS] = cic_out;
+    w = &d->delay[d->delay_idx];  // w[0] newest ... w[TAPS-1] oldest
+
+    acc = (int32_t)fir_coef[FIR_HALF - 1] * w[FIR_HALF - 1];
+    for(uint8_t k = 0; k < (FIR_HALF - 1); k++)
+        acc += (int32_t)fir_coef[k] * ((int32_t)w[k] + w[FAST_FILTER_FIR_TAPS - 1 - k]);
+
+    *out = saturate16((acc + (1 << 14)) >> 15);
+    return(true);
+}
+
+/*
+ * reset all of the stages
+ * (call before the fast timer is started)
+ */
+void fast_filter_init(void)  {
+    decimator_init(&display_stage, FAST_FILTER_DISPLAY_DECIM_LOG2);
+    decimator_init(&publish_stage, FAST_FILTER_PUBLISH_DECIM_LOG2);
+}
+
+/*
+ * run one full rate input sample through the filter stages
+ * returns FAST_FILTER_OUT_* flags for the outputs updated in *out
+ * (safe to call from the fast isr)
+ */
+uint8_t IRAM_ATTR fast_filter_process(int16_t in, fast_filter_out_t *out)  {
+    uint8_t produced = FAST_FILTER_OUT_FULL;
+
+    out->full = in;
+    if(decimate(&display_stage, in, &out->display))  {
+        produced |= FAST_FILTER_OUT_DISPLAY;
+        if(decimate(&publish_stage, out->display, &out->publish))
+            produced |= FAST_FILTER_OUT_PUBLISH;
+    }
+    return(produced);
+}
+
+/*
+ * pick one output by its FAST_FILTER_OUT_* flag
+ */
+int16_t IRAM_ATTR fast_filter_value(const fast_filter_out_t *out, uint8_t which)  {
+    switch(which)  {
+        case FAST_FILTER_OUT_DISPLAY:
+            return(out->display);
+        case FAST_FILTER_OUT_PUBLISH:
+            return(out->publish);
+        default:
+            return(out->full);
+    }
+}
+
+/*
+ * decimation of an output relative to the input rate
+ * (e.g. to compute the output sample period)
+ */
+uint32_t fast_filter_decimation(uint8_t which)  {
+    switch(which)  {
+        case FAST_FILTER_OUT_DISPLAY:
+            return(FAST_FILTER_DISPLAY_DECIM);
+        case FAST_FILTER_OUT_PUBLISH:
+            return(FAST_FILTER_DISPLAY_DECIM * FAST_FILTER_PUBLISH_DECIM);
+        default:
+            return(1);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * fast_filter.h
+ *
+ * multi-rate filter stage for the fast acquisition path
+ *
+ * one full rate input produces three outputs, so each consumer only touches
+ * samples at the rate it needs:
+ *   full     every input sample, unfiltered
+ *   display  decimated by FAST_FILTER_DISPLAY_DECIM (cic + compensating fir)
+ *   publish  display rate decimated again by FAST_FILTER_PUBLISH_DECIM
+ *
+ * everything is fixed point (integer cic, Q15 fir) so it can run inside the
+ * fast timer isr: no fpu context to save and no floating point in an isr.
+ * the cic integrators run at the input rate (FAST_FILTER_CIC_ORDER adds per sample),
+ * the combs and the fir only run at the decimated rate.
+ */
+
+#ifndef __FAST_FILTER_H__
+
+#include "esp_system.h"  // for types (at least)
+
+/*
+ * the compensator taps in fast_filter.c were designed for a 3rd order cic
+ * decimating by 4 (pass band to 0.2 of the output rate, +/- 8%).
+ * retune them if these are changed.
+ */
+#define FAST_FILTER_CIC_ORDER 3
+#define FAST_FILTER_DISPLAY_DECIM_LOG2 2  // full -> display decimation is 2^this
+#define FAST_FILTER_PUBLISH_DECIM_LOG2 2  // display -> publish decimation is 2^this
+#define FAST_FILTER_DISPLAY_DECIM (1 << FAST_FILTER_DISPLAY_DECIM_LOG2)
+#define FAST_FILTER_PUBLISH_DECIM (1 << FAST_FILTER_PUBLISH_DECIM_LOG2)
+#define FAST_FILTER_FIR_TAPS 7
+
+/*
+ * which outputs were produced by fast_filter_process() (or'd together)
+ */
+#define FAST_FILTER_OUT_FULL    0x01
+#define FAST_FILTER_OUT_DISPLAY 0x02
+#define FAST_FILTER_OUT_PUBLISH 0x04
+#define FAST_FILTER_OUT_ALL     (FAST_FILTER_OUT_FULL | FAST_FILTER_OUT_DISPLAY | FAST_FILTER_OUT_PUBLISH)
+
+typedef struct {
+    int16_t full;
+    int16_t display;  // valid when FAST_FILTER_OUT_DISPLAY is returned
+    int16_t publish;  // valid when FAST_FILTER_OUT_PUBLISH is returned
+} fast_filter_out_t;
+
+void fast_filter_init(void);
+uint8_t fast_filter_process(int16_t in, fast_filter_out_t *out);
+int16_t fast_filter_value(const fast_filter_out_t *out, uint8_t which);
+uint32_t fast_filter_decimation(uint8_t which);
+
+#define __FAST_FILTER_H__
+#endif
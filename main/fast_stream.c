@@ -0,0 +1,338 @@
+/*
+ * fast_stream.c
+ *
+ * compressed binary streaming of the fast acquisition path over mqtt
+ * (see fast_stream.h for the block format)
+ *
+ * the isr side is a single producer/single consumer ring: the isr only moves
+ * ring_head, the task only moves ring_tail, so no locking is needed.  the task
+ * always consumes whole blocks, and since the ring is a whole number of blocks,
+ * each block is contiguous in the ring and is encoded in place.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt_local.h"
+#include "mqtt_pub.h"
+#include "fast_stream.h"
+#include "trace.h"
+#include "dlog.h"
+
+static const char *TAG = "fast_stream";  // for logging
+
+/*
+ * isr -> task ring
+ */
+static int16_t ring[FAST_STREAM_RING_SIZE];
+static int64_t ring_block_time[FAST_STREAM_RING_BLOCKS];  // timestamp of the first sample of each block slot
+static uint32_t ring_block_index[FAST_STREAM_RING_BLOCKS]; // and its index among all samples produced (lost ones included)
+static volatile uint32_t ring_head = 0;  // total samples written (isr only)
+static volatile uint32_t ring_tail = 0;  // total samples consumed (task only)
+static volatile uint32_t samples_lost = 0;
+static TaskHandle_t stream_task_handle = NULL;
+
+static uint32_t stream_period_us = 0;
+static uint32_t stream_seq = 0;
+static uint8_t block_buf[FAST_STREAM_MAX_BLOCK_SIZE];  // static so it isn't on the task stack
+static fast_stream_stats_t stream_stats = {0};
+
+/*
+ * remember the sample period for the block headers
+ * call before the fast timer is started
+ */
+void fast_stream_init(uint32_t sample_period_us)  {
+    stream_period_us = sample_period_us;
+    ring_head = 0;
+    ring_tail = 0;
+    samples_lost = 0;
+    stream_seq = 0;
+    memset(&stream_stats, 0, sizeof(stream_stats));
+}
+
+/*
+ * called from the fast acquisition isr for each new sample
+ * wakes fast_stream_task() each time a full block is available
+ *
+ * the ring is only full when the head is a whole number of blocks ahead of the
+ * (block aligned) tail, so samples are only ever lost between blocks: the next block
+ * records its index counting them, and the decoder sees the loss as a gap
+ */
+void IRAM_ATTR fast_stream_put_from_isr(int16_t sample, BaseType_t *high_task_awoken)  {
+    uint32_t head = ring_head;
+
+    if((head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) >= FAST_STREAM_RING_SIZE)  {
+        samples_lost++;  // task is behind; drop the newest sample
+        return;
+    }
+
+    if((head % FAST_STREAM_BLOCK_SAMPLES) == 0)  {
+        ring_block_time[(head / FAST_STREAM_BLOCK_SAMPLES) % FAST_STREAM_RING_BLOCKS] = esp_timer_get_time();
+        ring_block_index[(head / FAST_STREAM_BLOCK_SAMPLES) % FAST_STREAM_RING_BLOCKS] = head + samples_lost;
+    }
+
+    ring[head % FAST_STREAM_RING_SIZE] = sample;
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+    if((((head + 1) % FAST_STREAM_BLOCK_SAMPLES) == 0) && (stream_task_handle != NULL))
+        vTaskNotifyGiveFromISR(stream_task_handle, high_task_awoken);
+}
+
+/*
+ * little endian field helpers
+ */
+static uint8_t *put_le16(uint8_t *p, uint16_t v)  {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return(p + 2);
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v)  {
+    p = put_le16(p, v & 0xffff);
+    return(put_le16(p, v >> 16));
+}
+
+static uint8_t *put_le64(uint8_t *p, uint64_t v)  {
+    p = put_le32(p, v & 0xffffffff);
+    return(put_le32(p, v >> 32));
+}
+
+static inline uint32_t zigzag(int32_t d)  {
+    return((uint32_t)((d << 1) ^ (d >> 31)));
+}
+
+/*
+ * msb first bit packer for the rice coder
+ * (never more than 31 bits pending, so nbits per call must be <= 24)
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t pos;
+    uint32_t acc;
+    uint8_t nbits;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *bw, uint32_t value, uint8_t nbits)  {
+    bw->acc = (bw->acc << nbits) | (value & ((1UL << nbits) - 1));
+    bw->nbits += nbits;
+    while(bw->nbits >= 8)  {
+        bw->nbits -= 8;
+        bw->buf[bw->pos++] = (uint8_t)(bw->acc >> bw->nbits);
+    }
+}
+
+static void flush_bits(bit_writer_t *bw)  {
+    if(bw->nbits > 0)
+        bw->buf[bw->pos++] = (uint8_t)(bw->acc << (8 - bw->nbits));
+    bw->nbits = 0;
+}
+
+static uint32_t rice_bits(uint32_t zz, uint8_t k)  {
+    uint32_t q = zz >> k;
+    return((q < FAST_STREAM_RICE_ESCAPE) ? (q + 1 + k) : (FAST_STREAM_RICE_ESCAPE + FAST_STREAM_ZZ_BITS));
+}
+
+static uint32_t varint_bytes(uint32_t zz)  {
+    return((zz < 0x80) ? 1 : ((zz < 0x4000) ? 2 : 3));
+}
+
+/*
+ * zigzag residuals of a first order (delta) or second order (delta of delta) predictor.
+ * the first residual is always a plain delta so the decoder can prime the predictor.
+ */
+static void predict(const int16_t *samples, uint16_t count, uint8_t order, uint32_t *zz)  {
+    zz[0] = zigzag((int32_t)samples[1] - (int32_t)samples[0]);
+    for(uint16_t i = 2; i < count; i++)  {
+        if(order == 1)
+            zz[i - 1] = zigzag((int32_t)samples[i] - (int32_t)samples[i - 1]);
+        else
+            zz[i - 1] = zigzag((int32_t)samples[i] - (2 * (int32_t)samples[i - 1]) + (int32_t)samples[i - 2]);
+    }
+}
+
+/*
+ * size in bits of the partitioned rice coding of n residuals.
+ * if k is not NULL, the best k for each partition is stored there.
+ */
+static uint32_t rice_size(const uint32_t *zz, uint16_t n, uint8_t *k)  {
+    uint32_t total = 0;
+    uint32_t part[FAST_STREAM_RICE_K_MAX + 1];
+    uint8_t best_k;
+
+    for(uint16_t start = 0; start < n; start += FAST_STREAM_RICE_PARTITION)  {
+        memset(part, 0, sizeof(part));
+        for(uint16_t i = start; (i < n) && (i < start + FAST_STREAM_RICE_PARTITION); i++)
+            for(uint8_t kk = 0; kk <= FAST_STREAM_RICE_K_MAX; kk++)
+                part[kk] += rice_bits(zz[i], kk);
+
+        best_k = 0;
+        for(uint8_t kk = 1; kk <= FAST_STREAM_RICE_K_MAX; kk++)
+            if(part[kk] < part[best_k])
+                best_k = kk;
+
+        total += part[best_k] + FAST_STREAM_RICE_K_BITS;
+        if(k != NULL)
+            k[start / FAST_STREAM_RICE_PARTITION] = best_k;
+    }
+    return(total);
+}
+
+/*
+ * encode count samples into out (at least FAST_STREAM_MAX_BLOCK_SIZE bytes)
+ * returns the number of bytes used
+ *
+ * the size of each predictor/coding combination is computed first (cheap compared
+ * to the mqtt send) so only the winner is actually written.
+ */
+static uint32_t zz_buf[2][FAST_STREAM_BLOCK_SAMPLES];  // residuals for predictor order 1 and 2
+static uint8_t k_buf[(FAST_STREAM_BLOCK_SAMPLES / FAST_STREAM_RICE_PARTITION) + 1];
+
+size_t fast_stream_encode_block(const int16_t *samples, uint16_t count, uint32_t seq,
+                                uint32_t first_index, int64_t timestamp_us, uint8_t *out)  {
+    uint16_t n = count - 1;  // number of residuals
+    uint32_t size, best_size = UINT32_MAX;
+    uint8_t best_order = 1, best_coding = FAST_STREAM_ENC_VARINT;
+    uint8_t *p = out;
+    uint32_t *zz;
+
+    if((count == 0) || (count > FAST_STREAM_BLOCK_SAMPLES))
+        return(0);
+
+    *p++ = FAST_STREAM_VERSION;
+    p++;  // encoding, filled in below
+    p = put_le32(p, seq);
+    p = put_le32(p, first_index);
+    p = put_le64(p, (uint64_t)timestamp_us);
+    p = put_le16(p, (uint16_t)stream_period_us);
+    p = put_le16(p, count);
+    p = put_le16(p, (uint16_t)samples[0]);
+
+    if(count == 1)  {
+        out[1] = FAST_STREAM_ENC_VARINT | (1 << 4);
+        return(p - out);
+    }
+
+    /*
+     * pick the predictor order and coding (size in bytes)
+     */
+    for(uint8_t order = 1; order <= 2; order++)  {
+        zz = zz_buf[order - 1];
+        predict(samples, count, order, zz);
+
+        size = 0;
+        for(uint16_t i = 0; i < n; i++)
+            size += varint_bytes(zz[i]);
+        if(size < best_size)  {
+            best_size = size;
+            best_order = order;
+            best_coding = FAST_STREAM_ENC_VARINT;
+        }
+
+        size = (rice_size(zz, n, NULL) + 7) / 8;
+        if(size < best_size)  {
+            best_size = size;
+            best_order = order;
+            best_coding = FAST_STREAM_ENC_RICE;
+        }
+    }
+
+    out[1] = best_coding | (best_order << 4);
+    zz = zz_buf[best_order - 1];
+
+    if(best_coding == FAST_STREAM_ENC_RICE)  {
+        bit_writer_t bw = { .buf = p, .pos = 0, .acc = 0, .nbits = 0 };
+        uint8_t k = 0;
+
+        rice_size(zz, n, k_buf);
+        for(uint16_t i = 0; i < n; i++)  {
+            if((i % FAST_STREAM_RICE_PARTITION) == 0)  {
+                k = k_buf[i / FAST_STREAM_RICE_PARTITION];
+                put_bits(&bw, k, FAST_STREAM_RICE_K_BITS);
+            }
+            uint32_t q = zz[i] >> k;
+            if(q < FAST_STREAM_RICE_ESCAPE)  {
+                put_bits(&bw, ((1UL << q) - 1) << 1, q + 1);  // q 1's and the terminating 0
+                put_bits(&bw, zz[i], k);
+            }
+            else  {
+                put_bits(&bw, (1UL << FAST_STREAM_RICE_ESCAPE) - 1, FAST_STREAM_RICE_ESCAPE);
+                put_bits(&bw, zz[i], FAST_STREAM_ZZ_BITS);
+            }
+        }
+        flush_bits(&bw);
+        p += bw.pos;
+    }
+    else  {
+        for(uint16_t i = 0; i < n; i++)  {
+            uint32_t v = zz[i];
+            while(v >= 0x80)  {
+                *p++ = (uint8_t)(v | 0x80);
+                v >>= 7;
+            }
+            *p++ = (uint8_t)v;
+        }
+    }
+
+    return(p - out);
+}
+
+/*
+ * copy out the running statistics
+ */
+void fast_stream_get_stats(fast_stream_stats_t *stats)  {
+    *stats = stream_stats;
+    stats->samples_lost = samples_lost;
+}
+
+/*
+ * wait for the isr to fill a block, encode it and publish it.
+ * if the broker isn't connected the block is dropped (it's a live stream,
+ * QoS 0, and there is no room to hold it anyway)
+ */
+void fast_stream_task(void *pvParameters)  {
+    uint32_t tail;
+    size_t len;
+    int msg_id;
+
+    stream_task_handle = xTaskGetCurrentTaskHandle();
+    ESP_LOGI(TAG, "fast_stream_task(): streaming to %s, %d samples/block", FAST_STREAM_TOPIC, FAST_STREAM_BLOCK_SAMPLES);
+
+    while(1)  {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        tail = ring_tail;
+        while((__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) - tail) >= FAST_STREAM_BLOCK_SAMPLES)  {
+            TRACE_BEGIN(STREAM_BLOCK, 0);
+            len = fast_stream_encode_block(&ring[tail % FAST_STREAM_RING_SIZE], FAST_STREAM_BLOCK_SAMPLES,
+                                           stream_seq++,
+                                           ring_block_index[(tail / FAST_STREAM_BLOCK_SAMPLES) % FAST_STREAM_RING_BLOCKS],
+                                           ring_block_time[(tail / FAST_STREAM_BLOCK_SAMPLES) % FAST_STREAM_RING_BLOCKS],
+                                           block_buf);
+            TRACE_END(STREAM_BLOCK, len);
+            tail += FAST_STREAM_BLOCK_SAMPLES;
+            __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);  // block is encoded, give the slot back
+
+            if(mqtt_is_connected())  {
+                msg_id = mqtt_pub_send_now(FAST_STREAM_TOPIC, (const char *)block_buf, len, FAST_STREAM_QOS, 0);
+                if(msg_id < 0)
+                    stream_stats.blocks_dropped++;
+                else  {
+                    stream_stats.blocks_sent++;
+                    stream_stats.raw_bytes += FAST_STREAM_BLOCK_SAMPLES * sizeof(int16_t);
+                    stream_stats.encoded_bytes += len;
+                }
+            }
+            else
+                stream_stats.blocks_dropped++;
+
+            if((stream_seq % FAST_STREAM_STATS_BLOCKS) == 0)
+                DLOGI(TAG, "sent %" PRIu32 " dropped %" PRIu32 " lost samples %" PRIu32 " ratio %.2f (last block %d bytes)",
+                         stream_stats.blocks_sent, stream_stats.blocks_dropped, samples_lost,
+                         (stream_stats.encoded_bytes > 0) ? ((float)stream_stats.raw_bytes / (float)stream_stats.encoded_bytes) : 0.0f,
+                         (int)len);
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * fast_stream.h
+ *
+ * compressed binary streaming of the fast acquisition path (e.g. the simulated
+ * ekg waveform) over mqtt.
+ *
+ * the fast isr pushes each sample into a lock free ring with fast_stream_put_from_isr().
+ * fast_stream_task() pulls the samples out a block at a time, delta encodes them
+ * (first order, or second order for smooth ramps), zigzag maps the residuals (so small
+ * negative numbers stay small) and packs them with either a varint or rice code.
+ * whichever predictor/coding pair is smallest for that block is used.
+ * the block is then published as a binary payload on FAST_STREAM_TOPIC at QoS 0.
+ *
+ * block format (all multi-byte fields little endian):
+ *   offset  size  field
+ *   0       1     version (FAST_STREAM_VERSION)
+ *   1       1     encoding: low nibble FAST_STREAM_ENC_VARINT or FAST_STREAM_ENC_RICE,
+ *                 high nibble predictor order (1: x[i]-x[i-1], 2: x[i]-2x[i-1]+x[i-2])
+ *   2       4     block sequence number (increments by one per block produced)
+ *   6       4     index of the first sample among all the isr produced since start.
+ *                 samples the isr couldn't store (ring full) are counted, so a gap
+ *                 between blocks (first_index != previous first_index + count) is
+ *                 the number of samples lost there; a sequence gap is a block lost
+ *                 on the way
+ *   10      8     timestamp of the first sample (uS since boot, esp_timer)
+ *   18      2     sample period (uS)
+ *   20      2     number of samples in the block
+ *   22      2     first sample value (int16, not delta coded)
+ *   24      ...   (count - 1) zigzag residuals, varint or rice coded.  the first
+ *                 residual is always x[1]-x[0], regardless of predictor order
+ *
+ * varint: 7 bits per byte, lsb first, bit 7 set on all but the last byte
+ * rice:   bits are packed msb first.  every FAST_STREAM_RICE_PARTITION residuals start
+ *         with a 4 bit k for that partition.  each residual is the quotient (zz >> k) in
+ *         unary as 1's ended by a 0, then the k bit remainder.  a quotient >=
+ *         FAST_STREAM_RICE_ESCAPE is sent as FAST_STREAM_RICE_ESCAPE 1's followed by
+ *         the raw FAST_STREAM_ZZ_BITS (18) bit zigzag value.
+ *
+ * tools/fast_stream.py is the host side decoder (and reports the compression ratio).
+ */
+
+#ifndef __FAST_STREAM_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"  // for types (at least)
+
+#define FAST_STREAM_TOPIC "esp32/waveform"
+#define FAST_STREAM_QOS 0
+
+#define FAST_STREAM_VERSION 1
+#define FAST_STREAM_ENC_VARINT 0x00
+#define FAST_STREAM_ENC_RICE   0x01
+#define FAST_STREAM_RICE_K_MAX 8
+#define FAST_STREAM_RICE_K_BITS 4
+#define FAST_STREAM_RICE_PARTITION 32  // residuals per rice parameter
+#define FAST_STREAM_RICE_ESCAPE 15
+#define FAST_STREAM_ZZ_BITS 18  // zigzag of a second order residual of int16 samples
+
+#define FAST_STREAM_BLOCK_SAMPLES 256  // samples per published block
+#define FAST_STREAM_RING_BLOCKS 4      // blocks of buffering between isr and task (power of 2)
+#define FAST_STREAM_RING_SIZE (FAST_STREAM_BLOCK_SAMPLES * FAST_STREAM_RING_BLOCKS)
+#define FAST_STREAM_HEADER_SIZE 24
+#define FAST_STREAM_MAX_BLOCK_SIZE (FAST_STREAM_HEADER_SIZE + (3 * FAST_STREAM_BLOCK_SAMPLES))  // worst case varint
+
+#define FAST_STREAM_STATS_BLOCKS 50  // log the compression statistics every this many blocks
+
+/*
+ * running statistics (for logging/telemetry)
+ */
+typedef struct {
+    uint32_t blocks_sent;     // blocks handed to mqtt
+    uint32_t blocks_dropped;  // blocks encoded but not sent (e.g. broker not connected)
+    uint32_t samples_lost;    // samples the isr couldn't store (ring full)
+    uint32_t raw_bytes;       // bytes the sent blocks would have taken as int16
+    uint32_t encoded_bytes;   // bytes actually sent (including headers)
+} fast_stream_stats_t;
+
+void fast_stream_init(uint32_t sample_period_us);
+void fast_stream_put_from_isr(int16_t sample, BaseType_t *high_task_awoken);
+void fast_stream_task(void *pvParameters);
+size_t fast_stream_encode_block(const int16_t *samples, uint16_t count, uint32_t seq,
+                                uint32_t first_index, int64_t timestamp_us, uint8_t *out);
+void fast_stream_get_stats(fast_stream_stats_t *stats);
+
+#define __FAST_STREAM_H__
+#endif
@@ -31,96 +31,270 @@
 // global/compartmentalized data
 i2c_port_t htu_port;
 
-int htu21d_init(i2c_port_t port, int sda_pin, int scl_pin,  gpio_pullup_t sda_internal_pullup,  gpio_pullup_t scl_internal_pullup) {
+/*
+ * resolution the sensor is running at (power on/soft reset default is RH 12 bit, T 14 bit).
+ * read back at init and updated by ht21d_set_resolution(), so read_value() can size its wait.
+ */
+static uint8_t htu_resolution = HTU21D_RES_RH12_TEMP14;
+
+/*
+ * maximum conversion times from the datasheet (mS), indexed by resolution_index()
+ */
+typedef struct {
+	uint8_t resolution;
+	uint8_t rh_bits;
+	uint8_t temp_bits;
+	uint8_t rh_ms;
+	uint8_t temp_ms;
+} htu21d_timing_t;
+
+static const htu21d_timing_t htu_timing[] = {
+	{ HTU21D_RES_RH12_TEMP14, 12, 14, 16, 50 },
+	{ HTU21D_RES_RH8_TEMP12,   8, 12,  3, 13 },
+	{ HTU21D_RES_RH10_TEMP13, 10, 13,  5, 25 },
+	{ HTU21D_RES_RH11_TEMP11, 11, 11,  8,  7 },
+};
+#define HTU21D_NUM_TIMINGS (sizeof(htu_timing) / sizeof(htu_timing[0]))
+
+static const htu21d_timing_t *timing_for(uint8_t resolution) {
+	resolution &= HTU21D_RES_MASK;
+	for(int i = 0; i < HTU21D_NUM_TIMINGS; i++)
+		if(htu_timing[i].resolution == resolution)
+			return &htu_timing[i];
+	return &htu_timing[0];  // unreachable, the mask only allows the four settings
+}
+
+/*
+ * the sensor's handle on the i2c bus manager (see i2c_bus.h)
+ */
+static i2c_bus_dev_t htu_dev = -1;
+
+/*
+ * failures by HTU21D_ERR_* code, and the most recent one
+ */
+static uint32_t htu_errors[HTU21D_ERR_COUNT];
+static int htu_last_error = HTU21D_ERR_OK;
+
+/*
+ * one blocking transaction with the sensor: write wr[], then read rd[]
+ * (poll: a NACK just means the sensor is still converting)
+ */
+static esp_err_t htu21d_xfer(const uint8_t *wr, size_t wr_len, uint8_t *rd, size_t rd_len, bool poll) {
+	i2c_bus_xfer_t x = {
+		.dev = htu_dev,
+		.prio = HTU21D_BUS_PRIO,
+		.wr = wr,
+		.wr_len = wr_len,
+		.rd = rd,
+		.rd_len = rd_len,
+		.poll = poll,
+	};
+	return i2c_bus_transfer(&x);
+}
+
+/*
+ * bus result -> HTU21D_ERR_*
+ */
+static int htu21d_err(esp_err_t ret) {
+	
+	switch(ret) {
+		
+		case ESP_OK:
+			return HTU21D_ERR_OK;
+		
+		case ESP_ERR_INVALID_ARG:
+			return HTU21D_ERR_INVALID_ARG;
+			
+		case ESP_FAIL:
+			return HTU21D_ERR_FAIL;
+		
+		case ESP_ERR_INVALID_STATE:
+			return HTU21D_ERR_INVALID_STATE;
+		
+		case ESP_ERR_TIMEOUT:
+			return HTU21D_ERR_TIMEOUT;
+		
+		case I2C_BUS_ERR_BACKOFF:
+			return HTU21D_ERR_BACKOFF;
+	}
+	return HTU21D_ERR_FAIL;
+}
+
+static int htu21d_count_error(int err) {
+	if(err != HTU21D_ERR_OK) {
+		htu_errors[(err < HTU21D_ERR_COUNT) ? err : HTU21D_ERR_FAIL]++;
+		htu_last_error = err;
+	}
+	return err;
+}
+
+uint32_t htu21d_error_count(int err) {
+	return ((err > HTU21D_ERR_OK) && (err < HTU21D_ERR_COUNT)) ? htu_errors[err] : 0;
+}
+
+int htu21d_last_error(void) {
+	return htu_last_error;
+}
+
+/*
+ * CRC-8, polynomial x^8 + x^5 + x^4 + 1 (0x31), initial value 0
+ * crc_table[i] is the crc of the single byte i
+ */
+static const uint8_t crc_table[256] = {
+	0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97, 0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E,
+	0x43, 0x72, 0x21, 0x10, 0x87, 0xB6, 0xE5, 0xD4, 0xFA, 0xCB, 0x98, 0xA9, 0x3E, 0x0F, 0x5C, 0x6D,
+	0x86, 0xB7, 0xE4, 0xD5, 0x42, 0x73, 0x20, 0x11, 0x3F, 0x0E, 0x5D, 0x6C, 0xFB, 0xCA, 0x99, 0xA8,
+	0xC5, 0xF4, 0xA7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7C, 0x4D, 0x1E, 0x2F, 0xB8, 0x89, 0xDA, 0xEB,
+	0x3D, 0x0C, 0x5F, 0x6E, 0xF9, 0xC8, 0x9B, 0xAA, 0x84, 0xB5, 0xE6, 0xD7, 0x40, 0x71, 0x22, 0x13,
+	0x7E, 0x4F, 0x1C, 0x2D, 0xBA, 0x8B, 0xD8, 0xE9, 0xC7, 0xF6, 0xA5, 0x94, 0x03, 0x32, 0x61, 0x50,
+	0xBB, 0x8A, 0xD9, 0xE8, 0x7F, 0x4E, 0x1D, 0x2C, 0x02, 0x33, 0x60, 0x51, 0xC6, 0xF7, 0xA4, 0x95,
+	0xF8, 0xC9, 0x9A, 0xAB, 0x3C, 0x0D, 0x5E, 0x6F, 0x41, 0x70, 0x23, 0x12, 0x85, 0xB4, 0xE7, 0xD6,
+	0x7A, 0x4B, 0x18, 0x29, 0xBE, 0x8F, 0xDC, 0xED, 0xC3, 0xF2, 0xA1, 0x90, 0x07, 0x36, 0x65, 0x54,
+	0x39, 0x08, 0x5B, 0x6A, 0xFD, 0xCC, 0x9F, 0xAE, 0x80, 0xB1, 0xE2, 0xD3, 0x44, 0x75, 0x26, 0x17,
+	0xFC, 0xCD, 0x9E, 0xAF, 0x38, 0x09, 0x5A, 0x6B, 0x45, 0x74, 0x27, 0x16, 0x81, 0xB0, 0xE3, 0xD2,
+	0xBF, 0x8E, 0xDD, 0xEC, 0x7B, 0x4A, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xC2, 0xF3, 0xA0, 0x91,
+	0x47, 0x76, 0x25, 0x14, 0x83, 0xB2, 0xE1, 0xD0, 0xFE, 0xCF, 0x9C, 0xAD, 0x3A, 0x0B, 0x58, 0x69,
+	0x04, 0x35, 0x66, 0x57, 0xC0, 0xF1, 0xA2, 0x93, 0xBD, 0x8C, 0xDF, 0xEE, 0x79, 0x48, 0x1B, 0x2A,
+	0xC1, 0xF0, 0xA3, 0x92, 0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1A, 0x2B, 0xBC, 0x8D, 0xDE, 0xEF,
+	0x82, 0xB3, 0xE0, 0xD1, 0x46, 0x77, 0x24, 0x15, 0x3B, 0x0A, 0x59, 0x68, 0xFF, 0xCE, 0x9D, 0xAC,
+};
+
+/*
+ * the port must already be set up with i2c_bus_init()
+ */
+int htu21d_init(i2c_port_t port) {
 	
 	esp_err_t ret;
 	htu_port = port;
 	
-	// setup i2c controller
-	i2c_config_t conf;
-	conf.mode = I2C_MODE_MASTER;
-	conf.sda_io_num = sda_pin;
-	conf.scl_io_num = scl_pin;
-	conf.sda_pullup_en = sda_internal_pullup;
-	conf.scl_pullup_en = scl_internal_pullup;
-	conf.clk_flags = I2C_SCLK_SRC_FLAG_FOR_NOMAL;
-	conf.master.clk_speed = (uint32_t)1000000;
-	ret = i2c_param_config(port, &conf);
-	if(ret != ESP_OK) return HTU21D_ERR_CONFIG;
-	
-	// install the driver
-	ret = i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0);
-	if(ret != ESP_OK) return HTU21D_ERR_INSTALL;
+	// register with the bus manager
+	htu_dev = i2c_bus_add_device(port, HTU21D_ADDR, "HTU21D");
+	if(htu_dev < 0) return HTU21D_ERR_INSTALL;
 	
 	// verify if a sensor is present
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_stop(cmd);
-	if(i2c_master_cmd_begin(port, cmd, 1000 / portTICK_PERIOD_MS) != ESP_OK)
+	ret = htu21d_xfer(NULL, 0, NULL, 0, false);
+	if(ret != ESP_OK)
 		return HTU21D_ERR_NOTFOUND;
 	
+	// learn the current resolution (it survives an esp32 reset, the sensor isn't reset)
+	htu_resolution = ht21d_get_resolution();
+	
 	return HTU21D_ERR_OK;
 }
 
+/*
+ * worst case conversion time (mS) of a measurement command at a given resolution
+ */
+uint32_t htu21d_conversion_ms(uint8_t command, uint8_t resolution) {
+	const htu21d_timing_t *t = timing_for(resolution);
+	
+	if((command == TRIGGER_HUMD_MEASURE_NOHOLD) || (command == TRIGGER_HUMD_MEASURE_HOLD))
+		return t->rh_ms;
+	return t->temp_ms;
+}
+
+/*
+ * achievable humidity + temperature sample pairs per second (x10) at a given resolution,
+ * counting the conversion times only (the i2c transfers are under 100 uS at 400 kHz).
+ * note that the waits are rounded up to whole ticks, so with CONFIG_FREERTOS_HZ=100
+ * the short conversions are limited by the tick, not the sensor.
+ */
+uint32_t htu21d_samples_per_sec_x10(uint8_t resolution) {
+	const htu21d_timing_t *t = timing_for(resolution);
+	uint32_t ms = t->rh_ms + t->temp_ms;
+	
+	return 10000 / ms;
+}
+
+uint8_t htu21d_active_resolution(void) {
+	return htu_resolution;
+}
+
+/*
+ * conversion of the raw codes, formulas in datasheet:
+ *   T  = -46.85 + 175.72 * raw / 2^16
+ *   RH = -6 + 125 * raw / 2^16
+ * done in fixed point (hundredths) so no double (or float) math is needed per sample.
+ * raw * 17572 < 2^31 for any 16 bit code, so int32 is enough.
+ */
+int32_t htu21d_temperature_centi(uint16_t raw_temperature) {
+	return ((int32_t)(((uint32_t)raw_temperature * HTU21D_TEMP_SCALE_CENTI) >> 16)) + HTU21D_TEMP_OFFSET_CENTI;
+}
+
+int32_t htu21d_humidity_centi(uint16_t raw_humidity) {
+	return ((int32_t)(((uint32_t)raw_humidity * HTU21D_HUMD_SCALE_CENTI) >> 16)) + HTU21D_HUMD_OFFSET_CENTI;
+}
+
 float ht21d_read_temperature() {
 
 	// get the raw value from the sensor
-	uint16_t raw_temperature = read_value(TRIGGER_TEMP_MEASURE_NOHOLD);
-	if(raw_temperature == 0) return -999;
+	uint16_t raw_temperature;
+	if(read_value(TRIGGER_TEMP_MEASURE_NOHOLD, &raw_temperature) != HTU21D_ERR_OK) return -999;
 	
-	// return the real value, formula in datasheet
-	return (raw_temperature * 175.72 / 65536.0) - 46.85;
+	// return the real value (single precision only, the esp32 fpu has no double)
+	return (float)htu21d_temperature_centi(raw_temperature) * 0.01f;
 }
 
+/*
+ * store the raw 16 bit code (uint16_t) for lazy conversion
+ * (see htu21d_temperature_centi())
+ */
 int ht21d_acquire_temperature(void *temperature) {
 
 	// get the raw value from the sensor
-	uint16_t raw_temperature = read_value(TRIGGER_TEMP_MEASURE_NOHOLD);
-	if(raw_temperature == 0) return 0;
+	uint16_t raw_temperature;
+	if(read_value(TRIGGER_TEMP_MEASURE_NOHOLD, &raw_temperature) != HTU21D_ERR_OK) return 0;
 	
-	// return the real value, formula in datasheet
-	*((float *)temperature) = (raw_temperature * 175.72 / 65536.0) - 46.85;
+	*((uint16_t *)temperature) = raw_temperature;
 	return 1;
 }
 
 float ht21d_read_humidity() {
 
 	// get the raw value from the sensor
-	uint16_t raw_humidity = read_value(TRIGGER_HUMD_MEASURE_NOHOLD);
-	if(raw_humidity == 0) return -999;
+	uint16_t raw_humidity;
+	if(read_value(TRIGGER_HUMD_MEASURE_NOHOLD, &raw_humidity) != HTU21D_ERR_OK) return -999;
 	
-	// return the real value, formula in datasheet
-	return (raw_humidity * 125.0 / 65536.0) - 6.0;
+	// return the real value (single precision only, the esp32 fpu has no double)
+	return (float)htu21d_humidity_centi(raw_humidity) * 0.01f;
 }
 
+/*
+ * store the raw 16 bit code (uint16_t) for lazy conversion
+ * (see htu21d_humidity_centi())
+ */
 int ht21d_acquire_humidity(void *humidity) {
 
 	// get the raw value from the sensor
-	uint16_t raw_humidity = read_value(TRIGGER_HUMD_MEASURE_NOHOLD);
-	if(raw_humidity == 0) return 0;
+	uint16_t raw_humidity;
+	if(read_value(TRIGGER_HUMD_MEASURE_NOHOLD, &raw_humidity) != HTU21D_ERR_OK) return 0;
 	
-	*((float *)humidity) = (raw_humidity * 125.0 / 65536.0) - 6.0;
+	*((uint16_t *)humidity) = raw_humidity;
 	return 1;
 }
 
 uint8_t ht21d_get_resolution() {
 
 	uint8_t reg_value = ht21d_read_user_register();
-	return reg_value & 0b10000001;
+	return reg_value & HTU21D_RES_MASK;
 }
 
 int ht21d_set_resolution(uint8_t resolution) {
 	
-	// get the actual resolution
+	int ret;
+	
+	// get the register, keep everything but the resolution bits
 	uint8_t reg_value = ht21d_read_user_register();
-	reg_value &= 0b10000001;
+	reg_value &= ~HTU21D_RES_MASK;
 	
 	// update the register value with the new resolution
-	resolution &= 0b10000001;
+	resolution &= HTU21D_RES_MASK;
 	reg_value |= resolution;
 	
-	return ht21d_write_user_register(reg_value);
+	ret = ht21d_write_user_register(reg_value);
+	if(ret == HTU21D_ERR_OK)
+		htu_resolution = resolution;
+	return ret;
 }
 
 int htu21d_soft_reset() {
@@ -128,54 +302,20 @@ int htu21d_soft_reset() {
 	esp_err_t ret;
 
 	// send the command
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, SOFT_RESET, true);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
+	uint8_t command = SOFT_RESET;
+	ret = htu21d_xfer(&command, 1, NULL, 0, false);
 	
-	switch(ret) {
-		
-		case ESP_ERR_INVALID_ARG:
-			return HTU21D_ERR_INVALID_ARG;
-			
-		case ESP_FAIL:
-			return HTU21D_ERR_FAIL;
-		
-		case ESP_ERR_INVALID_STATE:
-			return HTU21D_ERR_INVALID_STATE;
-		
-		case ESP_ERR_TIMEOUT:
-			return HTU21D_ERR_TIMEOUT;
-	}
-	return HTU21D_ERR_OK;
+	return htu21d_err(ret);
 }
 
 uint8_t ht21d_read_user_register() {
 	
 	esp_err_t ret;
 	
-	// send the command
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, READ_USER_REG, true);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
-	if(ret != ESP_OK) return 0;
-	
-	// receive the answer
+	// send the command and receive the answer (repeated start)
+	uint8_t command = READ_USER_REG;
 	uint8_t reg_value;
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_READ, true);
-	i2c_master_read_byte(cmd, &reg_value, 0x01);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
+	ret = htu21d_xfer(&command, 1, &reg_value, 1, false);
 	if(ret != ESP_OK) return 0;
 	
 	return reg_value;
@@ -186,70 +326,114 @@ int ht21d_write_user_register(uint8_t value) {
 	esp_err_t ret;
 	
 	// send the command
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, WRITE_USER_REG, true);
-	i2c_master_write_byte(cmd, value, true);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
+	uint8_t command[2] = { WRITE_USER_REG, value };
+	ret = htu21d_xfer(command, sizeof(command), NULL, 0, false);
 	
-	switch(ret) {
-		
-		case ESP_ERR_INVALID_ARG:
-			return HTU21D_ERR_INVALID_ARG;
-			
-		case ESP_FAIL:
-			return HTU21D_ERR_FAIL;
-		
-		case ESP_ERR_INVALID_STATE:
-			return HTU21D_ERR_INVALID_STATE;
-		
-		case ESP_ERR_TIMEOUT:
-			return HTU21D_ERR_TIMEOUT;
-	}
+	return htu21d_err(ret);
+}
+
+/*
+ * split phase access (see sensor_acquisition.h): start a conversion, do something
+ * else for htu21d_conversion_ms(), then collect it
+ */
+int htu21d_trigger(uint8_t command) {
+	
+	// send the command (fails at once while the bus manager has the sensor backed off)
+	esp_err_t ret = htu21d_xfer(&command, 1, NULL, 0, false);
+	if(ret != ESP_OK) return htu21d_count_error(htu21d_err(ret));
 	return HTU21D_ERR_OK;
 }
 
-uint16_t read_value(uint8_t command) {
+/*
+ * one attempt at reading the result of the last trigger into *raw (status bits cleared).
+ * in no hold mode the sensor NACKs its address until the conversion is done,
+ * that comes back as HTU21D_ERR_NOT_READY (not counted as an error, try again later)
+ */
+int htu21d_collect(uint16_t *raw) {
 	
-	esp_err_t ret;
+	uint8_t answer[3];  // msb, lsb, crc
+	esp_err_t ret = htu21d_xfer(NULL, 0, answer, sizeof(answer), true);
+	if(ret == ESP_FAIL) return HTU21D_ERR_NOT_READY;
+	if(ret != ESP_OK) return htu21d_count_error(htu21d_err(ret));
 	
-	// send the command
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, command, true);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
-	if(ret != ESP_OK) return 0;
+	uint16_t raw_value = ((uint16_t) answer[0] << 8) | (uint16_t) answer[1];
+	if(!is_crc_valid(raw_value, answer[2])) return htu21d_count_error(HTU21D_ERR_CRC);
+	*raw = raw_value & 0xFFFC;
+	return HTU21D_ERR_OK;
+}
+
+/*
+ * trigger a measurement and read it back into *raw (blocking)
+ * returns HTU21D_ERR_OK or the reason it failed (also counted, see htu21d_error_count())
+ */
+int read_value(uint8_t command, uint16_t *raw) {
 	
-	// wait for the sensor (50ms)
-	vTaskDelay(50 / portTICK_PERIOD_MS);
+	int ret;
 	
-	// receive the answer
-	uint8_t msb, lsb, crc;
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_READ, true);
-	i2c_master_read_byte(cmd, &msb, 0x00);
-	i2c_master_read_byte(cmd, &lsb, 0x00);
-	i2c_master_read_byte(cmd, &crc, 0x01);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(htu_port, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
-	if(ret != ESP_OK) return 0;
+	if((ret = htu21d_trigger(command)) != HTU21D_ERR_OK) return ret;
 	
-	uint16_t raw_value = ((uint16_t) msb << 8) | (uint16_t) lsb;
-	if(!is_crc_valid(raw_value, crc)) printf("CRC invalid\r\n");
-	return raw_value & 0xFFFC;
+	// wait for the conversion at the active resolution (rounded up to whole ticks).
+	// this task sleeps, the bus is free for other devices meanwhile
+	uint32_t wait_ms = htu21d_conversion_ms(command, htu_resolution);
+	vTaskDelay((wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+	
+	// receive the answer, a NACK (still converting) is retried a tick later
+	for(int retry = 0; ; retry++) {
+		ret = htu21d_collect(raw);
+		if((ret != HTU21D_ERR_NOT_READY) || (retry >= HTU21D_POLL_RETRIES)) break;
+		vTaskDelay(1);
+	}
+	if(ret == HTU21D_ERR_NOT_READY) return htu21d_count_error(ret);
+	return ret;
+}
+
+/*
+ * sensor_driver_t phases for the two channels (see sensor_acquisition.h):
+ * trigger/collect return 1 for success, 0 for failure, collect returns -1 for not ready
+ */
+int ht21d_trigger_humidity(void) {
+	return (htu21d_trigger(TRIGGER_HUMD_MEASURE_NOHOLD) == HTU21D_ERR_OK);
 }
 
-// verify the CRC, algorithm in the datasheet (see comments below)
+int ht21d_trigger_temperature(void) {
+	return (htu21d_trigger(TRIGGER_TEMP_MEASURE_NOHOLD) == HTU21D_ERR_OK);
+}
+
+int ht21d_collect(void *raw) {
+	switch(htu21d_collect((uint16_t *)raw)) {
+		case HTU21D_ERR_OK:
+			return 1;
+		case HTU21D_ERR_NOT_READY:
+			return -1;
+	}
+	return 0;
+}
+
+uint32_t ht21d_humidity_conversion_ms(void) {
+	return htu21d_conversion_ms(TRIGGER_HUMD_MEASURE_NOHOLD, htu_resolution);
+}
+
+uint32_t ht21d_temperature_conversion_ms(void) {
+	return htu21d_conversion_ms(TRIGGER_TEMP_MEASURE_NOHOLD, htu_resolution);
+}
+
+// verify the CRC (table driven, one lookup per byte)
 bool is_crc_valid(uint16_t value, uint8_t crc) {
 	
+	uint8_t c = crc_table[value >> 8];
+	c = crc_table[c ^ (value & 0xFF)];
+	return (c == crc);
+}
+
+#if HTU21D_BENCHMARK
+
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_system.h"
+
+// the original bitwise CRC check, algorithm in the datasheet (see comments below)
+static bool is_crc_valid_bitwise(uint16_t value, uint8_t crc) {
+	
 	// line the bits representing the input in a row (first data, then crc)
 	uint32_t row = (uint32_t)value << 8;
 	row |= crc;
@@ -272,3 +456,66 @@ bool is_crc_valid(uint16_t value, uint8_t crc) {
 	return (row == 0);
 }
 
+// build the read transaction of read_value() (without sending it)
+static void build_read(i2c_cmd_handle_t cmd, uint8_t *msb, uint8_t *lsb, uint8_t *crc) {
+	i2c_master_start(cmd);
+	i2c_master_write_byte(cmd, (HTU21D_ADDR << 1) | I2C_MASTER_READ, true);
+	i2c_master_read_byte(cmd, msb, 0x00);
+	i2c_master_read_byte(cmd, lsb, 0x00);
+	i2c_master_read_byte(cmd, crc, 0x01);
+	i2c_master_stop(cmd);
+}
+
+/*
+ * cycles per sample of the per-sample cpu work in read_value(), before/after:
+ *  - crc check, bitwise vs table
+ *  - building the read transaction, heap command link vs static
+ * (the bus transfer and conversion wait are the same either way)
+ */
+void htu21d_benchmark(void) {
+	
+	const char *TAG = "htu21d_bench";
+	uint32_t start, bitwise = 0, table = 0, heap = 0, stat = 0;
+	uint32_t heap_before, heap_min = UINT32_MAX;
+	volatile bool ok = true;
+	uint8_t msb, lsb, crc;
+	i2c_cmd_handle_t cmd;
+	static uint8_t cmd_buf[I2C_BUS_CMD_LINK_SIZE];
+	
+	for(int i = 0; i < HTU21D_BENCHMARK_ITERATIONS; i++) {
+		uint16_t value = (uint16_t)(i * 40503u);  // spread the test values around
+		uint8_t c = crc_table[crc_table[value >> 8] ^ (value & 0xFF)];
+		
+		start = esp_cpu_get_cycle_count();
+		ok = is_crc_valid_bitwise(value, c);
+		bitwise += esp_cpu_get_cycle_count() - start;
+		
+		start = esp_cpu_get_cycle_count();
+		ok = is_crc_valid(value, c);
+		table += esp_cpu_get_cycle_count() - start;
+	}
+	
+	heap_before = esp_get_free_heap_size();
+	for(int i = 0; i < HTU21D_BENCHMARK_ITERATIONS; i++) {
+		start = esp_cpu_get_cycle_count();
+		cmd = i2c_cmd_link_create();
+		build_read(cmd, &msb, &lsb, &crc);
+		if(esp_get_free_heap_size() < heap_min) heap_min = esp_get_free_heap_size();
+		i2c_cmd_link_delete(cmd);
+		heap += esp_cpu_get_cycle_count() - start;
+		
+		start = esp_cpu_get_cycle_count();
+		cmd = i2c_cmd_link_create_static(cmd_buf, sizeof(cmd_buf));
+		build_read(cmd, &msb, &lsb, &crc);
+		i2c_cmd_link_delete_static(cmd);
+		stat += esp_cpu_get_cycle_count() - start;
+	}
+	
+	ESP_LOGI(TAG, "crc check:   bitwise %" PRIu32 " cycles, table %" PRIu32 " cycles (per sample)",
+			 bitwise / HTU21D_BENCHMARK_ITERATIONS, table / HTU21D_BENCHMARK_ITERATIONS);
+	ESP_LOGI(TAG, "read cmd:    heap %" PRIu32 " cycles (%" PRIu32 " bytes malloc'd), static %" PRIu32 " cycles (0 bytes)",
+			 heap / HTU21D_BENCHMARK_ITERATIONS, heap_before - heap_min, stat / HTU21D_BENCHMARK_ITERATIONS);
+	(void)ok;
+}
+
+#endif  // HTU21D_BENCHMARK
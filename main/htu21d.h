@@ -15,6 +15,9 @@
 // I2C driver
 #include "driver/i2c.h"
 
+// I2C bus manager (owns the port)
+#include "i2c_bus.h"
+
 // FreeRTOS (for delay)
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -35,6 +38,16 @@
 #define READ_USER_REG  					0xE7
 #define SOFT_RESET  					0xFE
 
+// user register resolution settings (bits 7 and 0): RH bits / temperature bits
+#define HTU21D_RES_MASK				0b10000001
+#define HTU21D_RES_RH12_TEMP14		0b00000000
+#define HTU21D_RES_RH8_TEMP12		0b00000001
+#define HTU21D_RES_RH10_TEMP13		0b10000000
+#define HTU21D_RES_RH11_TEMP11		0b10000001
+
+// after the conversion wait, retry a read the sensor NACKs (still converting) this many ticks
+#define HTU21D_POLL_RETRIES			3
+
 // return values
 #define HTU21D_ERR_OK				0x00
 #define HTU21D_ERR_CONFIG			0x01
@@ -44,25 +57,59 @@
 #define HTU21D_ERR_FAIL		 		0x05
 #define HTU21D_ERR_INVALID_STATE	0x06
 #define HTU21D_ERR_TIMEOUT	 		0x07
+#define HTU21D_ERR_CRC				0x08	// data received but the crc didn't match
+#define HTU21D_ERR_NOT_READY		0x09	// conversion still not done after the polls
+#define HTU21D_ERR_BACKOFF			0x0A	// the bus manager has the sensor backed off, nothing sent
+#define HTU21D_ERR_COUNT			0x0B
+
+// raw code -> hundredths of engineering units: ((raw * SCALE) >> 16) + OFFSET
+#define HTU21D_TEMP_SCALE_CENTI		17572
+#define HTU21D_TEMP_OFFSET_CENTI	-4685
+#define HTU21D_HUMD_SCALE_CENTI		12500
+#define HTU21D_HUMD_OFFSET_CENTI	-600
+
+// bus manager queue for the sensor's transactions
+#define HTU21D_BUS_PRIO				I2C_BUS_PRIO_NORMAL
+
+// set to 1 to log before/after cycle counts of the per-sample work at init
+#define HTU21D_BENCHMARK			0
+#define HTU21D_BENCHMARK_ITERATIONS	1000
 
 // variables
 extern i2c_port_t htu_port;
 
 // functions
-int htu21d_init(i2c_port_t port, int sda_pin, int scl_pin, gpio_pullup_t sda_internal_pullup, gpio_pullup_t scl_internal_pullup);
+int htu21d_init(i2c_port_t port);
 float ht21d_read_temperature();
 int ht21d_acquire_temperature(void *temperature);
 float ht21d_read_humidity();
 int ht21d_acquire_humidity(void *humidity);
+int ht21d_trigger_humidity(void);
+int ht21d_trigger_temperature(void);
+int ht21d_collect(void *raw);
+uint32_t ht21d_humidity_conversion_ms(void);
+uint32_t ht21d_temperature_conversion_ms(void);
+int32_t htu21d_temperature_centi(uint16_t raw_temperature);
+int32_t htu21d_humidity_centi(uint16_t raw_humidity);
 uint8_t ht21d_get_resolution();
 int ht21d_set_resolution(uint8_t resolution);
 int htu21d_soft_reset();
+uint32_t htu21d_conversion_ms(uint8_t command, uint8_t resolution);
+uint32_t htu21d_samples_per_sec_x10(uint8_t resolution);
+uint8_t htu21d_active_resolution(void);
+uint32_t htu21d_error_count(int err);
+int htu21d_last_error(void);
 
 // helper functions
 uint8_t ht21d_read_user_register();
 int ht21d_write_user_register(uint8_t value);
-uint16_t read_value(uint8_t command);
+int read_value(uint8_t command, uint16_t *raw);
+int htu21d_trigger(uint8_t command);
+int htu21d_collect(uint16_t *raw);
 bool is_crc_valid(uint16_t value, uint8_t crc);
+#if HTU21D_BENCHMARK
+void htu21d_benchmark(void);
+#endif
 
 
 #endif  // __ESP_HTU21D_H__
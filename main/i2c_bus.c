@@ -0,0 +1,379 @@
+/*
+ * i2c_bus.c
+ *
+ * i2c bus manager (see i2c_bus.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "driver/gpio.h"
+
+#include "i2c_bus.h"
+#include "trace.h"
+#include "dlog.h"
+#include "app_tasks.h"
+
+static const char *TAG = "i2c_bus";  // for logging
+
+typedef struct {
+    bool installed;
+    i2c_port_t port;
+    i2c_config_t conf;  // kept to reinstall the driver after a bus recovery
+    QueueHandle_t queue[I2C_BUS_PRIO_LEVELS];
+    StaticQueue_t queue_buf[I2C_BUS_PRIO_LEVELS];
+    uint8_t queue_storage[I2C_BUS_PRIO_LEVELS][I2C_BUS_QUEUE_LEN * sizeof(i2c_bus_xfer_t *)];
+    TaskHandle_t task;
+    /*
+     * statically allocated command link storage so a transaction never touches the heap
+     * (i2c_cmd_link_create() mallocs a link and every queued command).  only the bus
+     * task builds links, one transaction at a time.
+     */
+    uint8_t cmd_buf[I2C_BUS_CMD_LINK_SIZE];
+} i2c_bus_t;
+
+typedef struct {
+    i2c_port_t port;
+    uint8_t addr;
+    const char *name;
+    SemaphoreHandle_t done;  // for i2c_bus_transfer()
+    StaticSemaphore_t done_buf;
+    uint8_t failures;        // consecutive
+    uint32_t backoff_ms;     // 0 when not backed off
+    int64_t backoff_until_us;
+    i2c_bus_stats_t stats;
+} i2c_bus_device_t;
+
+static i2c_bus_t buses[I2C_NUM_MAX];
+static i2c_bus_device_t devices[I2C_BUS_DEVICES_MAX];
+static uint8_t num_devices = 0;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;  // stats and backoff state
+
+/*
+ * timeout for a transaction: bit time of address bytes + data (9 clocks per byte),
+ * times a margin, in ticks rounded up plus one (a one tick wait can end immediately)
+ */
+static TickType_t xfer_timeout_ticks(const i2c_bus_t *bus, const i2c_bus_xfer_t *x)  {
+    uint32_t bytes, us, ms;
+
+    if(x->timeout_ms != 0)
+        ms = x->timeout_ms;
+    else  {
+        bytes = 1 + x->wr_len + ((x->rd_len > 0) ? (1 + x->rd_len) : 0);
+        us = (uint32_t)(((uint64_t)(bytes * 9 + 4) * 1000000) / bus->conf.master.clk_speed);
+        ms = ((us * I2C_BUS_TIMEOUT_MARGIN) + 999) / 1000 + I2C_BUS_TIMEOUT_SLACK_MS;
+    }
+    return (TickType_t)((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS + 1);
+}
+
+/*
+ * free a bus held low by a slave stuck mid-byte: take the pins away from the
+ * controller, clock SCL until the slave lets go of SDA, send a STOP, then reinstall
+ * the driver (which also resets the controller state machine)
+ */
+static esp_err_t bus_recover(i2c_bus_t *bus)  {
+    gpio_num_t sda = bus->conf.sda_io_num;
+    gpio_num_t scl = bus->conf.scl_io_num;
+    gpio_config_t io;
+    int clocks;
+    esp_err_t ret;
+
+    i2c_driver_delete(bus->port);
+
+    memset(&io, 0, sizeof(io));
+    io.pin_bit_mask = (1ULL << sda) | (1ULL << scl);
+    io.mode = GPIO_MODE_INPUT_OUTPUT_OD;
+    io.pull_up_en = 1;
+    io.intr_type = GPIO_INTR_DISABLE;
+    gpio_config(&io);
+
+    gpio_set_level(sda, 1);
+    gpio_set_level(scl, 1);
+    for(clocks = 0; (clocks < I2C_BUS_RECOVERY_CLOCKS) && (gpio_get_level(sda) == 0); clocks++)  {
+        gpio_set_level(scl, 0);
+        esp_rom_delay_us(I2C_BUS_RECOVERY_HALF_US);
+        gpio_set_level(scl, 1);
+        esp_rom_delay_us(I2C_BUS_RECOVERY_HALF_US);
+    }
+
+    // STOP: SDA low to high while SCL is high
+    gpio_set_level(scl, 0);
+    gpio_set_level(sda, 0);
+    esp_rom_delay_us(I2C_BUS_RECOVERY_HALF_US);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(I2C_BUS_RECOVERY_HALF_US);
+    gpio_set_level(sda, 1);
+    esp_rom_delay_us(I2C_BUS_RECOVERY_HALF_US);
+
+    if((ret = i2c_param_config(bus->port, &bus->conf)) == ESP_OK)
+        ret = i2c_driver_install(bus->port, I2C_MODE_MASTER, 0, 0, 0);
+    ESP_LOGI(TAG, "i2c port %d recovered (%d clocks, sda %s): %s", (int)bus->port, clocks,
+             gpio_get_level(sda) ? "high" : "still low", esp_err_to_name(ret));
+    return ret;
+}
+
+/*
+ * build and run one transaction on the bus
+ */
+static esp_err_t bus_run(i2c_bus_t *bus, i2c_bus_xfer_t *x)  {
+    i2c_bus_device_t *d = &devices[x->dev];
+    i2c_cmd_handle_t cmd;
+    esp_err_t ret;
+
+    cmd = i2c_cmd_link_create_static(bus->cmd_buf, sizeof(bus->cmd_buf));
+    if(cmd == NULL)
+        return ESP_ERR_NO_MEM;
+
+    if((x->wr_len > 0) || (x->rd_len == 0))  {
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, (d->addr << 1) | I2C_MASTER_WRITE, true);
+        if(x->wr_len > 0)
+            i2c_master_write(cmd, x->wr, x->wr_len, true);
+    }
+    if(x->rd_len > 0)  {
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, (d->addr << 1) | I2C_MASTER_READ, true);
+        i2c_master_read(cmd, x->rd, x->rd_len, I2C_MASTER_LAST_NACK);
+    }
+    i2c_master_stop(cmd);
+
+    ret = i2c_master_cmd_begin(bus->port, cmd, xfer_timeout_ticks(bus, x));
+    i2c_cmd_link_delete_static(cmd);
+    return ret;
+}
+
+/*
+ * account for a completed transaction and run the backoff policy
+ */
+static void stats_update(i2c_bus_device_t *d, const i2c_bus_xfer_t *x, bool recovered, uint32_t latency_us)  {
+    bool failed = (x->result != ESP_OK) && !(x->poll && (x->result == ESP_FAIL));
+
+    taskENTER_CRITICAL(&stats_lock);
+    d->stats.count++;
+    if(x->result == ESP_FAIL)  {
+        if(x->poll)
+            d->stats.polls++;
+        else
+            d->stats.nacks++;
+    }
+    else if(x->result == ESP_ERR_TIMEOUT)
+        d->stats.timeouts++;
+    if(recovered)
+        d->stats.recoveries++;
+
+    if(failed)  {
+        d->stats.errors++;
+        d->stats.last_error = x->result;
+        if(d->failures < UINT8_MAX)
+            d->failures++;
+        if(d->failures >= I2C_BUS_BACKOFF_AFTER)  {
+            d->backoff_ms = (d->backoff_ms == 0) ? I2C_BUS_BACKOFF_MIN_MS : d->backoff_ms * 2;
+            if(d->backoff_ms > I2C_BUS_BACKOFF_MAX_MS)
+                d->backoff_ms = I2C_BUS_BACKOFF_MAX_MS;
+            d->backoff_until_us = esp_timer_get_time() + (int64_t)d->backoff_ms * 1000;
+            d->stats.backoffs++;
+        }
+    }
+    else if(x->result == ESP_OK)  {
+        d->failures = 0;
+        d->backoff_ms = 0;
+    }
+
+    d->stats.last_us = latency_us;
+    if(latency_us > d->stats.max_us)
+        d->stats.max_us = latency_us;
+    d->stats.total_us += latency_us;
+    taskEXIT_CRITICAL(&stats_lock);
+
+    if(failed && (d->failures == I2C_BUS_BACKOFF_AFTER))
+        DLOGI(TAG, "%s failing (%s), backing off", d->name, esp_err_to_name(x->result));
+}
+
+/*
+ * next transaction, highest priority queue first
+ */
+static bool bus_next(i2c_bus_t *bus, i2c_bus_xfer_t **x)  {
+    for(int p = 0; p < I2C_BUS_PRIO_LEVELS; p++)
+        if(xQueueReceive(bus->queue[p], x, 0) == pdTRUE)
+            return true;
+    return false;
+}
+
+/*
+ * one per port: sleep until something is submitted, then run everything queued
+ */
+static void i2c_bus_task(void *pvParameters)  {
+    i2c_bus_t *bus = (i2c_bus_t *)pvParameters;
+    i2c_bus_xfer_t *x;
+    bool recovered;
+
+    for(;;)  {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while(bus_next(bus, &x))  {
+            TRACE_BEGIN(I2C_XFER, x->dev);
+            x->result = bus_run(bus, x);
+            TRACE_END(I2C_XFER, x->dev);
+            recovered = (x->result == ESP_ERR_TIMEOUT) && (bus_recover(bus) == ESP_OK);
+            stats_update(&devices[x->dev], x, recovered, (uint32_t)(esp_timer_get_time() - x->queued_us));
+            if(x->cb != NULL)
+                x->cb(x);
+        }
+    }
+}
+
+/*
+ * configure and install the legacy i2c driver on a port and start its bus task
+ */
+esp_err_t i2c_bus_init(i2c_port_t port, int sda_pin, int scl_pin, gpio_pullup_t sda_pullup, gpio_pullup_t scl_pullup, uint32_t clk_hz)  {
+    i2c_bus_t *bus;
+    i2c_config_t conf;
+    esp_err_t ret;
+
+    if((port < 0) || (port >= I2C_NUM_MAX))
+        return ESP_ERR_INVALID_ARG;
+    bus = &buses[port];
+    if(bus->installed)
+        return ESP_OK;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.mode = I2C_MODE_MASTER;
+    conf.sda_io_num = sda_pin;
+    conf.scl_io_num = scl_pin;
+    conf.sda_pullup_en = sda_pullup;
+    conf.scl_pullup_en = scl_pullup;
+    conf.clk_flags = I2C_SCLK_SRC_FLAG_FOR_NOMAL;
+    conf.master.clk_speed = clk_hz;
+    if((ret = i2c_param_config(port, &conf)) != ESP_OK)
+        return ret;
+    if((ret = i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0)) != ESP_OK)
+        return ret;
+
+    bus->port = port;
+    bus->conf = conf;
+    for(int p = 0; p < I2C_BUS_PRIO_LEVELS; p++)  {
+        bus->queue[p] = xQueueCreateStatic(I2C_BUS_QUEUE_LEN, sizeof(i2c_bus_xfer_t *), bus->queue_storage[p], &bus->queue_buf[p]);
+        if(bus->queue[p] == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+
+    // one task per port: APP_TASK_I2C_BUS0, APP_TASK_I2C_BUS1 (app_tasks.h)
+    if((bus->task = app_task_create((app_task_t)(APP_TASK_I2C_BUS0 + port), i2c_bus_task, bus)) == NULL)
+        return ESP_ERR_NO_MEM;
+
+    bus->installed = true;
+    ESP_LOGI(TAG, "i2c port %d installed (sda %d, scl %d, %" PRIu32 " Hz)", (int)port, sda_pin, scl_pin, clk_hz);
+    return ESP_OK;
+}
+
+/*
+ * register a device (7 bit address) on an initialized port
+ * returns the handle for its transactions, or -1
+ */
+i2c_bus_dev_t i2c_bus_add_device(i2c_port_t port, uint8_t addr, const char *name)  {
+    i2c_bus_device_t *d;
+
+    if((port < 0) || (port >= I2C_NUM_MAX) || !buses[port].installed)  {
+        ESP_LOGE(TAG, "error: %s added to uninitialized port %d", name, (int)port);
+        return -1;
+    }
+    if(num_devices >= I2C_BUS_DEVICES_MAX)  {
+        ESP_LOGE(TAG, "error: too many i2c devices, %s not added", name);
+        return -1;
+    }
+
+    d = &devices[num_devices];
+    memset(d, 0, sizeof(*d));
+    d->port = port;
+    d->addr = addr;
+    d->name = name;
+    d->done = xSemaphoreCreateBinaryStatic(&d->done_buf);
+    if(d->done == NULL)
+        return -1;
+
+    ESP_LOGI(TAG, "%s at 0x%02x on port %d", name, addr, (int)port);
+    return (i2c_bus_dev_t)(num_devices++);
+}
+
+/*
+ * queue a transaction without waiting for it
+ * ESP_ERR_NO_MEM if the queue for its priority is full,
+ * I2C_BUS_ERR_BACKOFF if the device is backed off (the callback is not called for either)
+ */
+esp_err_t i2c_bus_submit(i2c_bus_xfer_t *xfer)  {
+    i2c_bus_device_t *d;
+    i2c_bus_t *bus;
+    bool skip;
+
+    if((xfer == NULL) || (xfer->dev < 0) || (xfer->dev >= num_devices) || (xfer->prio >= I2C_BUS_PRIO_LEVELS))
+        return ESP_ERR_INVALID_ARG;
+    d = &devices[xfer->dev];
+    bus = &buses[d->port];
+
+    taskENTER_CRITICAL(&stats_lock);
+    skip = (d->backoff_ms != 0) && (esp_timer_get_time() < d->backoff_until_us);
+    if(skip)
+        d->stats.skipped++;
+    taskEXIT_CRITICAL(&stats_lock);
+    if(skip)
+        return I2C_BUS_ERR_BACKOFF;
+
+    xfer->queued_us = esp_timer_get_time();
+    if(xQueueSend(bus->queue[xfer->prio], &xfer, 0) != pdTRUE)  {
+        taskENTER_CRITICAL(&stats_lock);
+        devices[xfer->dev].stats.queue_full++;
+        taskEXIT_CRITICAL(&stats_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(bus->task);
+    return ESP_OK;
+}
+
+static void transfer_done(i2c_bus_xfer_t *xfer)  {
+    xSemaphoreGive((SemaphoreHandle_t)xfer->arg);
+}
+
+/*
+ * queue a transaction and block until the bus task has run it
+ * (one blocking caller per device at a time: each device has one completion semaphore)
+ */
+esp_err_t i2c_bus_transfer(i2c_bus_xfer_t *xfer)  {
+    esp_err_t ret;
+
+    if((xfer == NULL) || (xfer->dev < 0) || (xfer->dev >= num_devices))
+        return ESP_ERR_INVALID_ARG;
+
+    xfer->cb = transfer_done;
+    xfer->arg = devices[xfer->dev].done;
+    if((ret = i2c_bus_submit(xfer)) != ESP_OK)
+        return ret;
+
+    // the bus task always completes it (i2c_master_cmd_begin() has its own timeout)
+    xSemaphoreTake(devices[xfer->dev].done, portMAX_DELAY);
+    return xfer->result;
+}
+
+bool i2c_bus_get_stats(i2c_bus_dev_t dev, i2c_bus_stats_t *stats)  {
+    if((dev < 0) || (dev >= num_devices))
+        return false;
+
+    taskENTER_CRITICAL(&stats_lock);
+    *stats = devices[dev].stats;
+    taskEXIT_CRITICAL(&stats_lock);
+    return true;
+}
+
+void i2c_bus_log_stats(void)  {
+    i2c_bus_stats_t s;
+
+    for(i2c_bus_dev_t i = 0; i < num_devices; i++)  {
+        i2c_bus_get_stats(i, &s);
+        ESP_LOGI(TAG, "%s: %" PRIu32 " xfers, %" PRIu32 " errors (last %s: %" PRIu32 " nack, %" PRIu32 " timeout, %" PRIu32 " recovered), "
+                 "%" PRIu32 " backoffs, %" PRIu32 " skipped, %" PRIu32 " queue full, latency last/mean/max %" PRIu32 "/%" PRIu32 "/%" PRIu32 " uS",
+                 devices[i].name, s.count, s.errors, esp_err_to_name(s.last_error), s.nacks, s.timeouts, s.recoveries,
+                 s.backoffs, s.skipped, s.queue_full,
+                 s.last_us, (s.count > 0) ? (uint32_t)(s.total_us / s.count) : 0, s.max_us);
+    }
+}
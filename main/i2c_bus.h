@@ -0,0 +1,118 @@
+/*
+ * i2c_bus.h
+ *
+ * i2c bus manager: one task owns each i2c port and runs the transactions for every
+ * device on it.
+ *
+ * a driver registers its device once with i2c_bus_add_device(), then describes each
+ * transaction with an i2c_bus_xfer_t (write some bytes, then read some bytes, either
+ * part may be empty) and either
+ *   - i2c_bus_submit(): queue it and return immediately, the callback runs in the bus
+ *     task when it completes, or
+ *   - i2c_bus_transfer(): queue it and block the calling task until it completes.
+ * transactions are queued by pointer, so the xfer (and its buffers) must stay valid
+ * until it completes.
+ *
+ * there is one queue per priority level; the bus task always drains the higher
+ * priority queue first.  the bus is only held for the transfer itself, so a device
+ * that needs a wait (e.g. a conversion time) should split the work into a trigger
+ * transaction and a read transaction and wait in its own task, not on the bus.
+ *
+ * failures are kept cheap and bounded:
+ *   - each transaction's timeout is sized to its length at the bus clock (with margin)
+ *     instead of a flat second.
+ *   - a transaction that times out (bus held low, e.g. a device wedged mid-byte) makes
+ *     the bus task clock SCL until SDA is released, send a STOP and reinstall the driver.
+ *   - after I2C_BUS_BACKOFF_AFTER consecutive failures a device is backed off: its
+ *     transactions fail at submit with I2C_BUS_ERR_BACKOFF, without touching the bus,
+ *     until the backoff (doubling up to I2C_BUS_BACKOFF_MAX_MS) runs out.  the next
+ *     transaction after that is the probe; any success clears the backoff.
+ *   a NACK on an xfer marked .poll (e.g. a sensor still converting) is not a failure.
+ *
+ * per-device stats (count, errors by kind, queue+transfer latency) are kept by the bus
+ * task and read with i2c_bus_get_stats().
+ */
+
+#ifndef __I2C_BUS_H__
+
+#include "esp_system.h"  // for types (at least)
+#include "esp_err.h"
+#include "driver/i2c.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define I2C_BUS_DEVICES_MAX 8       // devices across all ports
+#define I2C_BUS_QUEUE_LEN 8         // transactions waiting per priority level per port
+#define I2C_BUS_TIMEOUT_MARGIN 4    // transaction timeout is this many times its bit time ...
+#define I2C_BUS_TIMEOUT_SLACK_MS 2  // ... plus this (then rounded up to ticks, plus one)
+#define I2C_BUS_RECOVERY_CLOCKS 9   // SCL pulses to free a slave holding SDA low
+#define I2C_BUS_RECOVERY_HALF_US 5  // half period of the recovery clock
+#define I2C_BUS_BACKOFF_AFTER 2     // consecutive failures before a device is backed off
+#define I2C_BUS_BACKOFF_MIN_MS 500
+#define I2C_BUS_BACKOFF_MAX_MS 60000
+#define I2C_BUS_CMD_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(8)  // static command link for one transaction
+
+/*
+ * returned (besides the i2c driver's esp_err_t) by i2c_bus_submit()/i2c_bus_transfer()
+ */
+#define I2C_BUS_ERR_BASE 0x7100
+#define I2C_BUS_ERR_BACKOFF (I2C_BUS_ERR_BASE + 1)  // device backed off, nothing sent
+
+typedef enum {
+    I2C_BUS_PRIO_HIGH,
+    I2C_BUS_PRIO_NORMAL,
+    I2C_BUS_PRIO_LEVELS,
+} i2c_bus_prio_t;
+
+typedef int8_t i2c_bus_dev_t;  // index returned by i2c_bus_add_device(), < 0 is invalid
+
+typedef struct i2c_bus_xfer i2c_bus_xfer_t;
+typedef void (*i2c_bus_cb_t)(i2c_bus_xfer_t *xfer);
+
+/*
+ * one transaction: START, address+W, wr[], (repeated) START, address+R, rd[], STOP
+ * with wr_len and rd_len both 0 it is just an address probe
+ */
+struct i2c_bus_xfer {
+    i2c_bus_dev_t dev;
+    i2c_bus_prio_t prio;
+    const uint8_t *wr;
+    size_t wr_len;
+    uint8_t *rd;
+    size_t rd_len;
+    uint32_t timeout_ms;  // 0 means sized to the transfer
+    bool poll;            // a NACK is expected (device busy), don't count it as a failure
+    i2c_bus_cb_t cb;      // called from the bus task on completion (may be NULL)
+    void *arg;            // for the callback
+    esp_err_t result;     // set before the callback is called
+    int64_t queued_us;    // (set by the bus manager)
+};
+
+typedef struct {
+    uint32_t count;          // transactions completed
+    uint32_t errors;         // transactions that did not return ESP_OK
+    uint32_t nacks;          // ESP_FAIL: the device didn't acknowledge
+    uint32_t timeouts;       // ESP_ERR_TIMEOUT: the transfer didn't finish (bus recovered)
+    uint32_t polls;          // NACKs on .poll transactions (not counted as errors)
+    uint32_t recoveries;     // bus recoveries after this device's timeouts
+    uint32_t backoffs;       // times the device was put into backoff
+    uint32_t skipped;        // transactions refused with I2C_BUS_ERR_BACKOFF
+    uint32_t queue_full;     // submits rejected because the queue was full
+    esp_err_t last_error;
+    uint32_t last_us;        // latency of the last transaction, queued to complete
+    uint32_t max_us;
+    uint64_t total_us;       // for the mean (total_us / count)
+} i2c_bus_stats_t;
+
+esp_err_t i2c_bus_init(i2c_port_t port, int sda_pin, int scl_pin, gpio_pullup_t sda_pullup, gpio_pullup_t scl_pullup, uint32_t clk_hz);
+i2c_bus_dev_t i2c_bus_add_device(i2c_port_t port, uint8_t addr, const char *name);
+esp_err_t i2c_bus_submit(i2c_bus_xfer_t *xfer);
+esp_err_t i2c_bus_transfer(i2c_bus_xfer_t *xfer);
+bool i2c_bus_get_stats(i2c_bus_dev_t dev, i2c_bus_stats_t *stats);
+void i2c_bus_log_stats(void);
+
+#define __I2C_BUS_H__
+#endif
@@ -29,41 +29,47 @@
 #include "mqtt_local.h"
 
 #include "sensor_acquisition.h"
+#include "sensor_rollup.h"
+#include "sensor_alarm.h"
+#include "sensor_record.h"
+#include "device_cmd.h"
+#include "boot_phase.h"
+#include "mqtt_pub.h"
 
 #include "display_neopixel.h"
+#include "fast_filter.h"
+#include "fast_stream.h"
+#include "trace.h"
+#include "dlog.h"
+#include "telemetry.h"
+#include "app_tasks.h"
 
 static const char *TAG = "main";  // for logging
 
 /*
- * slow acquisition task
- * acquires data from slower (~1s) sensors
- * espect an include file for each sensor here
+ * sensor acquisition
+ * sensors are acquired in groups (fast/medium/slow), each group in its own task
+ * at its own rate (see SENSOR_GROUP_TABLE in sensor_acquisition.h)
+ * espect an include file for each sensor in sensor_acquisition.c
  * 
- * sensor_init_slow() : initialize the sensors that will use the slow acq loop
- * sensor_acq_slow()  : read the slow acq loop sensors
+ * sensor_init_slow()    : initialize the sensors
+ * sensor_groups_start() : start a task for each group that has sensors
  * 
- * Note on STACK_SIZE: used value of 2048 from example and after adding more code
+ * Note on stack sizes: used value of 2048 from example and after adding more code
  * got irrational error relating to "i2c driver not loaded".  Increased to 4096 and
  * the error was resolved.  was red hering : not related to stack 
- * (was new parameter in i2c conf struct).  I'll leave at 8096.  TODO: research
+ * (was new parameter in i2c conf struct).  every task was then left at 8096.
+ * the tasks are now allocated statically from APP_TASK_TABLE (app_tasks.h).  those
+ * sizes are round first guesses, not measurements: run the auditor (TASK_AUDIT_ENABLE)
+ * on the target and take its recommended sizes
  */
 
-#define STACK_SIZE 8096
-TaskHandle_t xHandle_1 = NULL;
-
-void sensor_acq_slow(void *pvParameters)  {
-
+void sensor_acq_start(void)  {
   sensor_init_slow();
-
-  while(1)  {
-    ESP_LOGI(TAG, "sensor_acq_slow(): executing on core %d", xPortGetCoreID());
-
-    ESP_LOGI(TAG, "slow acquisition initiated");
-    acquire_sensors();
-    display_sensors();
-
-    vTaskDelay(SLOW_LOOP_INTERVAL / portTICK_PERIOD_MS);
-  }
+  sensor_rollup_init();
+  sensor_alarm_init();
+  sensor_record_init();
+  sensor_groups_start();
 }
 
 /*
@@ -72,28 +78,33 @@ void sensor_acq_slow(void *pvParameters)  {
  * 
  */
 //#define DISPLAY_NEOPIXEL_MODE PONG_EXAMPLE
-//#define DISPLAY_NEOPIXEL_SPEED (50 / portTICK_PERIOD_MS)  // mS between strip updates
-
 //#define DISPLAY_NEOPIXEL_MODE SIM_REG_EXAMPLE
-//#define DISPLAY_NEOPIXEL_SPEED (1000 / portTICK_PERIOD_MS)  // mS between strip updates
-
 //#define DISPLAY_NEOPIXEL_MODE EXCEL_COLOR_VALUE
-//#define DISPLAY_NEOPIXEL_SPEED (2000 / portTICK_PERIOD_MS)  // mS between strip update
-
 #define DISPLAY_NEOPIXEL_MODE FAST_WAVEFORM
-#define FAST_ACQ_PRIO tskIDLE_PRIORITY
 
+/*
+ * time between strip updates, per mode (the mode can be changed at runtime, so the
+ * period goes with it)
+ */
+#define DISPLAY_PONG_SPEED (50 / portTICK_PERIOD_MS)
+#define DISPLAY_SIM_REG_SPEED (1000 / portTICK_PERIOD_MS)
+#define DISPLAY_EXCEL_SPEED (2000 / portTICK_PERIOD_MS)
 /*
  * throttle the display to ~100 ups
  * the detail of the EKG simulated waveform emerges when this is about 100 ups
  * also, seems that the display update time becomes more consistent with this
  * delay included.
  */
-#define DISPLAY_NEOPIXEL_SPEED (5 / portTICK_PERIOD_MS)
-/*
- * throttle the display to ~100 ups
- */
-//#define DISPLAY_NEOPIXEL_SPEED (0 / portTICK_PERIOD_MS)  // let the scheduler decide
+#define DISPLAY_FAST_WAVEFORM_SPEED (5 / portTICK_PERIOD_MS)
+
+static TickType_t display_speed(uint8_t mode)  {
+    switch(mode)  {
+      case PONG_EXAMPLE:      return(DISPLAY_PONG_SPEED);
+      case SIM_REG_EXAMPLE:   return(DISPLAY_SIM_REG_SPEED);
+      case EXCEL_COLOR_VALUE: return(DISPLAY_EXCEL_SPEED);
+      default:                return(DISPLAY_FAST_WAVEFORM_SPEED);
+    }
+}
 
 // which data value to display for EXCEL_COLOR_VALUE mode
 #define DATA_VALUE_SINE 0  // canned sin wave
@@ -136,26 +147,32 @@ static float sine_wave_incr()  {
   return(sine_wave_data[sine_idx]);
 }
 
-static void neopixel_example(void *pvParameters)
-{
-    float sine_value = 0;
-    /*
-     * Configure the peripheral according to the LED type
-     */
-    configure_led();
-
-    /*
-     * configure/start the neo_pixel demo mode
-     */
-    if(DISPLAY_NEOPIXEL_MODE == EXCEL_COLOR_VALUE)  {
+/*
+ * configure the neo_pixel demo mode
+ */
+static void display_mode_setup(uint8_t mode)  {
+    if(mode == EXCEL_COLOR_VALUE)  {
       led_bargraph_min_set(0);
       led_bargraph_max_set(255);
     }
-    else if (DISPLAY_NEOPIXEL_MODE == FAST_WAVEFORM)  {
+    else if (mode == FAST_WAVEFORM)  {
       led_bargraph_min_set(0);
       led_bargraph_max_set(4096);
 //      led_bargraph_fast_timer_init(); // initialize and start the time, intr, display
     }
+}
+
+static void neopixel_example(void *pvParameters)
+{
+    float sine_value = 0;
+    float hum_value = 0;
+    bool hum_valid;
+    uint8_t mode = DISPLAY_NEOPIXEL_MODE;  // can be changed at runtime (see device_cmd.h)
+    /*
+     * Configure the peripheral according to the LED type
+     */
+    configure_led();
+    display_mode_setup(mode);
 
     /*
      * some slightly badly structured code to try out
@@ -166,33 +183,45 @@ static void neopixel_example(void *pvParameters)
      */
     while(1)
     {
-        if(DISPLAY_NEOPIXEL_MODE == EXCEL_COLOR_VALUE)  {
+        if(device_cmd_take_display(&mode))  {
+          ESP_LOGI(TAG, "display mode %d", mode);
+          display_mode_setup(mode);
+        }
+
+        if(mode == EXCEL_COLOR_VALUE)  {
           ;
 #if DISPLAY_NEOPIXEL_VALUE == DATA_VALUE_INT
             led_bargraph_incr();  // simple integer simulation
 #elif DISPLAY_NEOPIXEL_VALUE == DATA_VALUE_SINE
             sine_value = sine_wave_incr();  // sine wave simulation
-            display_neopixel_update(DISPLAY_NEOPIXEL_MODE, led_bargraph_map(sine_value, SINE_WAVE_MIN, SINE_WAVE_MAX));
+            display_neopixel_update(mode, led_bargraph_map(sine_value, SINE_WAVE_MIN, SINE_WAVE_MAX));
 #elif DISPLAY_NEOPIXEL_VALUE == DATA_VALUE_HUM
           /*
            * display the humidity sensor (sensor[0]) data across the
            * neopixel array with 0% at the bottom and 50% at that top
            */
-            ESP_LOGI(TAG, "displaying %s on neo_pixels, value = %f", sensors[0].label, *((float *)(sensors[0].data)));
-            display_neopixel_update(DISPLAY_NEOPIXEL_MODE, led_bargraph_map(*((float *)(sensors[0].data)), 0, 50));
+            hum_valid = false;
+            if((sensor_data_mutex != NULL) && (xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) == pdTRUE))  {
+              hum_valid = sensor_value_float(SENSOR_HUMIDITY, &hum_value);
+              xSemaphoreGiveRecursive(sensor_data_mutex);
+            }
+            if(hum_valid)  {
+              DLOGI(TAG, "displaying %s on neo_pixels, value = %f", sensors[SENSOR_HUMIDITY].label, hum_value);
+              display_neopixel_update(mode, led_bargraph_map(hum_value, 0, 50));
+            }
         }
 #endif
-        else if (DISPLAY_NEOPIXEL_MODE == SIM_REG_EXAMPLE)
-          display_neopixel_update(DISPLAY_NEOPIXEL_MODE, 0);
+        else if (mode == SIM_REG_EXAMPLE)
+          display_neopixel_update(mode, 0);
 
-        else if (DISPLAY_NEOPIXEL_MODE == FAST_WAVEFORM)
+        else if (mode == FAST_WAVEFORM)
           led_bargraph_update_fast_display();
 
         else
           ESP_LOGI(TAG, "nothing to do in loop");
 
-        if(DISPLAY_NEOPIXEL_SPEED > 0)
-          vTaskDelay(DISPLAY_NEOPIXEL_SPEED);  // set speed of neopixel chase here and give IDLE() time to run
+        if(display_speed(mode) > 0)
+          vTaskDelay(display_speed(mode));  // set speed of neopixel chase here and give IDLE() time to run
     }
 }
 
@@ -204,6 +233,9 @@ static void neopixel_example(void *pvParameters)
  */
 static void fast_acq_sim_task(void *pvParameters)  {
 
+#if FAST_STREAM_ENABLE
+   fast_stream_init(FAST_BG_ALARM_COUNT * fast_filter_decimation(FAST_STREAM_SOURCE));
+#endif
    led_bargraph_fast_timer_init();
 
    while(1);
@@ -214,14 +246,24 @@ static void fast_acq_sim_task(void *pvParameters)  {
  * start wifi
  * start mqtt
  * start other tasks
- * loop and publish health/welfare ping
+ * loop and publish health/welfare telemetry
+ *
+ * nothing here waits for the network: wifi and mqtt connect in the background
+ * while the sensors and display start, so sampling begins within milliseconds of
+ * boot.  what is produced before the broker is reachable is held for it: rollups
+ * (QoS 1) in the mqtt outbox (mqtt_pub.h), the raw sample records of sensors with
+ * publishing on (off by default, "publish <sensor> on", device_cmd.h) in the
+ * record backlog (sensor_record.h).  telemetry (QoS 0) is dropped until then.
+ * the phases are timestamped in boot_phase.h
  */
 void app_main(void)
 {
   char wifi_key[16];  // key to wifi instance
-  int msg_id;  // mqtt message id from broker
 
+  boot_mark(BOOT_PHASE_APP_MAIN);
   instru_gpio_init();
+  trace_init();  // before the traced tasks start
+  dlog_init();
 
     /*
      * Initialize NVS - apparently saves last successful connect credentials
@@ -232,15 +274,16 @@ void app_main(void)
       ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    boot_mark(BOOT_PHASE_NVS);
 
     /*
-     * attempt to connect to wifi
+     * start connecting to wifi (returns right away)
      */
     ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
     wifi_init_sta();
+    boot_mark(BOOT_PHASE_WIFI_START);
 
-    //esp_wifi_connect();  /* apparently not required */
-    /* TODO: Implement retry logic on lost wifi connection */
+    // (reconnects are the wifi_sup task's, see wifi_station.h)
 
     /*
      * if a key other than the default is used, need to set
@@ -250,19 +293,27 @@ void app_main(void)
     get_wifi_key(wifi_key, sizeof(wifi_key));
     ESP_LOGI(TAG, "wifi key: <%s>\n", wifi_key);
 
-    mqtt_app_start();
+    mqtt_pub_sched_start();  // burst schedule and modem sleep (PUB_SCHED_ENABLE)
+    mqtt_app_start();  // connects once wifi has an address
 
     /*
-     * create the slow acquitision task
+     * initialize the sensors and start the acquisition group tasks
      */
-    xTaskCreate( sensor_acq_slow, "sensor_acq_slow", STACK_SIZE, NULL, tskIDLE_PRIORITY, &xHandle_1 );
-    configASSERT( xHandle_1 ); /* check whether the returned handle is NULL */
+    sensor_acq_start();
+    boot_mark(BOOT_PHASE_SENSORS);
+
+#if FAST_STREAM_ENABLE
+    /*
+     * create the task that compresses and publishes the fast waveform
+     * (created before the fast acquisition so no blocks are missed)
+     */
+    app_task_create(APP_TASK_FAST_STREAM, fast_stream_task, NULL);
+#endif
 
     /*
      * create the fast acquisition simulation task
      */
-    xTaskCreate(fast_acq_sim_task, "fast_acq_sim_task", STACK_SIZE, NULL, FAST_ACQ_PRIO, NULL);
-    //xTaskCreatePinnedToCore(fast_acq_sim_task, "fast_acq_sim_task", STACK_SIZE, NULL, tskIDLE_PRIORITY, NULL, 1);
+    app_task_create(APP_TASK_FAST_ACQ, fast_acq_sim_task, NULL);
 
     /*
      * create a task to play out the neopixel example
@@ -285,7 +336,10 @@ void app_main(void)
      * changed enough to require it.)
      * 
      */
-    xTaskCreate(neopixel_example, "neopixel_example", STACK_SIZE, NULL, tskIDLE_PRIORITY, NULL);
+    app_task_create(APP_TASK_NEOPIXEL, neopixel_example, NULL);
+    boot_mark(BOOT_PHASE_TASKS);
+
+    app_task_audit_start();  // only with TASK_AUDIT_ENABLE
 
 #ifdef NOT_YET
     /*
@@ -304,8 +358,7 @@ void app_main(void)
 
     while(1)  {
         wifi_connect_status(true);
-        msg_id = esp_mqtt_client_publish(get_mqtt_handle(), "esp32/alive", "ping", 0, 1, 0);
-        ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
-        vTaskDelay(3000 / portTICK_PERIOD_MS);
+        telemetry_publish();
+        vTaskDelay(TELEMETRY_INTERVAL_MS / portTICK_PERIOD_MS);
     }
 }
\ No newline at end of file
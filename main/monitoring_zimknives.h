@@ -8,5 +8,20 @@
 #ifndef __MONITORING_ZIMKNIVES_H__
 #define SLOW_LOOP_INTERVAL ((int16_t) 5000)  // interval between sensor updates in the slow acq loop
 
+#define HTU21D_RESOLUTION HTU21D_RES_RH12_TEMP14  // HTU21D_RES_* (htu21d.h): lower resolution converts faster
+
+#define PUB_SCHED_ENABLE 1       // hold publishes back and send them in bursts, modem sleep in between (see mqtt_pub.h)
+#define PUB_SCHED_LIGHT_SLEEP 0  // also automatic light sleep (needs CONFIG_PM_ENABLE, see sdkconfig.defaults)
+
+#define FAST_FILTER_ENABLE 1  // cic/fir decimate the fast path for display/publish (see fast_filter.h)
+#define FAST_STREAM_ENABLE (!PUB_SCHED_ENABLE)  // publish the fast waveform as compressed blocks (see fast_stream.h); a continuous stream keeps the radio from sleeping between bursts
+#define FAST_STREAM_SOURCE FAST_FILTER_OUT_FULL  // which fast filter output is streamed
+
+#define SENSOR_RECORD_ENABLE 1  // raw samples go out as one binary record per group cycle, not a string per topic (see sensor_record.h)
+#define SENSOR_RECORD_BENCH 0   // log the size and encode time of the binary record against json at startup
+
+#define TASK_AUDIT_ENABLE 0  // run the stack auditor's load test after boot and log recommended sizes (see app_tasks.h)
+#define DLOG_DEFERRED 1  // hot path DLOGx() lines are formatted later by an idle task (see dlog.h)
+
 #define __MONITORING_ZIMKNIVES_H__
 #endif
@@ -13,10 +13,24 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_wifi.h"
 #include "mqtt_client.h"
 
+#include "mqtt_local.h"
+#include "trace.h"
+#include "sensor_record.h"
+#include "device_cmd.h"
+#include "wifi_station.h"
+#include "dlog.h"
+#include "boot_phase.h"
+
 /*
  * TODO: this will be set from eeprom based values
  */
@@ -24,6 +38,15 @@ esp_mqtt_client_config_t mqtt_cfg = {
     .broker.address.hostname = "192.168.1.24",
     .broker.address.transport = MQTT_TRANSPORT_OVER_TCP,
     .broker.address.port = 52065,
+    .session.last_will.topic = MQTT_STATUS_TOPIC,
+    .session.last_will.msg = MQTT_STATUS_OFFLINE,
+    .session.last_will.qos = 1,
+    .session.last_will.retain = 1,
+    .session.disable_clean_session = true,  // resume the session (see mqtt_local.h)
+    .session.keepalive = MQTT_KEEPALIVE_S,
+    .network.disable_auto_reconnect = true,  // the state machine below retries
+    .network.timeout_ms = MQTT_NETWORK_TIMEOUT_MS,
+    .outbox.limit = MQTT_OUTBOX_LIMIT,
 //
 // leave this unset for now to default to WIFI_STA_DEF for mqtt broker
 // beware, seems that the size of if_name is too small
@@ -36,11 +59,217 @@ esp_mqtt_client_config_t mqtt_cfg = {
  */
 static esp_mqtt_client_handle_t mqtt_client;
 
+/*
+ * track the broker connection so that publishers (e.g. streaming)
+ * can skip building/sending messages that have nowhere to go
+ */
+static volatile bool mqtt_connected = false;
+
 /*
  * logging
  */
 static const char *TAG = "mqtt_local";
 
+/*
+ * connection state machine (see mqtt_local.h).  it is driven from the mqtt task
+ * (client events), the event loop (wifi events) and the esp_timer task (backoff), so
+ * conn_state, wifi_up, backoff_step and the outage bookkeeping only change under
+ * conn_lock: each transition is decided and made in one critical section, then logged
+ * (and the timer or the client called) after it
+ */
+static volatile mqtt_state_t conn_state = MQTT_STATE_WAIT_WIFI;
+static volatile bool wifi_up = false;
+static uint32_t backoff_step = 0;
+static esp_timer_handle_t backoff_timer;
+static int64_t down_since_us;           // start of the current outage
+static volatile bool first_pub_pending = false;
+static uint32_t outage_attempts = 0;
+static bool client_started = false;     // the first attempt is esp_mqtt_client_start()
+static mqtt_conn_stats_t conn_stats;
+static portMUX_TYPE conn_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define MQTT_STATE_LABEL(name, label) label,
+static const char *const mqtt_state_names[MQTT_STATE_COUNT] = {
+    MQTT_STATE_TABLE(MQTT_STATE_LABEL)
+};
+#undef MQTT_STATE_LABEL
+
+static void log_transition(mqtt_state_t from, mqtt_state_t to)
+{
+    if(from != to)
+        ESP_LOGI(TAG, "%s -> %s", mqtt_state_names[from], mqtt_state_names[to]);
+}
+
+/*
+ * the next backoff: MQTT_BACKOFF_MIN_MS doubling up to MQTT_BACKOFF_MAX_MS,
+ * of which the upper half is random (rnd, from esp_random()).
+ * called with conn_lock held
+ */
+static uint32_t backoff_ms(uint32_t rnd)
+{
+    uint32_t step = MQTT_BACKOFF_MIN_MS;
+
+    for(uint32_t n = 0; (n < backoff_step) && (step < MQTT_BACKOFF_MAX_MS); n++)
+        step *= 2;
+    if(step > MQTT_BACKOFF_MAX_MS)
+        step = MQTT_BACKOFF_MAX_MS;
+    backoff_step++;
+    return((step / 2) + (rnd % ((step / 2) + 1)));
+}
+
+/*
+ * the connection is gone (or an attempt failed): wait for wifi, or back off
+ * (nothing to do if a retry is already scheduled)
+ */
+static void schedule_retry(void)
+{
+    uint32_t rnd = esp_random();
+    uint32_t delay_ms = 0;
+    mqtt_state_t from, to;
+
+    taskENTER_CRITICAL(&conn_lock);
+    from = to = conn_state;
+    if(from == MQTT_STATE_CONNECTED)  {
+        down_since_us = esp_timer_get_time();
+        first_pub_pending = false;
+    }
+    if(from != MQTT_STATE_BACKOFF)  {
+        to = wifi_up ? MQTT_STATE_BACKOFF : MQTT_STATE_WAIT_WIFI;
+        if(to == MQTT_STATE_BACKOFF)
+            delay_ms = backoff_ms(rnd);
+        conn_state = to;
+    }
+    taskEXIT_CRITICAL(&conn_lock);
+
+    log_transition(from, to);
+    if((from != MQTT_STATE_BACKOFF) && (to == MQTT_STATE_BACKOFF))  {
+        // (if a wifi event moves the state on before this, connect_attempt() ignores the timer)
+        esp_timer_stop(backoff_timer);
+        esp_timer_start_once(backoff_timer, (uint64_t)delay_ms * 1000);
+        ESP_LOGI(TAG, "next attempt in %" PRIu32 " mS", delay_ms);
+    }
+}
+
+/*
+ * make a connection attempt, unless one is already under way or there is no link
+ */
+static void connect_attempt(void)
+{
+    mqtt_state_t from = MQTT_STATE_CONNECTING;
+    esp_err_t ret = ESP_OK;
+    bool go = false;
+
+    taskENTER_CRITICAL(&conn_lock);  // (claim the attempt, wifi and the backoff timer can race here)
+    if(wifi_up && ((conn_state == MQTT_STATE_WAIT_WIFI) || (conn_state == MQTT_STATE_BACKOFF)))  {
+        go = true;
+        from = conn_state;
+        conn_state = MQTT_STATE_CONNECTING;
+        conn_stats.attempts++;
+        outage_attempts++;
+    }
+    taskEXIT_CRITICAL(&conn_lock);
+
+    if(go)  {
+        log_transition(from, MQTT_STATE_CONNECTING);
+        if(client_started)
+            ret = esp_mqtt_client_reconnect(mqtt_client);
+        else if((ret = esp_mqtt_client_start(mqtt_client)) == ESP_OK)
+            client_started = true;
+        if(ret != ESP_OK)  {
+            // no event will follow, so retry from here
+            ESP_LOGI(TAG, "connection attempt failed to start: %s", esp_err_to_name(ret));
+            schedule_retry();
+        }
+    }
+}
+
+static void backoff_expired(void *arg)
+{
+    connect_attempt();
+}
+
+/*
+ * wifi link events: hold off while there is no address, try straight away when
+ * there is one again (the broker was probably fine all along)
+ */
+static void wifi_event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    mqtt_state_t from;
+    bool backoff;
+
+    if((base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_DISCONNECTED))  {
+        taskENTER_CRITICAL(&conn_lock);
+        wifi_up = false;
+        from = conn_state;
+        if((backoff = (from == MQTT_STATE_BACKOFF)))
+            conn_state = MQTT_STATE_WAIT_WIFI;
+        taskEXIT_CRITICAL(&conn_lock);
+        if(backoff)  {
+            esp_timer_stop(backoff_timer);
+            log_transition(from, MQTT_STATE_WAIT_WIFI);
+        }
+        // a live connection is left for the client to notice (keepalive)
+    }
+    else if((base == IP_EVENT) && (event_id == IP_EVENT_STA_GOT_IP))  {
+        taskENTER_CRITICAL(&conn_lock);
+        wifi_up = true;
+        backoff_step = 0;
+        backoff = (conn_state == MQTT_STATE_BACKOFF);
+        taskEXIT_CRITICAL(&conn_lock);
+        if(backoff)
+            esp_timer_stop(backoff_timer);  // (connect_attempt() takes it from BACKOFF)
+        connect_attempt();
+    }
+}
+
+/*
+ * broker connected: subscribe if the session wasn't kept, time the outage
+ */
+static void on_connected(esp_mqtt_client_handle_t client, bool session_present)
+{
+    uint32_t connect_ms, attempts;
+    mqtt_state_t from;
+    int msg_id;
+
+    esp_timer_stop(backoff_timer);
+    mqtt_connected = true;
+    boot_mark(BOOT_PHASE_MQTT_UP);
+
+    taskENTER_CRITICAL(&conn_lock);
+    from = conn_state;
+    conn_state = MQTT_STATE_CONNECTED;
+    backoff_step = 0;
+    connect_ms = (uint32_t)((esp_timer_get_time() - down_since_us) / 1000);
+    attempts = outage_attempts;
+    conn_stats.connects++;
+    conn_stats.last_attempts = attempts;
+    conn_stats.last_connect_ms = connect_ms;
+    conn_stats.session_resumed = session_present;
+    outage_attempts = 0;
+    first_pub_pending = true;
+    taskEXIT_CRITICAL(&conn_lock);
+    log_transition(from, MQTT_STATE_CONNECTED);
+    ESP_LOGI(TAG, "connected after %" PRIu32 " mS (%" PRIu32 " attempts), session %s",
+             connect_ms, attempts, session_present ? "resumed" : "new");
+
+    msg_id = esp_mqtt_client_publish(client, MQTT_STATUS_TOPIC, MQTT_STATUS_ONLINE, 0, 1, 1);
+    ESP_LOGI(TAG, "sent status publish successful, msg_id=%d", msg_id);
+
+    if(!session_present)  {
+        msg_id = esp_mqtt_client_subscribe(client, TRACE_CMD_TOPIC, 1);
+        ESP_LOGI(TAG, "sent subscribe %s, msg_id=%d", TRACE_CMD_TOPIC, msg_id);
+        msg_id = esp_mqtt_client_subscribe(client, DEVICE_CMD_TOPIC, 1);
+        ESP_LOGI(TAG, "sent subscribe %s, msg_id=%d", DEVICE_CMD_TOPIC, msg_id);
+    }
+    sensor_record_publish_schema();
+}
+
+static void on_disconnected(void)
+{
+    mqtt_connected = false;
+    schedule_retry();
+}
+
 static void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0) {
@@ -71,26 +300,15 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        msg_id = esp_mqtt_client_publish(client, "/topic/qos1", "data_3", 0, 1, 0);
-        ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
-
-        msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-
-        msg_id = esp_mqtt_client_subscribe(client, "/topic/qos1", 1);
-        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-
-        msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
-        ESP_LOGI(TAG, "sent unsubscribe successful, msg_id=%d", msg_id);
+        on_connected(client, event->session_present);
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        on_disconnected();
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-        msg_id = esp_mqtt_client_publish(client, "/topic/qos0", "data", 0, 0, 0);
-        ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
         break;
     case MQTT_EVENT_UNSUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
@@ -99,9 +317,14 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_DATA:
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-        printf("DATA=%.*s\r\n", event->data_len, event->data);
+        ESP_LOGI(TAG, "MQTT_EVENT_DATA %.*s (%d bytes)", event->topic_len, event->topic, event->data_len);
+        // (payloads are parsed where they are, in the event's buffer, so only whole ones)
+        if(event->data_len != event->total_data_len)
+            ESP_LOGI(TAG, "ignoring a message too big for the receive buffer");
+        else if((event->topic_len == strlen(TRACE_CMD_TOPIC)) && (strncmp(event->topic, TRACE_CMD_TOPIC, event->topic_len) == 0))
+            trace_command(event->data, event->data_len);
+        else if((event->topic_len == strlen(DEVICE_CMD_TOPIC)) && (strncmp(event->topic, DEVICE_CMD_TOPIC, event->topic_len) == 0))
+            device_cmd_handle(event->data, event->data_len);
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -127,10 +350,30 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
  */
 void mqtt_app_start(void)
 {
+    const esp_timer_create_args_t backoff_args = {
+        .callback = backoff_expired,
+        .name = "mqtt_backoff",
+    };
+    bool got_ip;
+
+    ESP_ERROR_CHECK(esp_timer_create(&backoff_args, &backoff_timer));
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-    esp_mqtt_client_start(mqtt_client);
+
+    // (after the client exists: wifi may already be getting its address)
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &wifi_event_handler, NULL, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, NULL));
+
+    // the client is started by the first attempt, once wifi has an address
+    // (wifi_init_sta() doesn't wait for it)
+    got_ip = (wifi_connect_status(false) == 1);
+    taskENTER_CRITICAL(&conn_lock);
+    down_since_us = esp_timer_get_time();
+    if(got_ip)
+        wifi_up = true;  // (never cleared here: the event may have come in meanwhile)
+    taskEXIT_CRITICAL(&conn_lock);
+    connect_attempt();
 }
 
 /*
@@ -141,4 +384,63 @@ esp_mqtt_client_handle_t get_mqtt_handle(void)
     return(mqtt_client);
 }
 
+/*
+ * true if the broker connection is up
+ */
+bool mqtt_is_connected(void)
+{
+    return(mqtt_connected);
+}
+
+/*
+ * bytes waiting in the client's outbox (QoS 1/2 messages not yet acknowledged)
+ */
+int mqtt_outbox_size(void)
+{
+    if(mqtt_client == NULL)
+        return(0);
+    return(esp_mqtt_client_get_outbox_size(mqtt_client));
+}
+
+mqtt_state_t mqtt_state(void)
+{
+    return(conn_state);
+}
 
+const char *mqtt_state_name(mqtt_state_t state)
+{
+    if((state < 0) || (state >= MQTT_STATE_COUNT))
+        return("?");
+    return(mqtt_state_names[state]);
+}
+
+void mqtt_get_conn_stats(mqtt_conn_stats_t *stats)
+{
+    taskENTER_CRITICAL(&conn_lock);
+    *stats = conn_stats;
+    taskEXIT_CRITICAL(&conn_lock);
+}
+
+/*
+ * a publish was accepted by the client (called by mqtt_pub_send()): the first one
+ * after a connect ends the outage
+ */
+void mqtt_note_publish(void)
+{
+    uint32_t first_pub_ms = 0;
+    bool first = false;
+
+    if(!first_pub_pending)
+        return;
+    taskENTER_CRITICAL(&conn_lock);
+    if(first_pub_pending)  {
+        first = true;
+        first_pub_pending = false;
+        first_pub_ms = (uint32_t)((esp_timer_get_time() - down_since_us) / 1000);
+        conn_stats.last_first_pub_ms = first_pub_ms;
+    }
+    taskEXIT_CRITICAL(&conn_lock);
+    if(first)
+        DLOGI(TAG, "first publish %" PRIu32 " mS after the connection was lost (connack at %" PRIu32 " mS)",
+              first_pub_ms, conn_stats.last_connect_ms);
+}
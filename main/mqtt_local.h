@@ -12,8 +12,78 @@
 
 #include "mqtt_client.h"
 
+/*
+ * node status: retained "online" published on connect, the broker publishes the
+ * retained last will "offline" if the node goes away without disconnecting
+ */
+#define MQTT_STATUS_TOPIC "esp32/status"
+#define MQTT_STATUS_ONLINE "online"
+#define MQTT_STATUS_OFFLINE "offline"
+
+/*
+ * connection state machine: the client's own reconnect is off, attempts are made
+ * from here.  a lost connection is retried after a jittered exponential backoff
+ * (half the step fixed, half random, so a broker restart isn't met by every node at
+ * once); nothing is tried while wifi has no address, and an attempt is made as soon
+ * as it gets one.
+ *
+ * the session is persistent (clean session off, the client id is fixed per chip), so
+ * after a reconnect the broker still has the subscriptions (they are only sent again
+ * if it reports no session) and delivers the QoS 1 commands sent while we were away.
+ */
+#define MQTT_STATE_TABLE(X) \
+    X(WAIT_WIFI,  "wait_wifi")   /* link down, no attempts */      \
+    X(CONNECTING, "connecting")  /* attempt in progress */         \
+    X(CONNECTED,  "connected")                                     \
+    X(BACKOFF,    "backoff")     /* waiting to try again */
+
+typedef enum {
+#define MQTT_STATE_ID(name, label) MQTT_STATE_##name,
+    MQTT_STATE_TABLE(MQTT_STATE_ID)
+#undef MQTT_STATE_ID
+    MQTT_STATE_COUNT,
+} mqtt_state_t;
+
+#define MQTT_BACKOFF_MIN_MS 500
+#define MQTT_BACKOFF_MAX_MS 30000
+#define MQTT_NETWORK_TIMEOUT_MS 5000
+
+/*
+ * QoS 1/2 messages queued during an outage wait in the client's outbox (heap): at
+ * most this many bytes of them.  they expire after CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS
+ * (sdkconfig.defaults), which is set long enough to ride out an outage
+ */
+#define MQTT_OUTBOX_LIMIT 16384
+
+/*
+ * keepalive: a few telemetry intervals (telemetry.h), so a half open connection is
+ * found (and the broker sends the will) in seconds rather than the 2 minute default,
+ * while the periodic publishes mean a ping is rarely needed
+ */
+#define MQTT_KEEPALIVE_S 10
+
+/*
+ * reconnect timing, for telemetry.  an outage is timed from the disconnect (or from
+ * mqtt_app_start() for the first connect) to the CONNACK, and to the first
+ * application publish the client accepts after it
+ */
+typedef struct {
+    uint32_t connects;          // CONNACKs
+    uint32_t attempts;          // connection attempts
+    uint32_t last_attempts;     // attempts the last outage took
+    uint32_t last_connect_ms;   // last outage: disconnect to CONNACK
+    uint32_t last_first_pub_ms; // last outage: disconnect to first publish
+    bool session_resumed;       // the broker still had our session at the last connect
+} mqtt_conn_stats_t;
+
 void mqtt_app_start(void);
 esp_mqtt_client_handle_t get_mqtt_handle(void);
+bool mqtt_is_connected(void);
+int mqtt_outbox_size(void);
+mqtt_state_t mqtt_state(void);
+const char *mqtt_state_name(mqtt_state_t state);
+void mqtt_get_conn_stats(mqtt_conn_stats_t *stats);
+void mqtt_note_publish(void);
 
 #define __MQTT_LOCAL_H__
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+/*
+ * mqtt_pub.c
+ *
+ * payload buffer pool, the publish call and burst scheduling (see mqtt_pub.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+
+#include "monitoring_zimknives.h"
+#if PUB_SCHED_LIGHT_SLEEP && CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#include "mqtt_pub.h"
+#include "mqtt_local.h"
+#include "pub_sched.h"
+#include "app_tasks.h"
+#include "trace.h"
+#include "boot_phase.h"
+
+#if PUB_SCHED_ENABLE && (MQTT_PUB_BURST_INTERVAL_MS >= (MQTT_KEEPALIVE_S * 1000))
+#error "MQTT_PUB_BURST_INTERVAL_MS must be under the mqtt keepalive, or pings wake the radio between bursts"
+#endif
+#if PUB_SCHED_ENABLE && FAST_STREAM_ENABLE
+#warning "FAST_STREAM_ENABLE with PUB_SCHED_ENABLE: waveform blocks go out every ~0.5 S, the radio won't sleep between bursts"
+#endif
+
+static const char *TAG = "mqtt_pub";  // for logging
+
+static char pool[MQTT_PUB_POOL_BUFS][MQTT_PUB_BUF_LEN];
+static uint32_t pool_free = (1UL << MQTT_PUB_POOL_BUFS) - 1;  // bit n set: pool[n] is free
+static mqtt_pub_stats_t pub_stats = { .pool_min_free = MQTT_PUB_POOL_BUFS };
+static portMUX_TYPE pub_lock = portMUX_INITIALIZER_UNLOCKED;  // pool, stats, schedule and burst buffer
+
+/*
+ * a held back message in defer_buf: this header, then the payload, padded to 4 bytes
+ */
+typedef struct {
+    const char *topic;  // interned (see mqtt_pub.h)
+    uint16_t len;
+    uint8_t qos;
+    uint8_t retain;
+} defer_hdr_t;
+
+#define DEFER_SIZE(len) ((sizeof(defer_hdr_t) + (len) + 3) & ~3)
+
+static pub_sched_t sched;
+static bool sched_started = false;
+static uint8_t defer_buf[MQTT_PUB_DEFER_LEN] __attribute__((aligned(4)));
+static size_t defer_len = 0;
+static bool flushing = false;  // the pub_sched task is sending defer_buf: keep adding to it
+
+static uint8_t pool_count(uint32_t bits)  {
+    uint8_t n = 0;
+
+    for(; bits; bits &= bits - 1)
+        n++;
+    return(n);
+}
+
+/*
+ * take a MQTT_PUB_BUF_LEN byte payload buffer, NULL if they are all in use
+ */
+char *mqtt_pub_buf_get(void)  {
+    char *buf = NULL;
+    uint8_t n, free_now;
+
+    taskENTER_CRITICAL(&pub_lock);
+    if(pool_free != 0)  {
+        n = __builtin_ctz(pool_free);
+        pool_free &= ~(1UL << n);
+        buf = pool[n];
+        free_now = pool_count(pool_free);
+        if(free_now < pub_stats.pool_min_free)
+            pub_stats.pool_min_free = free_now;
+    }
+    else
+        pub_stats.pool_empty++;
+    taskEXIT_CRITICAL(&pub_lock);
+    return(buf);
+}
+
+/*
+ * give a buffer back (once its message has been handed to mqtt_pub_send())
+ */
+void mqtt_pub_buf_put(char *buf)  {
+    int n;
+
+    if(buf == NULL)
+        return;
+    n = (buf - pool[0]) / MQTT_PUB_BUF_LEN;
+    if((n < 0) || (n >= MQTT_PUB_POOL_BUFS) || (buf != pool[n]))
+        return;
+    taskENTER_CRITICAL(&pub_lock);
+    pool_free |= (1UL << n);
+    taskEXIT_CRITICAL(&pub_lock);
+}
+
+/*
+ * publish now, whatever the schedule (the client has copied or sent data when this
+ * returns, so a pool buffer can be put back right after).  QoS 1/2 is queued even
+ * while mqtt is down: the outbox sends it after the reconnect
+ * returns the message id (0 for QoS 0), or -1
+ */
+int mqtt_pub_send_now(const char *topic, const char *data, int len, int qos, int retain)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    bool connected = mqtt_is_connected();
+    int msg_id = -1;
+
+    if(connected || ((qos > 0) && (get_mqtt_handle() != NULL)))  {
+        TRACE_INSTANT(MQTT_PUBLISH, len);
+        if(qos == 0)
+            msg_id = esp_mqtt_client_publish(get_mqtt_handle(), topic, data, len, 0, retain);
+        else
+            msg_id = esp_mqtt_client_enqueue(get_mqtt_handle(), topic, data, len, qos, retain, true);
+    }
+
+    taskENTER_CRITICAL(&pub_lock);
+    if(msg_id < 0)
+        pub_stats.failed++;
+    else  {
+        pub_stats.messages++;
+        pub_stats.bytes += len;
+        if(qos > 0)
+            pub_stats.outbox++;
+        if(connected)
+            pub_sched_note_send(&sched, now_ms, len);
+    }
+    taskEXIT_CRITICAL(&pub_lock);
+    if((msg_id >= 0) && connected)  {
+        mqtt_note_publish();  // times the first one after a reconnect
+        boot_mark(BOOT_PHASE_FIRST_PUBLISH);
+    }
+    return(msg_id);
+}
+
+/*
+ * publish with the next burst: held back (returns 0) unless a burst is open, or
+ * sent now as mqtt_pub_send_now() (topic must be interned, see mqtt_pub.h)
+ */
+int mqtt_pub_send(const char *topic, const char *data, int len, int qos, int retain)  {
+#if PUB_SCHED_ENABLE
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    defer_hdr_t hdr = { .topic = topic, .len = len, .qos = qos, .retain = retain };
+    bool held = false;
+
+    if(sched_started && mqtt_is_connected() && (len <= UINT16_MAX))  {
+        taskENTER_CRITICAL(&pub_lock);
+        if(flushing || !pub_sched_is_open(&sched, now_ms))  {
+            if((defer_len + DEFER_SIZE(len)) <= sizeof(defer_buf))  {
+                memcpy(&defer_buf[defer_len], &hdr, sizeof(hdr));
+                memcpy(&defer_buf[defer_len + sizeof(hdr)], data, len);
+                defer_len += DEFER_SIZE(len);
+                pub_stats.deferred++;
+                held = true;
+            }
+            else
+                pub_stats.defer_full++;
+        }
+        taskEXIT_CRITICAL(&pub_lock);
+        if(held)
+            return(0);
+    }
+#endif
+    return(mqtt_pub_send_now(topic, data, len, qos, retain));
+}
+
+#if PUB_SCHED_ENABLE
+/*
+ * sends what was held back at each burst, then opens the burst for MQTT_PUB_BURST_WINDOW_MS.
+ * messages added while it sends go out in the same burst, in order: nothing is sent
+ * straight away until defer_buf is empty
+ */
+static void pub_sched_task(void *pvParameters)  {
+    defer_hdr_t hdr;
+    size_t off;
+    int64_t wait_ms;
+    bool done;
+
+    for(;;)  {
+        taskENTER_CRITICAL(&pub_lock);
+        wait_ms = pub_sched_wait_ms(&sched, esp_timer_get_time() / 1000);
+        flushing = (wait_ms == 0);
+        taskEXIT_CRITICAL(&pub_lock);
+        if(wait_ms > 0)  {
+            vTaskDelay((TickType_t)((wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS));
+            continue;
+        }
+
+        // (defer_buf below defer_len doesn't change until it is emptied here)
+        for(off = 0; ; off += DEFER_SIZE(hdr.len))  {
+            taskENTER_CRITICAL(&pub_lock);
+            if((done = (off >= defer_len)))  {
+                defer_len = 0;
+                flushing = false;
+                pub_sched_open(&sched, esp_timer_get_time() / 1000);
+            }
+            taskEXIT_CRITICAL(&pub_lock);
+            if(done)
+                break;
+            memcpy(&hdr, &defer_buf[off], sizeof(hdr));
+            mqtt_pub_send_now(hdr.topic, (const char *)&defer_buf[off + sizeof(hdr)], hdr.len, hdr.qos, hdr.retain);
+        }
+        vTaskDelay((MQTT_PUB_BURST_WINDOW_MS + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    }
+}
+#endif
+
+/*
+ * start the burst schedule (PUB_SCHED_ENABLE): modem sleep between bursts, and the
+ * task that sends them.  without it the radio-on estimate still runs, for comparison
+ */
+void mqtt_pub_sched_start(void)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+
+#if PUB_SCHED_ENABLE
+    pub_sched_init(&sched, MQTT_PUB_BURST_INTERVAL_MS, MQTT_PUB_BURST_WINDOW_MS, MQTT_PUB_LISTEN_INTERVAL, now_ms);
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+#if PUB_SCHED_LIGHT_SLEEP
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm));
+#else
+    ESP_LOGW(TAG, "PUB_SCHED_LIGHT_SLEEP needs CONFIG_PM_ENABLE (see sdkconfig.defaults), modem sleep only");
+#endif
+#endif
+    sched_started = (app_task_create(APP_TASK_PUB_SCHED, pub_sched_task, NULL) != NULL);
+    ESP_LOGI(TAG, "publishing in bursts every %d mS, modem sleep (listen interval %d)",
+             MQTT_PUB_BURST_INTERVAL_MS, MQTT_PUB_LISTEN_INTERVAL);
+#else
+    pub_sched_init(&sched, 0, 0, 1, now_ms);  // the driver's default power save wakes every beacon
+#endif
+}
+
+void mqtt_pub_get_stats(mqtt_pub_stats_t *stats)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+
+    taskENTER_CRITICAL(&pub_lock);
+    pub_stats.bursts = sched.bursts;
+    pub_stats.wakes = sched.wakes;
+    pub_stats.radio_ms_h = pub_sched_radio_ms_per_hour(&sched, now_ms);
+    *stats = pub_stats;
+    taskEXIT_CRITICAL(&pub_lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * mqtt_pub.h
+ *
+ * the application's publish path, built so that steady state publishing takes
+ * nothing from the heap:
+ *   - topics are fixed strings, interned when the registries are built (sensor and
+ *     rollup topics are literals generated from SENSOR_TABLE/ROLLUP_TIER_TABLE), so
+ *     nothing is formatted or allocated per message for them
+ *   - payloads are serialized into a small pool of reusable buffers
+ *     (mqtt_pub_buf_get()/mqtt_pub_buf_put()) instead of each task's stack
+ *   - QoS 0 goes straight out with esp_mqtt_client_publish(), which serializes into
+ *     the client's preallocated buffer: no allocation
+ *   - QoS 1/2 is handed over with esp_mqtt_client_enqueue(), which doesn't block the
+ *     calling task on the network; the client keeps a heap copy in its outbox until
+ *     the broker acknowledges it.  that copy is the one allocation left, and the
+ *     "outbox" counter counts it per message.  it is queued while mqtt is down too,
+ *     and goes out after the reconnect (up to MQTT_OUTBOX_LIMIT bytes, mqtt_local.h)
+ * so periodic data (samples, telemetry, the waveform) is QoS 0 and only events that
+ * must survive a reconnect (rollups, alarm transitions) pay for an outbox copy.
+ *
+ * burst scheduling (PUB_SCHED_ENABLE, monitoring_zimknives.h): mqtt_pub_send() holds
+ * messages back in a MQTT_PUB_DEFER_LEN byte buffer and the pub_sched task sends
+ * them together every MQTT_PUB_BURST_INTERVAL_MS (see pub_sched.h), with the station
+ * in modem sleep (WIFI_PS_MAX_MODEM, waking every MQTT_PUB_LISTEN_INTERVAL beacons)
+ * in between.  topics are kept as pointers, which the interned topics make safe.
+ * what is published while a burst is open goes straight out, and so does anything
+ * that doesn't fit the buffer.  mqtt_pub_send_now() skips the schedule: alarm
+ * transitions, command replies, the schema on connect, and the trace and waveform
+ * streams (with FAST_STREAM_ENABLE the radio hardly sleeps, so it is off by default
+ * when the schedule is on).
+ * the radio-on estimate (mS per hour) counts every message either way, so builds
+ * with and without the schedule can be compared; telemetry carries it.
+ */
+
+#ifndef __MQTT_PUB_H__
+
+#include "esp_system.h"  // for types (at least)
+
+#define MQTT_PUB_POOL_BUFS 4   // payload buffers (at most 32)
+#define MQTT_PUB_BUF_LEN 192   // largest pooled payload (alarm transitions)
+
+#define MQTT_PUB_BURST_INTERVAL_MS 5000  // under the mqtt keepalive, so bursts stand in for pings
+#define MQTT_PUB_BURST_WINDOW_MS 200     // a burst stays open this long after the held messages
+#define MQTT_PUB_LISTEN_INTERVAL 3       // beacons per wake in modem sleep
+#define MQTT_PUB_DEFER_LEN 4096          // held back messages (topic pointer, lengths and payload)
+
+typedef struct {
+    uint32_t messages;       // handed to the client
+    uint32_t bytes;          // payload bytes handed to the client
+    uint32_t outbox;         // messages the client had to copy into its outbox (heap)
+    uint32_t failed;         // refused by the client (or not connected)
+    uint32_t pool_empty;     // mqtt_pub_buf_get() found no free buffer
+    uint8_t pool_min_free;   // fewest free pool buffers seen
+    uint32_t deferred;       // held back for a burst
+    uint32_t defer_full;     // sent straight away, the burst buffer was full
+    uint32_t bursts;         // bursts opened
+    uint32_t wakes;          // estimated radio wakes for sends
+    uint32_t radio_ms_h;     // estimated radio-on mS per hour
+} mqtt_pub_stats_t;
+
+char *mqtt_pub_buf_get(void);
+void mqtt_pub_buf_put(char *buf);
+int mqtt_pub_send(const char *topic, const char *data, int len, int qos, int retain);
+int mqtt_pub_send_now(const char *topic, const char *data, int len, int qos, int retain);
+void mqtt_pub_sched_start(void);
+void mqtt_pub_get_stats(mqtt_pub_stats_t *stats);
+
+#define __MQTT_PUB_H__
+#endif
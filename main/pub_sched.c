@@ -0,0 +1,110 @@
+/*
+ * pub_sched.c
+ *
+ * publish burst scheduling and the radio-on estimate (see pub_sched.h)
+ */
+
+#include "pub_sched.h"
+
+/*
+ * a fresh schedule: the first burst opens at now_ms, which is also the grid origin
+ */
+void pub_sched_init(pub_sched_t *s, uint32_t interval_ms, uint32_t window_ms, uint8_t listen_interval, int64_t now_ms)  {
+    s->interval_ms = interval_ms;
+    s->window_ms = window_ms;
+    s->listen_interval = (listen_interval > 0) ? listen_interval : 1;
+    s->epoch_ms = now_ms;
+    s->next_ms = now_ms;
+    s->open_until_ms = now_ms;
+    s->awake_until_ms = now_ms;
+    s->bursts = 0;
+    s->wakes = 0;
+    s->hour_start_ms = now_ms;
+    s->on_ms = 0;
+    s->last_hour_ms = -1;
+}
+
+/*
+ * true if a message can go out now: a burst is open, or is due and opens
+ */
+bool pub_sched_open(pub_sched_t *s, int64_t now_ms)  {
+    if((s->interval_ms == 0) || (now_ms < s->open_until_ms))
+        return(true);
+    if(now_ms < s->next_ms)
+        return(false);
+
+    s->open_until_ms = now_ms + s->window_ms;
+    s->next_ms = s->epoch_ms + (((now_ms - s->epoch_ms) / s->interval_ms) + 1) * s->interval_ms;
+    s->bursts++;
+    return(true);
+}
+
+/*
+ * true if a burst is open (never opens one)
+ */
+bool pub_sched_is_open(const pub_sched_t *s, int64_t now_ms)  {
+    return((s->interval_ms == 0) || (now_ms < s->open_until_ms));
+}
+
+/*
+ * mS until the next burst is due, 0 if one is open or due now
+ */
+int64_t pub_sched_wait_ms(const pub_sched_t *s, int64_t now_ms)  {
+    if((s->interval_ms == 0) || (now_ms < s->open_until_ms) || (now_ms >= s->next_ms))
+        return(0);
+    return(s->next_ms - now_ms);
+}
+
+/*
+ * radio-on for elapsed_ms of which on_ms were sending: the rest is asleep,
+ * listening for a beacon every listen interval
+ */
+static float radio_on_ms(const pub_sched_t *s, float on_ms, float elapsed_ms)  {
+    float asleep_ms = elapsed_ms - on_ms;
+
+    if(asleep_ms < 0)
+        asleep_ms = 0;
+    return(on_ms + (asleep_ms / (s->listen_interval * PUB_SCHED_BEACON_TU_MS)) * PUB_SCHED_BEACON_MS);
+}
+
+/*
+ * close the estimate's hour(s) that ended before now_ms
+ */
+static void roll_hour(pub_sched_t *s, int64_t now_ms)  {
+    while((now_ms - s->hour_start_ms) >= PUB_SCHED_HOUR_MS)  {
+        s->last_hour_ms = radio_on_ms(s, s->on_ms, PUB_SCHED_HOUR_MS);
+        s->hour_start_ms += PUB_SCHED_HOUR_MS;
+        s->on_ms = 0;
+    }
+}
+
+/*
+ * a message of bytes went out at now_ms (scheduled or not)
+ */
+void pub_sched_note_send(pub_sched_t *s, int64_t now_ms, uint32_t bytes)  {
+    roll_hour(s, now_ms);
+    if(now_ms >= s->awake_until_ms)  {
+        s->on_ms += PUB_SCHED_WAKE_MS + PUB_SCHED_TAIL_MS;
+        s->wakes++;
+    }
+    else
+        s->on_ms += (float)(now_ms + PUB_SCHED_TAIL_MS - s->awake_until_ms);
+    s->awake_until_ms = now_ms + PUB_SCHED_TAIL_MS;
+    s->on_ms += (bytes * 8.0f) / PUB_SCHED_TX_KBPS;
+}
+
+/*
+ * estimated radio-on mS per hour: the last whole hour, or the current one so far
+ * scaled to an hour
+ */
+uint32_t pub_sched_radio_ms_per_hour(pub_sched_t *s, int64_t now_ms)  {
+    float elapsed_ms;
+
+    roll_hour(s, now_ms);
+    if(s->last_hour_ms >= 0)
+        return((uint32_t)s->last_hour_ms);
+    elapsed_ms = (float)(now_ms - s->hour_start_ms);
+    if(elapsed_ms <= 0)
+        return(0);
+    return((uint32_t)(radio_on_ms(s, s->on_ms, elapsed_ms) * (PUB_SCHED_HOUR_MS / elapsed_ms)));
+}
@@ -0,0 +1,64 @@
+/*
+ * pub_sched.h
+ *
+ * publish burst scheduling and the radio-on estimate.
+ *
+ * outgoing traffic is held back and sent together in bursts on a fixed grid of
+ * interval_ms (burst n starts at n * interval_ms after the epoch given to
+ * pub_sched_init()), so the radio wakes once per interval instead of whenever some
+ * task happens to publish.  a burst is opened by pub_sched_open() (the one caller
+ * that sends what was held back) and stays open for window_ms; pub_sched_is_open()
+ * tells the others whether to send straight away.  a burst that was missed (the
+ * caller was late) is not made up: the next one is the next grid point after now.
+ *
+ * radio-on estimate: every message is noted with pub_sched_note_send().  a send
+ * keeps the radio up for PUB_SCHED_TAIL_MS (the station's idle time before it goes
+ * back to modem sleep); one that finds it asleep also pays PUB_SCHED_WAKE_MS.  the
+ * air time is the bytes at PUB_SCHED_TX_KBPS, and while asleep the station wakes for
+ * a beacon every listen interval (PUB_SCHED_BEACON_MS each).  the result is mS of
+ * radio-on per hour, extrapolated over the current hour until a whole one has
+ * passed, then the last whole hour.  these are models of the station, not
+ * measurements, good for comparing schedules rather than for a power budget.
+ *
+ * this is plain C, with no ESP-IDF or FreeRTOS dependency and no locking (the caller
+ * serializes), so it builds and runs on a host as well: test/host/test_pub_sched.c
+ * is its unit test.  times are mS from any monotonic clock.
+ */
+
+#ifndef __PUB_SCHED_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PUB_SCHED_TAIL_MS 40     // radio stays up after a send
+#define PUB_SCHED_WAKE_MS 3      // leaving modem sleep
+#define PUB_SCHED_TX_KBPS 2000   // effective mqtt/tcp throughput
+#define PUB_SCHED_BEACON_MS 3    // one beacon listen while asleep
+#define PUB_SCHED_BEACON_TU_MS 102.4f  // beacon interval (100 TU)
+#define PUB_SCHED_HOUR_MS 3600000
+
+typedef struct {
+    uint32_t interval_ms;    // between bursts, 0: no bursts (everything goes straight out)
+    uint32_t window_ms;      // how long a burst stays open
+    uint8_t listen_interval; // beacons per wake while asleep
+    int64_t epoch_ms;        // grid origin
+    int64_t next_ms;         // start of the next burst
+    int64_t open_until_ms;   // end of the current burst (<= now: closed)
+    int64_t awake_until_ms;  // the radio is up until then (estimate)
+    uint32_t bursts;         // bursts opened
+    uint32_t wakes;          // sends that found the radio asleep (estimate)
+    /* estimate, over the hour starting at hour_start_ms */
+    int64_t hour_start_ms;
+    float on_ms;             // radio on for sends (beacons are added for the rest)
+    float last_hour_ms;      // whole hour estimate, < 0: none yet
+} pub_sched_t;
+
+void pub_sched_init(pub_sched_t *s, uint32_t interval_ms, uint32_t window_ms, uint8_t listen_interval, int64_t now_ms);
+bool pub_sched_open(pub_sched_t *s, int64_t now_ms);
+bool pub_sched_is_open(const pub_sched_t *s, int64_t now_ms);
+int64_t pub_sched_wait_ms(const pub_sched_t *s, int64_t now_ms);
+void pub_sched_note_send(pub_sched_t *s, int64_t now_ms, uint32_t bytes);
+uint32_t pub_sched_radio_ms_per_hour(pub_sched_t *s, int64_t now_ms);
+
+#define __PUB_SCHED_H__
+#endif
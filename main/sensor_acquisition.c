@@ -4,122 +4,774 @@
  * 
  */
 
+#include <stdio.h>
+#include <math.h>
+
 #include "esp_log.h"
+#include "esp_timer.h"
+
+#include "monitoring_zimknives.h"
 
 #include "sensor_acquisition.h"
+#include "mqtt_local.h"
+#include "mqtt_pub.h"
+#include "sensor_alarm.h"
+#include "sensor_rollup.h"
+#include "sensor_record.h"
+#include "device_cmd.h"
+#include "boot_phase.h"
 
 static const char *TAG = "sensor_acquisition";  // for logging
 
 /*
  * sensor includes
-
- * also, provide the storage location for data (exposed through sensors[].data)
+ * (the registry itself, SENSOR_TABLE, is in sensor_acquisition.h)
  */
+#include "i2c_bus.h"
 #include "htu21d.h"
-static float humidity = 0;
-static float temperature = 0;
+#include "trace.h"
+#include "dlog.h"
+#include "app_tasks.h"
+static int htu21d_sensor_init(void);
 
+static const sensor_driver_t htu21d_humidity_driver = {
+    htu21d_sensor_init, ht21d_trigger_humidity, ht21d_collect, ht21d_humidity_conversion_ms
+};
+static const sensor_driver_t htu21d_temperature_driver = {
+    htu21d_sensor_init, ht21d_trigger_temperature, ht21d_collect, ht21d_temperature_conversion_ms
+};
 
 /*
- * structure to manage acquisition and storage of sensor value
- *  acq function               data storage            data type   label                 mqtt topic           acq?  pub?   disp?  valid?
+ * device numbers (sensors[].device)
  */
-sensor_data_t sensors[] =  {
-  { ht21d_acquire_humidity,    (void *)(&humidity),    PARM_FLOAT, "HTU21D humidity",    "esp32/humidity",    true, false, false, false },
-  { ht21d_acquire_temperature, (void *)(&temperature), PARM_FLOAT, "HTU21D temperature", "esp32/temperature", true, false, false, false },
-  { NULL, (void *)(0), PARM_UND, "end of sensors", "", false, false, false, false },
+#define SENSOR_DEV_HTU21D 0
+
+
+/*
+ * structure to manage acquisition and storage of sensor value, generated from SENSOR_TABLE
+ */
+#define SENSOR_ENTRY(name, type, acq, drv, dev, label, topic, grp, pub, disp, db_abs, db_rel, db_silence, scale, offset, a_floor, a_ceiling, a_fast, a_slow) \
+  [SENSOR_##name] = { acq, drv, dev, { 0 }, PARM_##type, label, topic, SENSOR_GROUP_##grp, pub, disp, false, false, \
+                      { db_abs, db_rel, db_silence }, { scale, offset }, { a_floor, a_ceiling, a_fast, a_slow }, 0, 0 },
+
+sensor_data_t sensors[SENSOR_COUNT] =  {
+  SENSOR_TABLE(SENSOR_ENTRY)
 };
+#undef SENSOR_ENTRY
+
+/*
+ * raw code history, indexed like sensors[]
+ */
+typedef struct {
+  uint16_t raw[SENSOR_HISTORY_LEN];
+  uint32_t t_ms[SENSOR_HISTORY_LEN];  // when each was taken (low 32 bits of esp_timer mS)
+  uint8_t head;   // next slot to write
+  uint8_t count;  // valid entries
+} sensor_history_t;
+
+static sensor_history_t history[SENSOR_COUNT];
+
+static void history_push(int i, uint16_t raw, uint32_t t_ms)  {
+    sensor_history_t *h = &history[i];
+
+    h->raw[h->head] = raw;
+    h->t_ms[h->head] = t_ms;
+    h->head = (h->head + 1) % SENSOR_HISTORY_LEN;
+    if(h->count < SENSOR_HISTORY_LEN)
+        h->count++;
+}
+
+/*
+ * rate of change of sensors[i] (units per minute, absolute) from its history:
+ * newest sample against the oldest one within SENSOR_ADAPT_SPAN_MS (at least the
+ * previous one).  returns false if there aren't two samples yet
+ */
+static bool history_rate(int i, float *rate)  {
+    sensor_history_t *h = &history[i];
+    int newest, k, back;
+    uint32_t dt;
+
+    if(h->count < 2)
+        return(false);
+
+    newest = (h->head + SENSOR_HISTORY_LEN - 1) % SENSOR_HISTORY_LEN;
+    back = 1;
+    for(int n = 2; n < h->count; n++)  {
+        k = (h->head + SENSOR_HISTORY_LEN - 1 - n) % SENSOR_HISTORY_LEN;
+        if((h->t_ms[newest] - h->t_ms[k]) > SENSOR_ADAPT_SPAN_MS)
+            break;
+        back = n;
+    }
+    k = (h->head + SENSOR_HISTORY_LEN - 1 - back) % SENSOR_HISTORY_LEN;
+
+    dt = h->t_ms[newest] - h->t_ms[k];
+    if(dt == 0)
+        return(false);
+    *rate = fabsf((float)(sensor_convert_centi(i, h->raw[newest]) - sensor_convert_centi(i, h->raw[k])))
+            * 0.01f * 60000.0f / (float)dt;
+    return(true);
+}
+
+/*
+ * pick the next sampling interval of an adaptive sensor after a new sample
+ * (see sensor_adapt_t)
+ */
+static void adapt_interval(int i)  {
+    const sensor_adapt_t *a = &sensors[i].adapt;
+    uint32_t interval = sensors[i].interval_ms;
+    float rate;
+
+    if((a->floor_ms == 0) || !history_rate(i, &rate))
+        return;
+
+    if(rate > a->fast_rate)
+        interval = a->floor_ms;
+    else if(rate < a->slow_rate)
+        interval = ((interval * 2) < a->ceiling_ms) ? (interval * 2) : a->ceiling_ms;
+
+    if(interval != sensors[i].interval_ms)
+        DLOGI(TAG, "%s: %.2f/min, sampling every %" PRIu32 " mS", sensors[i].label, rate, interval);
+    sensors[i].interval_ms = interval;
+}
+
+/*
+ * current sampling interval of sensors[i] (mS)
+ */
+uint32_t sensor_interval_ms(int i)  {
+    if((i < 0) || (i >= SENSOR_COUNT))
+        return(0);
+    return(sensors[i].interval_ms);
+}
+
+/*
+ * publish suppression state, indexed like sensors[]
+ */
+typedef struct {
+  bool published;       // false until the first publish
+  float last;           // last published value
+  int64_t last_ms;      // when it was last published (esp_timer mS)
+} sensor_publish_state_t;
+
+static sensor_publish_state_t publish_state[SENSOR_COUNT];
 
 /*
  * mutex to protect the structure from collisions
  */
 SemaphoreHandle_t sensor_data_mutex = NULL;
+static StaticSemaphore_t sensor_data_mutex_buf;
 
 /*
- * initialize all of the sensors.
- * since all are a bit unique in their initialization requirements,
- * just brute force code them serially here.
+ * HTU21D device init (shared by its humidity and temperature entries)
  */
-void sensor_init_slow(void)  {
+static int htu21d_sensor_init(void)  {
     int   reterr = HTU21D_ERR_OK;
 
-    sensor_data_mutex = xSemaphoreCreateRecursiveMutex();
-
-    if((reterr = htu21d_init(I2C_NUM_0, 21, 22,  GPIO_PULLUP_ONLY,  GPIO_PULLUP_ONLY)) == HTU21D_ERR_OK)
-        ESP_LOGI(TAG, "HTU21D init OK\n");
-    else
+    if((reterr = htu21d_init(SENSOR_I2C_PORT)) != HTU21D_ERR_OK)  {
         ESP_LOGI(TAG, "HTU21D init returned error code %d\n", reterr);
+        return(0);
+    }
+
+    ESP_LOGI(TAG, "HTU21D init OK\n");
+    if((reterr = ht21d_set_resolution(HTU21D_RESOLUTION)) != HTU21D_ERR_OK)
+        ESP_LOGI(TAG, "HTU21D set resolution returned error code %d\n", reterr);
+    ESP_LOGI(TAG, "HTU21D resolution 0x%02x: humidity %" PRIu32 " mS, temperature %" PRIu32 " mS, %" PRIu32 ".%" PRIu32 " samples/sec",
+             htu21d_active_resolution(),
+             htu21d_conversion_ms(TRIGGER_HUMD_MEASURE_NOHOLD, htu21d_active_resolution()),
+             htu21d_conversion_ms(TRIGGER_TEMP_MEASURE_NOHOLD, htu21d_active_resolution()),
+             htu21d_samples_per_sec_x10(htu21d_active_resolution()) / 10,
+             htu21d_samples_per_sec_x10(htu21d_active_resolution()) % 10);
+
+#if HTU21D_BENCHMARK
+    htu21d_benchmark();
+#endif
+    return(1);
 }
 
 /*
- * cause acquisition cycle for all sensors with sensors[].slow_acq set true
+ * initialize all of the sensors:
+ * bring up the bus, then run each device's init once
  */
-void acquire_sensors(void)  {
-    int i = 0;
-    int ret = 0;
+void sensor_init_slow(void)  {
+    esp_err_t ret;
+    bool done;
+
+    sensor_data_mutex = xSemaphoreCreateRecursiveMutexStatic(&sensor_data_mutex_buf);
+
+    if((ret = i2c_bus_init(SENSOR_I2C_PORT, SENSOR_I2C_SDA, SENSOR_I2C_SCL,  GPIO_PULLUP_ONLY,  GPIO_PULLUP_ONLY, SENSOR_I2C_CLK_HZ)) != ESP_OK)
+        ESP_LOGI(TAG, "i2c bus init returned %s\n", esp_err_to_name(ret));
+
+    for(int i = 0; i < SENSOR_COUNT; i++)  {
+        if((sensors[i].driver == NULL) || (sensors[i].driver->init == NULL))
+            continue;
+        done = false;
+        for(int j = 0; j < i; j++)
+            if((sensors[j].driver != NULL) && (sensors[j].device == sensors[i].device))
+                done = true;
+        if(!done)
+            sensors[i].driver->init();
+    }
+}
+
+/*
+ * the groups, generated from SENSOR_GROUP_TABLE
+ */
+typedef struct {
+    app_task_t task;
+    uint32_t period_ms;
+    bool display;
+} sensor_group_config_t;
+
+#define SENSOR_GROUP_ENTRY(name, period_ms, display) \
+    [SENSOR_GROUP_##name] = { APP_TASK_ACQ_##name, period_ms, display },
+static const sensor_group_config_t group_config[SENSOR_GROUP_COUNT] = {
+    SENSOR_GROUP_TABLE(SENSOR_GROUP_ENTRY)
+};
+#undef SENSOR_GROUP_ENTRY
+
+/*
+ * a sample has arrived for sensors[i] (ret as returned by the driver):
+ * store it and pass it to the alarm engine right away.
+ * sensor_data_mutex is only held for this, not across the conversion waits,
+ * so the groups (and the readers of sensors[]) don't hold each other up
+ */
+static void sample_arrived(int i, int ret, const sensor_value_t *v)  {
+    float value;
+
+    if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) != pdTRUE)  {
+        DLOGI(TAG, "warning: can't take sensor_data_mutex ... %s sample dropped", sensors[i].label);
+        return;
+    }
+
+    TRACE_INSTANT(ACQ_SAMPLE, i);
+    boot_mark(BOOT_PHASE_FIRST_SAMPLE);
+    sensors[i].valid = (ret == 1);
+    sensors[i].fresh = true;
+    if(sensors[i].valid)
+        sensors[i].value = *v;
+    if(sensors[i].valid && (sensors[i].data_type == PARM_RAW16))  {
+        history_push(i, sensors[i].value.val_RAW16, (uint32_t)(esp_timer_get_time() / 1000));
+        adapt_interval(i);
+    }
+    if(sensor_value_float(i, &value))
+        sensor_alarm_evaluate(i, value);  // alarms react to each sample as it arrives
+
+    xSemaphoreGiveRecursive(sensor_data_mutex);
+    DLOGD(TAG, "%s acquire returned %s", sensors[i].label, (ret == 1) ? "success" : "fail");
+}
+
+/*
+ * per-entry state of one split phase acquisition cycle
+ */
+typedef enum {
+    ACQ_IDLE,       // not part of this cycle (or finished)
+    ACQ_WAITING,    // waiting for its device to be free
+    ACQ_CONVERTING, // triggered, result due at ready_ms
+} acq_phase_t;
+
+static bool device_busy(const acq_phase_t *phase, int n, uint8_t device)  {
+    for(int i = 0; i < n; i++)
+        if((phase[i] == ACQ_CONVERTING) && (sensors[i].device == device))
+            return(true);
+    return(false);
+}
+
+/*
+ * start the next waiting entry on every device that is free
+ */
+static void trigger_free_devices(acq_phase_t *phase, int64_t *ready_ms, int n)  {
+    for(int i = 0; i < n; i++)  {
+        if((phase[i] != ACQ_WAITING) || device_busy(phase, n, sensors[i].device))
+            continue;
+        if(sensors[i].driver->trigger() == 1)  {
+            phase[i] = ACQ_CONVERTING;
+            ready_ms[i] = (esp_timer_get_time() / 1000) + sensors[i].driver->conversion_ms();
+        }
+        else  {
+            phase[i] = ACQ_IDLE;
+            sample_arrived(i, 0, NULL);
+        }
+    }
+}
+
+/*
+ * cause acquisition cycle for all sensors in a group
+ *
+ * split phase entries are all triggered up front (one at a time per device) and
+ * collected in the order their conversions finish; blocking (acq_fcn only) entries
+ * run while those conversions are in progress.
+ * each new sample is passed to the alarm engine as soon as it is acquired
+ * (all entries of one device must be in the same group, see sensor_groups_start())
+ *
+ * only the members that are due (sensors[].next_ms) are sampled, they are marked fresh.
+ * returns when the next member is due (esp_timer mS)
+ */
+int64_t acquire_sensors(sensor_group_t group)  {
+    acq_phase_t phase[SENSOR_COUNT];
+    int64_t ready_ms[SENSOR_COUNT];
+    bool due[SENSOR_COUNT];
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    int64_t wake_ms = INT64_MAX;
+    int64_t heartbeat_ms, alarm_ms;
+    const int n = SENSOR_COUNT;
+    sensor_value_t v;
+    int next, ret, retries;
+
+    if(sensor_data_mutex == NULL)  {
+        ESP_LOGE(TAG, "error: sensor_data_mutex not initialized");
+        return(now_ms + group_config[group].period_ms);
+    }
+
+    for(int i = 0; i < n; i++)  {
+        due[i] = (sensors[i].group == group) && (now_ms >= sensors[i].next_ms);
+        if(sensors[i].group == group)
+            sensors[i].fresh = false;
+        phase[i] = (due[i] && (sensors[i].driver != NULL)) ? ACQ_WAITING : ACQ_IDLE;
+    }
+
+    trigger_free_devices(phase, ready_ms, n);
+
+    // blocking sensors overlap with the conversions started above
+    for(int i = 0; i < n; i++)  {
+        if(due[i] && (sensors[i].driver == NULL) && (sensors[i].acq_fcn != NULL))  {
+            ret = sensors[i].acq_fcn(&v);
+            sample_arrived(i, ret, &v);
+        }
+    }
+
+    // collect in order of completion, starting the next conversion on that device
+    for(;;)  {
+        next = -1;
+        for(int i = 0; i < n; i++)
+            if((phase[i] == ACQ_CONVERTING) && ((next < 0) || (ready_ms[i] < ready_ms[next])))
+                next = i;
+        if(next < 0)
+            break;
+
+        now_ms = esp_timer_get_time() / 1000;
+        if(ready_ms[next] > now_ms)
+            vTaskDelay((TickType_t)((ready_ms[next] - now_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS));
+
+        for(retries = 0; ; retries++)  {
+            ret = sensors[next].driver->collect(&v);
+            if((ret != SENSOR_NOT_READY) || (retries >= SENSOR_COLLECT_RETRIES))
+                break;
+            vTaskDelay(1);
+        }
+        phase[next] = ACQ_IDLE;
+        sample_arrived(next, (ret == 1) ? 1 : 0, &v);
+        trigger_free_devices(phase, ready_ms, n);
+    }
 
     /*
-     * if the sensors[] data structure can be taken/held,
-     * acquire all sensor data
-     * (mutex unavailability is not a fatal error ... try next cycle)
+     * schedule the next sample on the same cadence (the interval may have just changed),
+     * or from now if the schedule has fallen a whole interval behind
      */
-    if(sensor_data_mutex != NULL)  {
-        if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS)  == pdTRUE)  {
-            ESP_LOGI(TAG, "acquire_sensors(): sensor_data_mutex was taken");
-            while(sensors[i].acq_fcn != NULL)  {
-                if(sensors[i].slow_acq == true)  {
-                ret = sensors[i].acq_fcn(sensors[i].data);
-                ESP_LOGI(TAG, "%s acquire returned %s", sensors[i].label, (ret ? "success" : "fail" ));
-                i++;
-                }
-            }
-            xSemaphoreGiveRecursive(sensor_data_mutex);  // release the data structure
-            ESP_LOGI(TAG, "acquire_sensors(): sensor_data_mutex given back");
+    for(int i = 0; i < n; i++)  {
+        if(sensors[i].group != group)
+            continue;
+        if(due[i])  {
+            sensors[i].next_ms += sensors[i].interval_ms;
+            if(sensors[i].next_ms <= now_ms)
+                sensors[i].next_ms = now_ms + sensors[i].interval_ms;
+        }
+        heartbeat_ms = publish_state[i].last_ms + sensors[i].deadband.max_silence_ms;
+        if(sensors[i].publish && publish_state[i].published && (sensors[i].deadband.max_silence_ms > 0) &&
+           (heartbeat_ms < sensors[i].next_ms))
+            sensors[i].next_ms = (heartbeat_ms > now_ms) ? heartbeat_ms : now_ms;  // sample for the heartbeat
+        alarm_ms = sensor_alarm_due_ms(i);
+        if((alarm_ms > now_ms) && (alarm_ms < sensors[i].next_ms))
+            sensors[i].next_ms = alarm_ms;  // sample when an alarm hold ends
+        if(sensors[i].next_ms < wake_ms)
+            wake_ms = sensors[i].next_ms;
+    }
+    return(wake_ms);
+}
+
+/*
+ * take the settings staged by device_cmd for this group's members (and the HTU21D
+ * resolution if the device is in this group).  called between cycles, so nothing
+ * changes under a conversion in flight
+ */
+static void apply_pending_config(sensor_group_t group)  {
+    device_cmd_sensor_t cfg;
+    uint8_t resolution;
+    bool htu21d = false;
+    int64_t now_ms;
+    int ret;
+
+    for(int i = 0; i < SENSOR_COUNT; i++)
+        if((sensors[i].group == group) && (sensors[i].driver != NULL) && (sensors[i].device == SENSOR_DEV_HTU21D))
+            htu21d = true;
+    if(htu21d && device_cmd_take_resolution(&resolution))  {
+        ret = ht21d_set_resolution(resolution);
+        ESP_LOGI(TAG, "HTU21D resolution 0x%02x %s (humidity %" PRIu32 " mS, temperature %" PRIu32 " mS)",
+                 resolution, (ret == HTU21D_ERR_OK) ? "set" : "failed",
+                 ht21d_humidity_conversion_ms(), ht21d_temperature_conversion_ms());
+    }
+
+    for(int i = 0; i < SENSOR_COUNT; i++)  {
+        if((sensors[i].group != group) || !device_cmd_take_sensor(i, &cfg))
+            continue;
+        if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) != pdTRUE)  {
+            ESP_LOGI(TAG, "warning: can't take sensor_data_mutex ... %s settings dropped", sensors[i].label);
+            continue;
+        }
+        if(cfg.set & DEVICE_CMD_SET_INTERVAL)  {
+            sensors[i].adapt.floor_ms = cfg.floor_ms;
+            sensors[i].adapt.ceiling_ms = cfg.ceiling_ms;
+            if(cfg.floor_ms == 0)
+                sensors[i].interval_ms = group_config[group].period_ms;
+            else if(sensors[i].interval_ms < cfg.floor_ms)
+                sensors[i].interval_ms = cfg.floor_ms;
+            else if(sensors[i].interval_ms > cfg.ceiling_ms)
+                sensors[i].interval_ms = cfg.ceiling_ms;
+            now_ms = esp_timer_get_time() / 1000;
+            if(sensors[i].next_ms > now_ms + sensors[i].interval_ms)
+                sensors[i].next_ms = now_ms + sensors[i].interval_ms;  // don't wait out the old interval
+        }
+        if(cfg.set & DEVICE_CMD_SET_DEADBAND)  {
+            sensors[i].deadband.abs = cfg.deadband.abs;
+            sensors[i].deadband.rel = cfg.deadband.rel;
+        }
+        if(cfg.set & DEVICE_CMD_SET_SILENCE)
+            sensors[i].deadband.max_silence_ms = cfg.deadband.max_silence_ms;
+        if(cfg.set & DEVICE_CMD_SET_PUBLISH)
+            sensors[i].publish = cfg.publish;
+        xSemaphoreGiveRecursive(sensor_data_mutex);
+
+        ESP_LOGI(TAG, "%s: interval %" PRIu32 " mS (%" PRIu32 "-%" PRIu32 "), deadband %.3f %.3f %" PRIu32 " mS, publish %s",
+                 sensors[i].label, sensors[i].interval_ms, sensors[i].adapt.floor_ms, sensors[i].adapt.ceiling_ms,
+                 sensors[i].deadband.abs, sensors[i].deadband.rel, sensors[i].deadband.max_silence_ms,
+                 sensors[i].publish ? "on" : "off");
+    }
+}
+
+static sensor_group_stats_t group_stats[SENSOR_GROUP_COUNT];
+static portMUX_TYPE group_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * one per group: acquire whichever members are due, hand the new samples on,
+ * then sleep until the next member is due (every period for fixed rate members)
+ */
+static void sensor_group_task(void *pvParameters)  {
+    sensor_group_t group = (sensor_group_t)(intptr_t)pvParameters;
+    const sensor_group_config_t *cfg = &group_config[group];
+    sensor_group_stats_t *st = &group_stats[group];
+    int64_t start_us, wake_ms, now_ms;
+    uint32_t took_us;
+    bool overrun;
+
+    ESP_LOGI(TAG, "%s: every %" PRIu32 " mS on core %d", app_task_name(cfg->task), cfg->period_ms, xPortGetCoreID());
+
+    while(1)  {
+        start_us = esp_timer_get_time();
+        TRACE_BEGIN(ACQ_CYCLE, group);
+
+        apply_pending_config(group);   // runtime settings from DEVICE_CMD_TOPIC
+        wake_ms = acquire_sensors(group);
+        sensor_alarm_publish();        // alarm transitions (the leds were already updated during acquisition)
+        sensor_rollup_update(group);   // rollups are published as their windows close
+        publish_sensors(group);        // raw samples, only for sensors switched on with sensor_set_publish()
+        if(cfg->display)
+            display_sensors(group);
+
+        now_ms = esp_timer_get_time() / 1000;
+        took_us = (uint32_t)(esp_timer_get_time() - start_us);
+        TRACE_END(ACQ_CYCLE, group);
+        overrun = (wake_ms <= now_ms);  // already late for the next one
+
+        taskENTER_CRITICAL(&group_stats_lock);
+        st->cycles++;
+        st->last_us = took_us;
+        if(took_us > st->max_us)
+            st->max_us = took_us;
+        if(overrun)
+            st->overruns++;
+        taskEXIT_CRITICAL(&group_stats_lock);
+
+        if(overrun)  {
+            if((st->overruns % SENSOR_GROUP_OVERRUN_LOG) == 1)
+                DLOGI(TAG, "%s overrun: cycle took %" PRIu32 " uS (%" PRIu32 " overruns in %" PRIu32 " cycles)",
+                         app_task_name(cfg->task), took_us, st->overruns, st->cycles);
+            vTaskDelay(1);  // don't starve the lower priority tasks
+        }
+        else  // (sensor_groups_wake() cuts the sleep short)
+            ulTaskNotifyTake(pdTRUE, (TickType_t)((wake_ms - now_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS));
+    }
+}
+
+/*
+ * run every group's next cycle now, e.g. to take new settings without waiting
+ * out a long adaptive interval (members that aren't due still aren't sampled)
+ */
+void sensor_groups_wake(void)  {
+    TaskHandle_t task;
+
+    for(int g = 0; g < SENSOR_GROUP_COUNT; g++)
+        if((task = app_task_handle(group_config[g].task)) != NULL)
+            xTaskNotifyGive(task);
+}
+
+/*
+ * create a task for each group that has members
+ * (call after sensor_init_slow(), sensor_rollup_init() and sensor_alarm_init())
+ */
+void sensor_groups_start(void)  {
+    int members;
+
+    // a device can only be sequenced within one group
+    for(int i = 0; i < SENSOR_COUNT; i++)
+        for(int j = 0; j < i; j++)
+            if((sensors[i].driver != NULL) && (sensors[j].driver != NULL) &&
+               (sensors[i].device == sensors[j].device) && (sensors[i].group != sensors[j].group))
+                ESP_LOGE(TAG, "error: %s and %s share a device but not a group", sensors[j].label, sensors[i].label);
+
+    // sampling intervals start at the group period (within the adaptive limits)
+    for(int i = 0; i < SENSOR_COUNT; i++)  {
+        if(sensors[i].group >= SENSOR_GROUP_COUNT)
+            continue;
+        sensors[i].interval_ms = group_config[sensors[i].group].period_ms;
+        if(sensors[i].adapt.floor_ms != 0)  {
+            if(sensors[i].interval_ms < sensors[i].adapt.floor_ms)
+                sensors[i].interval_ms = sensors[i].adapt.floor_ms;
+            if(sensors[i].interval_ms > sensors[i].adapt.ceiling_ms)
+                sensors[i].interval_ms = sensors[i].adapt.ceiling_ms;
         }
-        else
-            ESP_LOGI(TAG, "warning: can't take sensor_data_mutex ... try next time");
+        sensors[i].next_ms = esp_timer_get_time() / 1000;
+    }
+
+    for(int g = 0; g < SENSOR_GROUP_COUNT; g++)  {
+        members = 0;
+        for(int i = 0; i < SENSOR_COUNT; i++)
+            if(sensors[i].group == g)
+                members++;
+        if(members == 0)
+            continue;
+
+        if(app_task_create(group_config[g].task, sensor_group_task, (void *)(intptr_t)g) != NULL)
+            ESP_LOGI(TAG, "%s started with %d sensors", app_task_name(group_config[g].task), members);
+    }
+}
+
+bool sensor_group_get_stats(sensor_group_t group, sensor_group_stats_t *stats)  {
+    if(group >= SENSOR_GROUP_COUNT)
+        return(false);
+
+    taskENTER_CRITICAL(&group_stats_lock);
+    *stats = group_stats[group];
+    taskEXIT_CRITICAL(&group_stats_lock);
+    return(true);
+}
+
+/*
+ * per-type display and value functions, selected at compile time by each
+ * SENSOR_TABLE entry's type (display_<type>(), value_float_<type>()).
+ * only the types the table uses are referenced, so they are all marked unused
+ */
+static void __attribute__((unused)) display_INT(int i)  {
+    DLOGI(TAG, "%s =  %d", sensors[i].label, sensors[i].value.val_INT);
+}
+
+static void __attribute__((unused)) display_FLOAT(int i)  {
+    DLOGI(TAG, "%s =  %f", sensors[i].label, sensors[i].value.val_FLOAT);
+}
+
+static void __attribute__((unused)) display_BOOL(int i)  {
+    DLOGI(TAG, "%s =  %d", sensors[i].label, sensors[i].value.val_BOOL);
+}
+
+static void __attribute__((unused)) display_STRING(int i)  {
+    ESP_LOGI(TAG, "%s =  %s", sensors[i].label, sensors[i].value.val_STRING);  // not deferred: the string may not outlive the line
+}
+
+static void __attribute__((unused)) display_RAW16(int i)  {
+    if(sensors[i].valid)  {
+        int32_t centi = sensor_convert_centi(i, sensors[i].value.val_RAW16);
+        int32_t mag = (centi < 0) ? -centi : centi;  // (abs() is int, not int32_t)
+        DLOGI(TAG, "%s =  %s%" PRId32 ".%02" PRId32, sensors[i].label, (centi < 0) ? "-" : "", mag / 100, mag % 100);
     }
     else
-        ESP_LOGE(TAG, "error: sensor_data_mutex not initialized");
+        DLOGI(TAG, "%s =  (invalid)", sensors[i].label);
+}
+
+static bool __attribute__((unused)) value_float_INT(int i, float *value)  {
+    *value = (float)sensors[i].value.val_INT;
+    return(true);
+}
+
+static bool __attribute__((unused)) value_float_FLOAT(int i, float *value)  {
+    *value = sensors[i].value.val_FLOAT;
+    return(true);
+}
+
+static bool __attribute__((unused)) value_float_BOOL(int i, float *value)  {
+    *value = sensors[i].value.val_BOOL ? 1.0f : 0.0f;
+    return(true);
+}
+
+static bool __attribute__((unused)) value_float_STRING(int i, float *value)  {
+    return(false);
+}
+
+static bool __attribute__((unused)) value_float_RAW16(int i, float *value)  {
+    *value = (float)sensor_convert_centi(i, sensors[i].value.val_RAW16) * 0.01f;
+    return(true);
 }
 
+#define SENSOR_VALUE_FCN(name, type, ...) [SENSOR_##name] = value_float_##type,
+static bool (*const value_float_fcn[SENSOR_COUNT])(int i, float *value) = {
+    SENSOR_TABLE(SENSOR_VALUE_FCN)
+};
+#undef SENSOR_VALUE_FCN
+
 /*
- * display data for all sensors using label in sensors.label
+ * display data for the sensors in a group using label in sensors.label
+ * (unrolled: one direct call per SENSOR_TABLE entry)
  */
-void display_sensors(void)  {
-  int i = 0;
+void display_sensors(sensor_group_t group)  {
 
     if(sensor_data_mutex != NULL)  {
         if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS)  == pdTRUE)  {
-            ESP_LOGI(TAG, "display_sensors(): sensor_data_mutex taken");
-            while(sensors[i].acq_fcn != NULL)  {
-                switch(sensors[i].data_type) {
+            DLOGD(TAG, "display_sensors(): sensor_data_mutex taken");
+#define SENSOR_DISPLAY(name, type, ...) if(sensors[SENSOR_##name].group == group) display_##type(SENSOR_##name);
+            SENSOR_TABLE(SENSOR_DISPLAY)
+#undef SENSOR_DISPLAY
+            xSemaphoreGiveRecursive(sensor_data_mutex);  // release the data structure
+            DLOGD(TAG, "display_sensors(): sensor_data_mutex given back");
+        }
+    }
+}
 
-                case PARM_INT:
-                    ESP_LOGI(TAG, "%s =  %d", sensors[i].label, *((int *)(sensors[i].data)));
-                break;
+/*
+ * return the latest value of sensors[i] as a float
+ * returns false (and leaves *value alone) if there isn't a valid numeric value
+ * (caller is expected to hold sensor_data_mutex)
+ */
+bool sensor_value_float(int i, float *value)  {
+    if((i < 0) || (i >= SENSOR_COUNT) || !sensors[i].valid)
+        return(false);
 
-                case PARM_FLOAT:
-                    ESP_LOGI(TAG, "%s =  %f", sensors[i].label, *((float *)(sensors[i].data)));
-                break;
+    return(value_float_fcn[i](i, value));
+}
 
-                case PARM_BOOL:
-                    ESP_LOGI(TAG, "%s =  %d", sensors[i].label, *((bool *)(sensors[i].data)));
-                break;
+/*
+ * convert a raw code of sensors[i] to hundredths of engineering units
+ * (integer only)
+ */
+int32_t sensor_convert_centi(int i, uint16_t raw)  {
+    return((int32_t)(((uint32_t)raw * (uint32_t)sensors[i].conv.scale) >> 16) + sensors[i].conv.offset);
+}
 
-                case PARM_STRING:
-                    ESP_LOGI(TAG, "%s =  %s", sensors[i].label, (char *)(sensors[i].data));
-                break;
+/*
+ * turn raw (per sample) publishing of a sensor on or off.
+ * normally only rollups are published (see sensor_rollup.h); this
+ * provides the raw samples on demand.
+ */
+void sensor_set_publish(int i, bool publish)  {
+    if((sensor_data_mutex == NULL) || (i < 0) || (i >= SENSOR_COUNT))
+        return;
 
-                default:
-                    ESP_LOGI(TAG, "Error, can't display undefined sensor");
-                break;
+    if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) == pdTRUE)  {
+        sensors[i].publish = publish;
+        xSemaphoreGiveRecursive(sensor_data_mutex);
+    }
+}
+
+/*
+ * decide whether sensors[i]'s latest value needs to go out:
+ * first value, moved outside the deadband, or the heartbeat is due
+ */
+static bool publish_needed(int i, bool valid, float value, int64_t now_ms)  {
+    sensor_publish_state_t *ps = &publish_state[i];
+    const sensor_deadband_t *db = &sensors[i].deadband;
+    float change;
+
+    if((db->max_silence_ms > 0) && ((now_ms - ps->last_ms) >= db->max_silence_ms))
+        return(true);  // heartbeat, even if the sensor is failing
 
+    if(!valid)
+        return(false);
+
+    if(!ps->published)
+        return(true);
+
+    change = fabsf(value - ps->last);
+    if((db->abs == 0) && (db->rel == 0))
+        return(true);
+    if((db->abs > 0) && (change >= db->abs))
+        return(true);
+    if((db->rel > 0) && (change >= (db->rel * fabsf(ps->last))))
+        return(true);
+
+    return(false);
+}
+
+/*
+ * publish the latest value of the sensors in a group with sensors[].publish set
+ * to sensors[].topic, subject to each sensor's deadband/heartbeat.
+ * call once per group cycle; only freshly sampled sensors are considered
+ * (the heartbeat is timed from each sensor's last publish, see sensor_deadband_t).
+ *
+ * a heartbeat for a failing sensor is published as SENSOR_PAYLOAD_INVALID,
+ * so subscribers can tell a dead sensor from a steady one; a dead node is
+ * reported by the broker through the mqtt last will (see mqtt_local.h).
+ *
+ * with SENSOR_RECORD_ENABLE the same values go out together as one binary
+ * record on SENSOR_RECORD_TOPIC instead (see sensor_record.h), and records built
+ * while mqtt is down are kept for when it comes up
+ */
+#if SENSOR_RECORD_ENABLE
+static sensor_record_stream_t record_streams[SENSOR_GROUP_COUNT];
+#endif
+
+void publish_sensors(sensor_group_t group)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    float value = 0;
+    bool valid;
+    char *payload;
+    int len;
+#if SENSOR_RECORD_ENABLE
+    sensor_record_t rec;
+#endif
+
+    if(sensor_data_mutex == NULL)
+        return;
+    if((payload = mqtt_pub_buf_get()) == NULL)
+        return;  // pool busy: nothing is marked published, so it goes next cycle
+
+#if SENSOR_RECORD_ENABLE
+    sensor_record_start(&rec, (uint8_t *)payload, MQTT_PUB_BUF_LEN, &record_streams[group], group, now_ms);
+#endif
+    if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) == pdTRUE)  {
+        for(int i = 0; i < SENSOR_COUNT; i++)  {
+            if(sensors[i].publish && (sensors[i].group == group) && sensors[i].fresh)  {
+                valid = sensor_value_float(i, &value);
+#if SENSOR_RECORD_ENABLE
+                if(publish_needed(i, valid, value, now_ms))  {  // (kept while mqtt is down)
+                    if(!sensor_record_add(&rec, i, valid, value))
+                        continue;  // record full, this one goes next cycle
+#else
+                if(publish_needed(i, valid, value, now_ms) && mqtt_is_connected())  {
+                    if(valid)
+                        len = snprintf(payload, MQTT_PUB_BUF_LEN, "%.2f", value);
+                    else
+                        len = snprintf(payload, MQTT_PUB_BUF_LEN, "%s", SENSOR_PAYLOAD_INVALID);
+                    mqtt_pub_send(sensors[i].topic, payload, len, SENSOR_PUBLISH_QOS, 0);
+#endif
+
+                    publish_state[i].last_ms = now_ms;
+                    if(valid)  {
+                        publish_state[i].published = true;
+                        publish_state[i].last = value;
+                    }
                 }
-                i++;
             }
-            xSemaphoreGiveRecursive(sensor_data_mutex);  // release the data structure
-            ESP_LOGI(TAG, "display_sensors(): sensor_data_mutex given back");
         }
+        xSemaphoreGiveRecursive(sensor_data_mutex);
     }
+#if SENSOR_RECORD_ENABLE
+    if((len = sensor_record_finish(&rec, &record_streams[group])) > 0)
+        sensor_record_send((const uint8_t *)payload, len, SENSOR_PUBLISH_QOS);
+#endif
+    mqtt_pub_buf_put(payload);
 }
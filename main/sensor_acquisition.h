@@ -11,6 +11,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"  // for types (at least)
 
 /*
@@ -21,44 +22,229 @@
  */
 typedef int (*acquisition_function_t)(void *data);
 
+/*
+ * split phase driver: lets acquire_sensors() start every sensor's conversion and
+ * collect each one as it becomes ready, so a cycle takes about the longest conversion
+ * instead of the sum of them.
+ *
+ * sensors[] entries with the same device number share hardware (e.g. the humidity and
+ * temperature channels of one HTU21D) and are sequenced: only one of them is converting
+ * at a time.  init is called once per device (from the first entry that has one).
+ * an entry with driver == NULL is acquired with the blocking acq_fcn instead.
+ */
+#define SENSOR_NOT_READY -1  // collect(): conversion not finished yet
+
+typedef struct {
+  int (*init)(void);                // once per device: 1 for success, 0 for failure (may be NULL)
+  int (*trigger)(void);             // start a conversion: 1 for success, 0 for failure
+  int (*collect)(void *data);       // fetch the result: 1 for success, 0 for failure, SENSOR_NOT_READY
+  uint32_t (*conversion_ms)(void);  // worst case time from trigger to result
+} sensor_driver_t;
+
+/*
+ * publish suppression: a value is only published when it has moved at least
+ * abs (engineering units) or rel (fraction of the last published value) since the
+ * last publish, or when max_silence_ms have gone by without one (the heartbeat, so
+ * "unchanged" can be told from "dead").  the heartbeat is in time, not samples:
+ * a sensor is sampled when its heartbeat is due even if its (adaptive) interval
+ * would sample it later, so a subscriber can time out after max_silence_ms plus
+ * the group period, whatever the sampling rate.
+ * all zero means publish every sample.
+ */
+typedef struct {
+  float abs;                // absolute deadband
+  float rel;                // relative deadband (e.g. 0.01 = 1%)
+  uint32_t max_silence_ms;  // heartbeat: publish at least this often (0 = never)
+} sensor_deadband_t;
+
+/*
+ * adaptive sampling: each sample, the rate of change is estimated from the history
+ * (newest sample against the oldest one within SENSOR_ADAPT_SPAN_MS, or the previous
+ * one if that's further back).  above fast_rate the sensor drops straight to the
+ * floor interval, below slow_rate its interval doubles toward the ceiling, in between
+ * it holds.  floor_ms == 0 means fixed: sampled every group period.
+ * (PARM_RAW16 sensors only, they are the ones with history)
+ */
+typedef struct {
+  uint32_t floor_ms;    // shortest interval (during transients)
+  uint32_t ceiling_ms;  // longest interval (steady state)
+  float fast_rate;      // engineering units per minute
+  float slow_rate;
+} sensor_adapt_t;
+
+#define SENSOR_ADAPT_SPAN_MS 30000  // how far back to look for the rate estimate
+
+/*
+ * linear conversion of a raw code to engineering units, in fixed point:
+ *   hundredths = ((raw * scale) >> 16) + offset
+ * (scale must be < 32768 so raw * scale fits in 31 bits)
+ * only used for PARM_RAW16 sensors; conversion is done lazily when a value is
+ * displayed/published, never on the acquisition path.
+ */
+typedef struct {
+  int32_t scale;
+  int32_t offset;
+} sensor_conversion_t;
+
+/*
+ * types of sensor data
+ */
+#define PARM_UND   -1  /* undefined */
+#define PARM_INT    0
+#define PARM_FLOAT  1
+#define PARM_BOOL   2
+#define PARM_STRING 3
+#define PARM_RAW16  4  /* uint16_t raw sensor code, see sensor_conversion_t */
+
+/*
+ * acquisition groups: each group acquires its members (sensors[].group) in its own
+ * task, at its own period, so a fast sensor doesn't make the slow ones wake up with it
+ * (or the reverse).  a task is only created for a group that has members; each
+ * group's task (stack, priority, core) is APP_TASK_ACQ_<name> in app_tasks.h.
+ * (expanded in sensor_acquisition.c, where monitoring_zimknives.h is included)
+ *
+ * X(name, period (mS), display each cycle?)
+ */
+#define SENSOR_GROUP_TABLE(X) \
+  X(FAST,   10,                 false) \
+  X(MEDIUM, 1000,               false) \
+  X(SLOW,   SLOW_LOOP_INTERVAL, true)
+
+/*
+ * group ids: SENSOR_GROUP_FAST, ...  (SENSOR_GROUP_NONE: registered but not acquired)
+ */
+typedef enum {
+#define SENSOR_GROUP_ID(name, ...) SENSOR_GROUP_##name,
+  SENSOR_GROUP_TABLE(SENSOR_GROUP_ID)
+#undef SENSOR_GROUP_ID
+  SENSOR_GROUP_COUNT,
+  SENSOR_GROUP_NONE = SENSOR_GROUP_COUNT
+} sensor_group_t;
+
+/*
+ * per group timing, a cycle that ends after the next member was already due is an
+ * overrun (members a whole interval behind are rescheduled from now, not caught up)
+ */
+typedef struct {
+  uint32_t cycles;
+  uint32_t overruns;
+  uint32_t last_us;  // duration of the last cycle
+  uint32_t max_us;
+} sensor_group_stats_t;
+
+#define SENSOR_GROUP_OVERRUN_LOG 100  // log the first overrun and every this many after
+
+/*
+ * the sensor registry: one line per sensor.  the sensor ids, SENSOR_COUNT, sensors[]
+ * and the per-type dispatch are all generated from it, so adding a sensor is one line.
+ * (expanded in sensor_acquisition.c, where the drivers and devices are in scope)
+ *
+ * X(name, type, acq_fcn, driver, device, label, topic, group, pub?, disp?,
+ *   deadband abs, rel, max silence (mS), conversion scale, offset,
+ *   adaptive floor (mS), ceiling (mS), fast rate, slow rate (units/min))
+ *
+ * type is one of INT, FLOAT, BOOL, STRING, RAW16: it selects the data type (PARM_<type>),
+ * the sensor_value_t member (val_<type>) and the display/value functions for the entry.
+ * group is one of the SENSOR_GROUP_TABLE names, or NONE.  an adaptive sensor is sampled
+ * on its own interval within its group, the group task wakes for whichever is due first.
+ */
+#define SENSOR_TABLE(X) \
+  X(HUMIDITY,    RAW16, ht21d_acquire_humidity,    &htu21d_humidity_driver,    SENSOR_DEV_HTU21D, "HTU21D humidity",    "esp32/humidity",    SLOW, false, false, 0.5, 0.0, 60000, HTU21D_HUMD_SCALE_CENTI, HTU21D_HUMD_OFFSET_CENTI, 2000, 60000, 1.0, 0.25) \
+  X(TEMPERATURE, RAW16, ht21d_acquire_temperature, &htu21d_temperature_driver, SENSOR_DEV_HTU21D, "HTU21D temperature", "esp32/temperature", SLOW, false, false, 0.2, 0.0, 60000, HTU21D_TEMP_SCALE_CENTI, HTU21D_TEMP_OFFSET_CENTI, 2000, 60000, 0.3, 0.05)
+
+/*
+ * sensor ids (index into sensors[]): SENSOR_HUMIDITY, ...
+ */
+typedef enum {
+#define SENSOR_ID(name, ...) SENSOR_##name,
+  SENSOR_TABLE(SENSOR_ID)
+#undef SENSOR_ID
+  SENSOR_COUNT
+} sensor_id_t;
+
+/*
+ * groups with members, as a compile time constant (sizes the group task stacks)
+ */
+#define SENSOR_GROUP_BIT(name, type, acq_fcn, driver, device, label, topic, group, ...) | (1u << SENSOR_GROUP_##group)
+#define SENSOR_GROUPS_USED (0u SENSOR_TABLE(SENSOR_GROUP_BIT))
+#define SENSOR_GROUP_USED(g) ((SENSOR_GROUPS_USED >> (g)) & 1u)
+
+/*
+ * storage for the latest value, the member used is fixed by the entry's type
+ * (acq_fcn/collect are handed a pointer to it)
+ */
+typedef union {
+  int val_INT;
+  float val_FLOAT;
+  bool val_BOOL;
+  const char *val_STRING;
+  uint16_t val_RAW16;
+} sensor_value_t;
+
 /*
  * provide a confluence of sensor api's:
  *
- * acq_fcn provides general way to cause acquisition of data and void *data,
- * a place to store results for subsequent use (case when using)
- * 
+ * acq_fcn (or the split phase driver) provides general way to cause acquisition
+ * of data into value, the place to store results for subsequent use
  */
 typedef struct {
   acquisition_function_t  acq_fcn;    // pointer to function to cause data acquisition
-  void *data;     // pointer to actual data value
+  const sensor_driver_t *driver;  // split phase driver (NULL: use acq_fcn)
+  uint8_t device;                 // entries with the same device are sequenced
+  sensor_value_t value;   // the actual data value
   uint8_t  data_type; // type of data
   char *label;    // human readable label
   char *topic;    // topic for mqtt publish
-  bool slow_acq;  // whether to acquire on the slow loop
+  sensor_group_t group;  // acquisition group (SENSOR_GROUP_NONE: not acquired)
   bool publish;   // whether to publish this sensors result
   bool display;   // whether to display for actions that care
   bool valid;     // set true if data acquisition is successful
+  bool fresh;     // sampled in the group's latest cycle (adaptive sensors skip cycles)
+  sensor_deadband_t deadband;  // publish suppression
+  sensor_conversion_t conv;    // raw code conversion (PARM_RAW16 only)
+  sensor_adapt_t adapt;        // adaptive sampling
+  uint32_t interval_ms;        // current sampling interval
+  int64_t next_ms;             // when the next sample is due (esp_timer mS)
 } sensor_data_t;
 
 /*
- * types of sensor data
+ * per-sensor history of raw codes (PARM_RAW16 sensors only), newest last
+ * 2 bytes per sample, converted (sensor_convert_centi()) only when a value is used
  */
-#define PARM_UND   -1  /* undefined */
-#define PARM_INT    0
-#define PARM_FLOAT  1
-#define PARM_BOOL   2
-#define PARM_STRING 3
+#define SENSOR_HISTORY_LEN 32
 
-extern sensor_data_t sensors[];  // sensor acq and data structure
+#define SENSOR_PUBLISH_QOS 0  // periodic: the next sample supersedes a lost one (see mqtt_pub.h)
+#define SENSOR_PAYLOAD_INVALID "nan"  // heartbeat payload when the sensor itself is failing
+
+extern sensor_data_t sensors[SENSOR_COUNT];  // sensor acq and data structure
 extern SemaphoreHandle_t sensor_data_mutex;  // mutex for sensors[]
+
+/*
+ * the i2c bus the slow sensors are on (see i2c_bus.h)
+ */
+#define SENSOR_I2C_PORT I2C_NUM_0
+#define SENSOR_I2C_SDA 21
+#define SENSOR_I2C_SCL 22
+#define SENSOR_I2C_CLK_HZ 400000  // the HTU21D is rated for 400 kHz (the transfer timeouts are derived from this)
+
+#define SENSOR_COLLECT_RETRIES 3  // ticks to keep polling a conversion that isn't ready in time
+
 #define SENSOR_MUTEX_WAIT_TICKS (TickType_t)100  // how many ticks to wait for the sensor structure mutex
 
 /*
  * public functions
  */
 void sensor_init_slow(void);
-void acquire_sensors(void);
-void display_sensors(void);
+void sensor_groups_start(void);
+void sensor_groups_wake(void);
+int64_t acquire_sensors(sensor_group_t group);
+void display_sensors(sensor_group_t group);
+void publish_sensors(sensor_group_t group);
+bool sensor_group_get_stats(sensor_group_t group, sensor_group_stats_t *stats);
+void sensor_set_publish(int i, bool publish);
+bool sensor_value_float(int i, float *value);
+int32_t sensor_convert_centi(int i, uint16_t raw);
+uint32_t sensor_interval_ms(int i);
 
 #define __SENSOR_ACQUISITION_H__
 #endif
\ No newline at end of file
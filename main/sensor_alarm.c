@@ -0,0 +1,235 @@
+/*
+ * sensor_alarm.c
+ *
+ * threshold/alarm engine for the slow sensors (see sensor_alarm.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sensor_acquisition.h"
+#include "sensor_alarm.h"
+#include "display_neopixel.h"
+#include "mqtt_local.h"
+#include "mqtt_pub.h"
+
+static const char *TAG = "sensor_alarm";  // for logging
+
+/*
+ * the rules
+ *  sensor              kind        limit   hyst   hold (mS)
+ */
+static const alarm_rule_t alarm_rules[] = {
+    { SENSOR_HUMIDITY,    ALARM_HIGH,  60.0f, 2.0f, 10000 },
+    { SENSOR_HUMIDITY,    ALARM_LOW,   20.0f, 2.0f, 10000 },
+    { SENSOR_TEMPERATURE, ALARM_HIGH,  35.0f, 1.0f,     0 },
+};
+#define ALARM_NUM_RULES (sizeof(alarm_rules) / sizeof(alarm_rules[0]))
+
+/*
+ * compiled rule: value * sign > trip means beyond the limit,
+ * value * sign <= clear means back inside (including hysteresis)
+ */
+typedef struct {
+    float sign;
+    float trip;
+    float clear;
+    uint32_t hold_ms;
+    uint8_t rule;         // index in alarm_rules[] (for reporting)
+    alarm_state_t state;
+    int64_t since_ms;     // when the limit was first exceeded
+} alarm_compiled_t;
+
+static alarm_compiled_t compiled[ALARM_RULES_MAX];
+static uint8_t sensor_first[SENSOR_COUNT];  // first compiled rule for each sensor
+static uint8_t sensor_count[SENSOR_COUNT];  // number of compiled rules for each sensor
+static uint8_t active_count = 0;           // number of rules in ALARM_STATE_ACTIVE
+
+/*
+ * transitions waiting to be published
+ */
+typedef struct {
+    uint8_t rule;
+    bool active;
+    float value;
+    int64_t when_ms;
+} alarm_event_t;
+
+static alarm_event_t events[ALARM_EVENT_QUEUE_LEN];
+static uint8_t event_head = 0;
+static uint8_t event_count = 0;
+static uint32_t events_lost = 0;
+static portMUX_TYPE event_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * compile alarm_rules[] into the flat, per-sensor grouped table
+ */
+void sensor_alarm_init(void)  {
+    uint8_t n = 0;
+    const alarm_rule_t *r;
+
+    memset(sensor_first, 0, sizeof(sensor_first));
+    memset(sensor_count, 0, sizeof(sensor_count));
+    active_count = 0;
+
+    for(uint8_t s = 0; s < SENSOR_COUNT; s++)  {
+        sensor_first[s] = n;
+        for(uint8_t i = 0; i < ALARM_NUM_RULES; i++)  {
+            r = &alarm_rules[i];
+            if(r->sensor != s)
+                continue;
+            if(n >= ALARM_RULES_MAX)  {
+                ESP_LOGE(TAG, "error: too many alarm rules, rule %d ignored", i);
+                continue;
+            }
+            compiled[n].sign = (r->kind == ALARM_HIGH) ? 1.0f : -1.0f;
+            compiled[n].trip = compiled[n].sign * r->limit;
+            compiled[n].clear = compiled[n].sign * r->limit - r->hysteresis;
+            compiled[n].hold_ms = r->hold_ms;
+            compiled[n].rule = i;
+            compiled[n].state = ALARM_STATE_CLEAR;
+            compiled[n].since_ms = 0;
+            n++;
+            sensor_count[s]++;
+        }
+    }
+    ESP_LOGI(TAG, "%d alarm rules compiled", n);
+}
+
+static void event_queue(uint8_t rule, bool active, float value, int64_t when_ms)  {
+    taskENTER_CRITICAL(&event_lock);
+    if(event_count >= ALARM_EVENT_QUEUE_LEN)  {
+        event_head = (event_head + 1) % ALARM_EVENT_QUEUE_LEN;  // drop the oldest
+        event_count--;
+        events_lost++;
+    }
+    events[(event_head + event_count) % ALARM_EVENT_QUEUE_LEN] = (alarm_event_t){ rule, active, value, when_ms };
+    event_count++;
+    taskEXIT_CRITICAL(&event_lock);
+}
+
+/*
+ * a rule changed between clear and active:
+ * update the local indication first, then queue the transition for the broker
+ */
+static void alarm_transition(alarm_compiled_t *c, bool active, float value, int64_t now_ms)  {
+    bool was_any = (active_count > 0);
+
+    c->state = active ? ALARM_STATE_ACTIVE : ALARM_STATE_CLEAR;
+    active_count += active ? 1 : -1;
+
+    if(was_any != (active_count > 0))
+        display_alarm_set(active_count > 0);
+
+    event_queue(c->rule, active, value, now_ms);
+}
+
+/*
+ * run the rules for one sensor against its newest sample
+ * (call from the acquisition loop as each sample arrives)
+ */
+void sensor_alarm_evaluate(int sensor, float value)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    alarm_compiled_t *c;
+    float v;
+
+    if((sensor < 0) || (sensor >= SENSOR_COUNT))
+        return;
+
+    for(uint8_t i = sensor_first[sensor]; i < (sensor_first[sensor] + sensor_count[sensor]); i++)  {
+        c = &compiled[i];
+        v = c->sign * value;
+
+        switch(c->state)  {
+            case ALARM_STATE_CLEAR:
+                if(v > c->trip)  {
+                    c->since_ms = now_ms;
+                    if(c->hold_ms == 0)
+                        alarm_transition(c, true, value, now_ms);
+                    else
+                        c->state = ALARM_STATE_PENDING;
+                }
+            break;
+
+            case ALARM_STATE_PENDING:
+                if(v <= c->trip)
+                    c->state = ALARM_STATE_CLEAR;  // didn't last long enough, nothing to report
+                else if((now_ms - c->since_ms) >= c->hold_ms)
+                    alarm_transition(c, true, value, now_ms);
+            break;
+
+            case ALARM_STATE_ACTIVE:
+                if(v <= c->clear)
+                    alarm_transition(c, false, value, now_ms);
+            break;
+        }
+    }
+}
+
+/*
+ * when the next sample of a sensor is needed to decide a pending rule (the end of
+ * its hold time), INT64_MAX if none is pending.  holds are only checked as samples
+ * arrive, so the acquisition loop schedules one for then rather than waiting out an
+ * adaptive interval that may be much longer than the hold
+ */
+int64_t sensor_alarm_due_ms(int sensor)  {
+    int64_t due_ms = INT64_MAX;
+    alarm_compiled_t *c;
+
+    if((sensor < 0) || (sensor >= SENSOR_COUNT))
+        return(due_ms);
+
+    for(uint8_t i = sensor_first[sensor]; i < (sensor_first[sensor] + sensor_count[sensor]); i++)  {
+        c = &compiled[i];
+        if((c->state == ALARM_STATE_PENDING) && ((c->since_ms + c->hold_ms) < due_ms))
+            due_ms = c->since_ms + c->hold_ms;
+    }
+    return(due_ms);
+}
+
+/*
+ * publish the queued transitions (oldest first) if the broker is up,
+ * otherwise leave them queued for next time
+ */
+void sensor_alarm_publish(void)  {
+    alarm_event_t e;
+    char *payload;
+    const alarm_rule_t *r;
+    int len;
+
+    while(mqtt_is_connected() && (event_count > 0))  {
+        if((payload = mqtt_pub_buf_get()) == NULL)
+            break;  // left queued for next time
+
+        taskENTER_CRITICAL(&event_lock);
+        if(event_count == 0)  {
+            taskEXIT_CRITICAL(&event_lock);
+            mqtt_pub_buf_put(payload);
+            break;
+        }
+        e = events[event_head];
+        event_head = (event_head + 1) % ALARM_EVENT_QUEUE_LEN;
+        event_count--;
+        taskEXIT_CRITICAL(&event_lock);
+
+        r = &alarm_rules[e.rule];
+        len = snprintf(payload, MQTT_PUB_BUF_LEN,
+                       "{\"rule\":%d,\"sensor\":\"%s\",\"kind\":\"%s\",\"state\":\"%s\",\"value\":%.2f,\"limit\":%.2f,\"t_ms\":%" PRId64 ",\"lost\":%" PRIu32 "}",
+                       e.rule, sensors[r->sensor].label, (r->kind == ALARM_HIGH) ? "high" : "low",
+                       e.active ? "active" : "clear", e.value, r->limit, e.when_ms, events_lost);
+        ESP_LOGI(TAG, "alarm transition %s", payload);
+        mqtt_pub_send_now(ALARM_TOPIC, payload, len, ALARM_QOS, 0);
+        mqtt_pub_buf_put(payload);
+    }
+}
+
+/*
+ * true if any rule is currently in alarm
+ */
+bool sensor_alarm_any_active(void)  {
+    return(active_count > 0);
+}
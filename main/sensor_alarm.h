@@ -0,0 +1,58 @@
+/*
+ * sensor_alarm.h
+ *
+ * threshold/alarm engine for the slow sensors
+ *
+ * rules are per-sensor high or low limits with hysteresis and a hold time.
+ * alarm_rules[] (sensor_alarm.c) is compiled once at init into a flat table grouped
+ * by sensor, with the limits pre-normalized so every rule is evaluated the same way
+ * (value * sign > trip).  sensor_alarm_evaluate() is called for each new sample
+ * and only looks at that sensor's rules.  while a rule is waiting out its hold time,
+ * sensor_alarm_due_ms() tells the acquisition loop when to take the sample that
+ * decides it.
+ *
+ * a state change drives the alarm segment on the neopixel strip immediately
+ * (in the acquisition task, no broker involved) and queues a transition event;
+ * sensor_alarm_publish() sends the queued transitions when the broker is reachable.
+ * only transitions are published, never the steady state.
+ */
+
+#ifndef __SENSOR_ALARM_H__
+
+#include "esp_system.h"  // for types (at least)
+
+#define ALARM_TOPIC "esp32/alarm"
+#define ALARM_QOS 1
+#define ALARM_RULES_MAX 16        // capacity of the compiled rule table
+#define ALARM_EVENT_QUEUE_LEN 16  // transitions held while the broker is unreachable
+
+typedef enum {
+    ALARM_HIGH,  // trips when the value goes above the limit
+    ALARM_LOW,   // trips when the value goes below the limit
+} alarm_kind_t;
+
+typedef enum {
+    ALARM_STATE_CLEAR,
+    ALARM_STATE_PENDING,  // beyond the limit, waiting out the hold time
+    ALARM_STATE_ACTIVE,
+} alarm_state_t;
+
+/*
+ * rule as written by a human
+ */
+typedef struct {
+    uint8_t sensor;       // sensor id (SENSOR_HUMIDITY, ...)
+    alarm_kind_t kind;
+    float limit;
+    float hysteresis;     // how far back inside the limit the value must go to clear
+    uint32_t hold_ms;     // how long the limit must be exceeded to trip (0 = immediately)
+} alarm_rule_t;
+
+void sensor_alarm_init(void);
+void sensor_alarm_evaluate(int sensor, float value);
+int64_t sensor_alarm_due_ms(int sensor);
+void sensor_alarm_publish(void);
+bool sensor_alarm_any_active(void);
+
+#define __SENSOR_ALARM_H__
+#endif
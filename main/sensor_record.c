@@ -0,0 +1,285 @@
+/*
+ * sensor_record.c
+ *
+ * binary sensor record encoder and its schema message (see sensor_record.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "monitoring_zimknives.h"
+#include "sensor_record.h"
+#include "mqtt_pub.h"
+#include "mqtt_local.h"
+
+static const char *TAG = "sensor_record";  // for logging
+
+#define SENSOR_RECORD_OFS_FLAGS 1
+#define SENSOR_RECORD_OFS_COUNT 3
+
+static char schema[SENSOR_RECORD_SCHEMA_LEN];
+static int schema_len = 0;
+
+/*
+ * records kept while mqtt is down, a ring: oldest at backlog_head
+ */
+static uint8_t backlog[SENSOR_RECORD_BACKLOG][SENSOR_RECORD_MAX_SIZE];
+static uint8_t backlog_len[SENSOR_RECORD_BACKLOG];
+static int backlog_head = 0;
+static int backlog_count = 0;
+static uint32_t backlog_dropped = 0;
+static portMUX_TYPE backlog_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * little endian field helpers
+ */
+static uint8_t *put_le16(uint8_t *p, uint16_t v)  {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return(p + 2);
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v)  {
+    p = put_le16(p, v & 0xffff);
+    return(put_le16(p, v >> 16));
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)  {
+    while(v >= 0x80)  {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return(p);
+}
+
+/*
+ * begin a record for group at when_ms in buf (at least SENSOR_RECORD_HEADER_MAX bytes).
+ * the stream isn't changed until sensor_record_finish(), so a record that ends up
+ * empty can just be dropped
+ */
+void sensor_record_start(sensor_record_t *rec, uint8_t *buf, size_t size,
+                         const sensor_record_stream_t *stream, uint8_t group, int64_t when_ms)  {
+    bool sync = (stream->until_sync == 0) || (when_ms < stream->last_ms);
+    uint8_t *p = buf;
+
+    *p++ = SENSOR_RECORD_SCHEMA_ID;
+    *p++ = sync ? SENSOR_RECORD_F_SYNC : 0;
+    *p++ = group;
+    *p++ = 0;  // entries, counted by sensor_record_add()
+    p = put_le16(p, stream->seq);
+    p = put_varint(p, (uint64_t)(sync ? when_ms : (when_ms - stream->last_ms)));
+
+    rec->buf = buf;
+    rec->size = size;
+    rec->len = p - buf;
+    rec->when_ms = when_ms;
+}
+
+/*
+ * append one sensor's value, false if the record is full
+ */
+bool sensor_record_add(sensor_record_t *rec, uint8_t sensor, bool valid, float value)  {
+    uint32_t bits;
+    uint8_t *p;
+
+    if(((rec->len + SENSOR_RECORD_ENTRY_SIZE) > rec->size) || (rec->buf[SENSOR_RECORD_OFS_COUNT] == UINT8_MAX))
+        return(false);
+
+    if(!valid)
+        value = NAN;
+    memcpy(&bits, &value, sizeof(bits));
+    p = &rec->buf[rec->len];
+    *p++ = sensor;
+    put_le32(p, bits);
+    rec->len += SENSOR_RECORD_ENTRY_SIZE;
+    rec->buf[SENSOR_RECORD_OFS_COUNT]++;
+    return(true);
+}
+
+/*
+ * close the record: returns its length and moves the stream on, or 0 (and the
+ * stream is left alone) if it has no entries
+ */
+size_t sensor_record_finish(sensor_record_t *rec, sensor_record_stream_t *stream)  {
+    if(rec->buf[SENSOR_RECORD_OFS_COUNT] == 0)
+        return(0);
+
+    stream->seq++;
+    stream->last_ms = rec->when_ms;
+    if(rec->buf[SENSOR_RECORD_OFS_FLAGS] & SENSOR_RECORD_F_SYNC)
+        stream->until_sync = SENSOR_RECORD_SYNC_EVERY - 1;
+    else
+        stream->until_sync--;
+    return(rec->len);
+}
+
+/*
+ * keep a record for later, overwriting the oldest if the backlog is full
+ */
+static void backlog_push(const uint8_t *buf, size_t len)  {
+    int slot;
+
+    if(len > SENSOR_RECORD_MAX_SIZE)
+        return;
+    taskENTER_CRITICAL(&backlog_lock);
+    if(backlog_count == SENSOR_RECORD_BACKLOG)  {
+        backlog_head = (backlog_head + 1) % SENSOR_RECORD_BACKLOG;
+        backlog_count--;
+        backlog_dropped++;
+    }
+    slot = (backlog_head + backlog_count) % SENSOR_RECORD_BACKLOG;
+    memcpy(backlog[slot], buf, len);
+    backlog_len[slot] = len;
+    backlog_count++;
+    taskEXIT_CRITICAL(&backlog_lock);
+}
+
+/*
+ * take the oldest kept record into buf, its length or 0 if there is none
+ */
+static size_t backlog_pop(uint8_t *buf)  {
+    size_t len = 0;
+
+    taskENTER_CRITICAL(&backlog_lock);
+    if(backlog_count > 0)  {
+        len = backlog_len[backlog_head];
+        memcpy(buf, backlog[backlog_head], len);
+        backlog_head = (backlog_head + 1) % SENSOR_RECORD_BACKLOG;
+        backlog_count--;
+    }
+    taskEXIT_CRITICAL(&backlog_lock);
+    return(len);
+}
+
+/*
+ * publish a finished record, after any kept while mqtt was down; kept itself if
+ * mqtt isn't up, the client refuses it or the backlog can't be sent first (records
+ * go out in order, so the decoder's delta timestamps stay in step)
+ */
+void sensor_record_send(const uint8_t *buf, size_t len, int qos)  {
+    uint8_t *old;
+    size_t old_len;
+    uint32_t dropped;
+
+    if(!mqtt_is_connected())  {
+        backlog_push(buf, len);
+        return;
+    }
+
+    if(backlog_count > 0)  {
+        if((old = (uint8_t *)mqtt_pub_buf_get()) == NULL)  {
+            backlog_push(buf, len);  // pool busy, try again next record
+            return;
+        }
+        while((old_len = backlog_pop(old)) > 0)
+            if(mqtt_pub_send(SENSOR_RECORD_TOPIC, (const char *)old, old_len, qos, 0) < 0)  {
+                taskENTER_CRITICAL(&backlog_lock);
+                backlog_dropped++;  // (can't go back in front of the ring, it's lost)
+                taskEXIT_CRITICAL(&backlog_lock);
+                break;
+            }
+        mqtt_pub_buf_put((char *)old);
+
+        taskENTER_CRITICAL(&backlog_lock);
+        dropped = backlog_dropped;
+        backlog_dropped = 0;
+        taskEXIT_CRITICAL(&backlog_lock);
+        if(dropped > 0)
+            ESP_LOGW(TAG, "%" PRIu32 " records dropped while mqtt was down (backlog %d)", dropped, SENSOR_RECORD_BACKLOG);
+        if(backlog_count > 0)  {
+            backlog_push(buf, len);
+            return;
+        }
+    }
+
+    if(mqtt_pub_send(SENSOR_RECORD_TOPIC, (const char *)buf, len, qos, 0) < 0)
+        backlog_push(buf, len);
+}
+
+/*
+ * the index to label/topic map (sensors[] is initialized from SENSOR_TABLE, so it
+ * can be built before the sensors are)
+ */
+static int schema_build(void)  {
+    int n;
+
+    n = snprintf(schema, sizeof(schema), "{\"schema\":%d,\"sensors\":[", SENSOR_RECORD_SCHEMA_ID);
+    for(int i = 0; (i < SENSOR_COUNT) && (n < (int)sizeof(schema)); i++)
+        n += snprintf(&schema[n], sizeof(schema) - n, "%s[\"%s\",\"%s\"]",
+                      (i > 0) ? "," : "", sensors[i].label, sensors[i].topic);
+    if(n < (int)sizeof(schema))
+        n += snprintf(&schema[n], sizeof(schema) - n, "]}");
+    if(n >= (int)sizeof(schema))  {
+        ESP_LOGE(TAG, "error: schema doesn't fit in %d bytes, not published", SENSOR_RECORD_SCHEMA_LEN);
+        return(-1);
+    }
+    return(n);
+}
+
+/*
+ * publish the map retained, so a decoder that starts later still gets it
+ * (called from the mqtt event handler on each connect)
+ */
+void sensor_record_publish_schema(void)  {
+    if(schema_len == 0)
+        schema_len = schema_build();
+    if(schema_len > 0)
+        mqtt_pub_send_now(SENSOR_RECORD_SCHEMA_TOPIC, schema, schema_len, SENSOR_RECORD_SCHEMA_QOS, 1);
+}
+
+#if SENSOR_RECORD_BENCH
+/*
+ * size and encode time of a record of every sensor, binary vs json
+ */
+static void sensor_record_benchmark(void)  {
+    static uint8_t bin[SENSOR_RECORD_MAX_SIZE];
+    static char json[SENSOR_RECORD_SCHEMA_LEN];
+    sensor_record_stream_t stream = { 0 };
+    sensor_record_t rec;
+    int64_t start_us, bin_us, json_us;
+    size_t bin_len = 0;
+    int json_len = 0;
+
+    start_us = esp_timer_get_time();
+    for(int run = 0; run < SENSOR_RECORD_BENCH_RUNS; run++)  {
+        sensor_record_start(&rec, bin, sizeof(bin), &stream, SENSOR_GROUP_SLOW, 1000 + (run * 5000));
+        for(int i = 0; i < SENSOR_COUNT; i++)
+            sensor_record_add(&rec, i, true, 20.0f + (i * 1.37f));
+        bin_len = sensor_record_finish(&rec, &stream);
+    }
+    bin_us = esp_timer_get_time() - start_us;
+
+    start_us = esp_timer_get_time();
+    for(int run = 0; run < SENSOR_RECORD_BENCH_RUNS; run++)  {
+        json_len = snprintf(json, sizeof(json), "{\"group\":%d,\"seq\":%d,\"t_ms\":%d,\"sensors\":{",
+                            SENSOR_GROUP_SLOW, run, 1000 + (run * 5000));
+        for(int i = 0; (i < SENSOR_COUNT) && (json_len < (int)sizeof(json)); i++)
+            json_len += snprintf(&json[json_len], sizeof(json) - json_len, "%s\"%s\":%.2f",
+                                 (i > 0) ? "," : "", sensors[i].label, 20.0f + (i * 1.37f));
+        if(json_len < (int)sizeof(json))
+            json_len += snprintf(&json[json_len], sizeof(json) - json_len, "}}");
+    }
+    json_us = esp_timer_get_time() - start_us;
+
+    ESP_LOGI(TAG, "bench (%d sensors, %d runs): binary %u bytes %.2f uS/record, json %d bytes %.2f uS/record",
+             SENSOR_COUNT, SENSOR_RECORD_BENCH_RUNS, (unsigned)bin_len, (float)bin_us / SENSOR_RECORD_BENCH_RUNS,
+             json_len, (float)json_us / SENSOR_RECORD_BENCH_RUNS);
+}
+#endif
+
+/*
+ * run the benchmark (with SENSOR_RECORD_BENCH)
+ */
+void sensor_record_init(void)  {
+#if SENSOR_RECORD_BENCH
+    sensor_record_benchmark();
+#endif
+}
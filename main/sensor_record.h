@@ -0,0 +1,91 @@
+/*
+ * sensor_record.h
+ *
+ * compact binary record of a sensor group's samples, published in place of a
+ * string per sensor topic (SENSOR_RECORD_ENABLE, monitoring_zimknives.h).
+ *
+ * one record per group cycle holds every sensor that publish_sensors() would have
+ * published (its deadband/heartbeat rules are unchanged), on SENSOR_RECORD_TOPIC.
+ * sensors are sent as their index in SENSOR_TABLE rather than a label or topic; the
+ * index to label/topic map is published retained on SENSOR_RECORD_SCHEMA_TOPIC each
+ * time mqtt connects, as json:
+ *   {"schema":<id>,"sensors":[["<label>","<topic>"],...]}
+ *
+ * record format (all multi-byte fields little endian):
+ *   offset  size  field
+ *   0       1     schema id (SENSOR_RECORD_SCHEMA_ID), changes with any layout change
+ *   1       1     flags: SENSOR_RECORD_F_SYNC set: the timestamp is absolute
+ *   2       1     group (sensor_group_t)
+ *   3       1     number of entries
+ *   4       2     sequence number (per group, increments by one per record sent)
+ *   6       1-10  timestamp, varint: mS since boot with SENSOR_RECORD_F_SYNC, otherwise
+ *                 mS since the group's previous record
+ *   ...     5     per entry: sensor index (1 byte), value (float32, NaN: sensor failing)
+ *
+ * varint: 7 bits per byte, lsb first, bit 7 set on all but the last byte (as fast_stream.h)
+ *
+ * every SENSOR_RECORD_SYNC_EVERY records (and the first) carry the absolute time, so
+ * a decoder that missed a record (a sequence gap, QoS 0) is back in step by the next
+ * one.  tools/sensor_record.py is the host side decoder.
+ *
+ * records are sent with sensor_record_send().  until mqtt is up (at boot, as sampling
+ * starts without waiting for the network, or during an outage) they are kept in a
+ * backlog of the last SENSOR_RECORD_BACKLOG records, the oldest dropped when it is
+ * full (the decoder sees that as a sequence gap); the backlog goes out, oldest first,
+ * ahead of the next record sent while connected.
+ *
+ * with SENSOR_RECORD_BENCH set, sensor_record_init() encodes a record of every sensor
+ * SENSOR_RECORD_BENCH_RUNS times, and the same record as json, and logs the size and
+ * encode time of each.
+ */
+
+#ifndef __SENSOR_RECORD_H__
+
+#include "esp_system.h"  // for types (at least)
+
+#include "sensor_acquisition.h"
+
+#define SENSOR_RECORD_TOPIC "esp32/sensors"
+#define SENSOR_RECORD_SCHEMA_TOPIC "esp32/sensors/schema"
+#define SENSOR_RECORD_SCHEMA_QOS 1
+
+#define SENSOR_RECORD_SCHEMA_ID 1
+#define SENSOR_RECORD_F_SYNC 0x01
+#define SENSOR_RECORD_SYNC_EVERY 16
+#define SENSOR_RECORD_HEADER_MAX (6 + 10)
+#define SENSOR_RECORD_ENTRY_SIZE 5
+#define SENSOR_RECORD_MAX_SIZE (SENSOR_RECORD_HEADER_MAX + (SENSOR_COUNT * SENSOR_RECORD_ENTRY_SIZE))
+#define SENSOR_RECORD_SCHEMA_LEN 512
+#define SENSOR_RECORD_BACKLOG 16  // records kept while mqtt is down
+
+#define SENSOR_RECORD_BENCH_RUNS 1000
+
+/*
+ * timing and sequence state of one group's records
+ */
+typedef struct {
+    uint16_t seq;         // sequence number of the next record
+    uint8_t until_sync;   // records to go before the next absolute timestamp (0: this one)
+    int64_t last_ms;      // timestamp of the previous record
+} sensor_record_stream_t;
+
+/*
+ * a record being built
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    int64_t when_ms;
+} sensor_record_t;
+
+void sensor_record_init(void);
+void sensor_record_publish_schema(void);
+void sensor_record_start(sensor_record_t *rec, uint8_t *buf, size_t size,
+                         const sensor_record_stream_t *stream, uint8_t group, int64_t when_ms);
+bool sensor_record_add(sensor_record_t *rec, uint8_t sensor, bool valid, float value);
+size_t sensor_record_finish(sensor_record_t *rec, sensor_record_stream_t *stream);
+void sensor_record_send(const uint8_t *buf, size_t len, int qos);
+
+#define __SENSOR_RECORD_H__
+#endif
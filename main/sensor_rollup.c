@@ -0,0 +1,137 @@
+/*
+ * sensor_rollup.c
+ *
+ * on-device min/max/mean rollups of the slow sensors (see sensor_rollup.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sensor_acquisition.h"
+#include "sensor_rollup.h"
+#include "mqtt_local.h"
+#include "mqtt_pub.h"
+
+static const char *TAG = "sensor_rollup";  // for logging
+
+/*
+ * the tiers, from ROLLUP_TIER_TABLE
+ */
+typedef struct {
+    const char *label;    // appended to the sensor topic
+    int64_t period_ms;    // window length
+} rollup_tier_t;
+
+#define ROLLUP_TIER_ENTRY(ctx, label, period_ms) { label, period_ms },
+static const rollup_tier_t rollup_tiers[ROLLUP_TIERS] = {
+    ROLLUP_TIER_TABLE(ROLLUP_TIER_ENTRY, 0)
+};
+#undef ROLLUP_TIER_ENTRY
+
+/*
+ * every rollup topic, interned as a literal: "<sensor topic>/<tier label>"
+ */
+#define ROLLUP_TOPIC(topic, label, period_ms) topic "/" label,
+#define ROLLUP_SENSOR_TOPICS(name, type, acq_fcn, driver, device, label, topic, ...) \
+    [SENSOR_##name] = { ROLLUP_TIER_TABLE(ROLLUP_TOPIC, topic) },
+static const char *const rollup_topics[SENSOR_COUNT][ROLLUP_TIERS] = {
+    SENSOR_TABLE(ROLLUP_SENSOR_TOPICS)
+};
+#undef ROLLUP_SENSOR_TOPICS
+#undef ROLLUP_TOPIC
+
+static rollup_window_t rollups[SENSOR_COUNT][ROLLUP_TIERS];
+
+static void window_reset(rollup_window_t *w)  {
+    w->start_ms = 0;
+    w->count = 0;
+    w->sum = 0;
+}
+
+/*
+ * fold a sample (or a whole closed window from the tier below) into a window
+ */
+static void window_merge(rollup_window_t *w, int64_t period_ms, int64_t when_ms,
+                         float min, float max, float sum, uint32_t count)  {
+    if(w->count == 0)  {
+        w->start_ms = when_ms - (when_ms % period_ms);
+        w->min = min;
+        w->max = max;
+        w->sum = sum;
+        w->count = count;
+    }
+    else  {
+        if(min < w->min)  w->min = min;
+        if(max > w->max)  w->max = max;
+        w->sum += sum;
+        w->count += count;
+    }
+}
+
+static void window_publish(int sensor, uint8_t tier, const rollup_window_t *w)  {
+    char *payload;
+    int len;
+
+    if((payload = mqtt_pub_buf_get()) == NULL)  {
+        ESP_LOGI(TAG, "%s %s rollup dropped (no publish buffer)", sensors[sensor].label, rollup_tiers[tier].label);
+        return;
+    }
+    len = snprintf(payload, MQTT_PUB_BUF_LEN, "{\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f,\"n\":%" PRIu32 "}",
+                   w->min, w->max, w->sum / (float)w->count, w->count);
+    ESP_LOGI(TAG, "%s %s rollup %s", sensors[sensor].label, rollup_tiers[tier].label, payload);
+
+    mqtt_pub_send(rollup_topics[sensor][tier], payload, len, ROLLUP_QOS, 0);  // (queued in the outbox while mqtt is down)
+    mqtt_pub_buf_put(payload);
+}
+
+/*
+ * close (publish and pass up to the next tier) any windows that have ended
+ */
+static void windows_close(int sensor, int64_t now_ms)  {
+    rollup_window_t *w;
+
+    for(uint8_t t = 0; t < ROLLUP_TIERS; t++)  {
+        w = &rollups[sensor][t];
+        if((w->count > 0) && (now_ms >= (w->start_ms + rollup_tiers[t].period_ms)))  {
+            window_publish(sensor, t, w);
+            if((t + 1) < ROLLUP_TIERS)
+                window_merge(&rollups[sensor][t + 1], rollup_tiers[t + 1].period_ms, w->start_ms,
+                             w->min, w->max, w->sum, w->count);
+            window_reset(w);
+        }
+    }
+}
+
+void sensor_rollup_init(void)  {
+    for(int i = 0; i < SENSOR_COUNT; i++)
+        for(uint8_t t = 0; t < ROLLUP_TIERS; t++)
+            window_reset(&rollups[i][t]);
+}
+
+/*
+ * fold the new value of every freshly sampled, valid sensor in a group into its rollups
+ * call once per group cycle, after acquire_sensors()
+ */
+void sensor_rollup_update(sensor_group_t group)  {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    float value;
+
+    if(sensor_data_mutex == NULL)
+        return;
+
+    if(xSemaphoreTakeRecursive(sensor_data_mutex, SENSOR_MUTEX_WAIT_TICKS) == pdTRUE)  {
+        for(int i = 0; i < SENSOR_COUNT; i++)  {
+            if(sensors[i].group != group)
+                continue;
+            windows_close(i, now_ms);
+            if(sensors[i].fresh && sensor_value_float(i, &value))
+                window_merge(&rollups[i][0], rollup_tiers[0].period_ms, now_ms, value, value, value, 1);
+        }
+        xSemaphoreGiveRecursive(sensor_data_mutex);
+    }
+    else
+        ESP_LOGI(TAG, "warning: can't take sensor_data_mutex ... try next time");
+}
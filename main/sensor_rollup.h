@@ -0,0 +1,53 @@
+/*
+ * sensor_rollup.h
+ *
+ * on-device min/max/mean rollups of the slow sensors
+ *
+ * each sensors[] entry gets one tumbling window per tier (1 minute and 1 hour).
+ * windows are updated incrementally as samples arrive (constant memory, no sample
+ * history) and published when they close, so the broker sees a few rollups instead
+ * of every sample.  the 1 minute windows are merged into the 1 hour window when they
+ * close, so the extremes are kept at every tier.
+ *
+ * rollups are published as <sensor topic>/<tier label> (generated as literals from
+ * SENSOR_TABLE and ROLLUP_TIER_TABLE) with a payload like:
+ *   {"min":41.20,"max":43.05,"mean":42.11,"n":12}
+ */
+
+#ifndef __SENSOR_ROLLUP_H__
+
+#include "esp_system.h"  // for types (at least)
+
+#include "sensor_acquisition.h"
+
+/*
+ * the tiers, shortest first: X(ctx, label appended to the sensor topic, window (mS))
+ * each tier is fed by the windows closing in the tier before it (the first tier is
+ * fed by the samples themselves).  ctx is passed through to X so the table can be
+ * expanded once per sensor
+ */
+#define ROLLUP_TIER_TABLE(X, ctx) \
+    X(ctx, "1m", 60 * 1000) \
+    X(ctx, "1h", 60 * 60 * 1000)
+
+#define ROLLUP_TIER_ONE(ctx, label, period_ms) + 1
+#define ROLLUP_TIERS (0 ROLLUP_TIER_TABLE(ROLLUP_TIER_ONE, 0))
+
+#define ROLLUP_QOS 1
+
+/*
+ * one tumbling window
+ */
+typedef struct {
+    int64_t start_ms;  // start of the window, aligned to the tier period
+    float min;
+    float max;
+    float sum;
+    uint32_t count;    // 0 means nothing accumulated yet
+} rollup_window_t;
+
+void sensor_rollup_init(void);
+void sensor_rollup_update(sensor_group_t group);
+
+#define __SENSOR_ROLLUP_H__
+#endif
@@ -0,0 +1,154 @@
+/*
+ * telemetry.c
+ *
+ * gather and publish the device health record (see telemetry.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+
+#include "telemetry.h"
+#include "mqtt_local.h"
+#include "wifi_station.h"
+#include "display_neopixel.h"
+#include "sensor_acquisition.h"
+#include "i2c_bus.h"
+#include "dlog.h"
+#include "mqtt_pub.h"
+#include "boot_phase.h"
+
+static const char *TAG = "telemetry";  // for logging
+
+/*
+ * all static: the record is built in the same place every interval
+ */
+static TaskStatus_t task_status[TELEMETRY_TASKS_MAX];
+static char payload[TELEMETRY_PAYLOAD_LEN];
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+/*
+ * each task's run time counter at the last record, for the per interval cpu %
+ */
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t run_time;
+} task_prev_t;
+
+static task_prev_t task_prev[TELEMETRY_TASKS_MAX];
+static UBaseType_t task_prev_count = 0;
+static uint32_t total_prev = 0;
+
+static int task_cpu_percent(const TaskStatus_t *t, uint32_t total_delta)  {
+    for(UBaseType_t i = 0; i < task_prev_count; i++)
+        if(task_prev[i].handle == t->xHandle)
+            return((total_delta > 0) ? (int)(((uint64_t)(t->ulRunTimeCounter - task_prev[i].run_time) * 100) / total_delta) : 0);
+    return(-1);  // new since the last record
+}
+#endif
+
+static void i2c_totals(uint32_t *errors, uint32_t *nacks, uint32_t *timeouts, uint32_t *recoveries)  {
+    i2c_bus_stats_t s;
+
+    *errors = *nacks = *timeouts = *recoveries = 0;
+    for(i2c_bus_dev_t d = 0; i2c_bus_get_stats(d, &s); d++)  {
+        *errors += s.errors;
+        *nacks += s.nacks;
+        *timeouts += s.timeouts;
+        *recoveries += s.recoveries;
+    }
+}
+
+static uint32_t group_overruns(void)  {
+    sensor_group_stats_t s;
+    uint32_t overruns = 0;
+
+    for(int g = 0; g < SENSOR_GROUP_COUNT; g++)
+        if(sensor_group_get_stats((sensor_group_t)g, &s))
+            overruns += s.overruns;
+    return(overruns);
+}
+
+/*
+ * build the record and publish it (called from the main loop every TELEMETRY_INTERVAL_MS)
+ */
+void telemetry_publish(void)  {
+    static uint32_t collect_us = 0;  // cost of the previous record (this one isn't finished yet)
+    int64_t start_us = esp_timer_get_time();
+    display_stats_t disp;
+    mqtt_pub_stats_t pub;
+    mqtt_conn_stats_t conn;
+    wifi_link_stats_t link;
+    uint32_t i2c_err, i2c_nack, i2c_timeout, i2c_recover;
+    uint32_t total_run_time = 0, total_delta = 0;
+    UBaseType_t tasks;
+    size_t n;
+    int cpu;
+
+    display_get_stats(&disp);
+    mqtt_pub_get_stats(&pub);
+    mqtt_get_conn_stats(&conn);
+    wifi_get_link_stats(&link);
+    i2c_totals(&i2c_err, &i2c_nack, &i2c_timeout, &i2c_recover);
+    tasks = uxTaskGetSystemState(task_status, TELEMETRY_TASKS_MAX, &total_run_time);  // 0 if there are more tasks than fit
+
+    n = snprintf(payload, sizeof(payload),
+                 "{\"up\":%" PRId64 ",\"heap\":%" PRIu32 ",\"heap_min\":%" PRIu32 ",\"rssi\":%d,\"outbox\":%d,"
+                 "\"isr\":%" PRIu32 ",\"frames\":%" PRIu32 ",\"skipped\":%" PRIu32 ","
+                 "\"i2c\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "],\"overruns\":%" PRIu32 ","
+                 "\"pub\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "],"
+                 "\"sched\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "],"
+                 "\"mqtt\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%d],"
+                 "\"wifi\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%d],"
+                 "\"boot\":[",
+                 start_us / 1000000, esp_get_free_heap_size(), esp_get_minimum_free_heap_size(), wifi_rssi(), mqtt_outbox_size(),
+                 disp.isr_count, disp.frames_sent, disp.frames_skipped,
+                 i2c_err, i2c_nack, i2c_timeout, i2c_recover, group_overruns(),
+                 pub.messages, pub.outbox, pub.failed, pub.pool_empty,
+                 pub.bursts, pub.deferred, pub.defer_full, pub.wakes, pub.radio_ms_h,
+                 conn.connects, conn.attempts, conn.last_connect_ms, conn.last_first_pub_ms, conn.session_resumed ? 1 : 0,
+                 link.links, link.attempts, link.fast_links, link.last_link_ms, link.max_link_ms, link.last_reason);
+    for(int p = 0; (p < BOOT_PHASE_COUNT) && (n < sizeof(payload)); p++)
+        n += snprintf(&payload[n], sizeof(payload) - n, "%s%" PRId32, (p > 0) ? "," : "", boot_phase_ms(p));
+    if(n < sizeof(payload))
+        n += snprintf(&payload[n], sizeof(payload) - n, "],\"collect_us\":%" PRIu32 ",\"tasks\":[", collect_us);
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    total_delta = total_run_time - total_prev;
+#endif
+    for(UBaseType_t i = 0; (i < tasks) && (n < sizeof(payload)); i++)  {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        cpu = task_cpu_percent(&task_status[i], total_delta);
+#else
+        cpu = -1;
+#endif
+        n += snprintf(&payload[n], sizeof(payload) - n, "%s[\"%s\",%" PRIu32 ",%d]", (i > 0) ? "," : "",
+                      task_status[i].pcTaskName, (uint32_t)task_status[i].usStackHighWaterMark, cpu);
+    }
+    if(n < sizeof(payload))
+        n += snprintf(&payload[n], sizeof(payload) - n, "]}");
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    for(UBaseType_t i = 0; i < tasks; i++)  {
+        task_prev[i].handle = task_status[i].xHandle;
+        task_prev[i].run_time = task_status[i].ulRunTimeCounter;
+    }
+    task_prev_count = tasks;
+    total_prev = total_run_time;
+#endif
+
+    collect_us = (uint32_t)(esp_timer_get_time() - start_us);
+
+    if(n >= sizeof(payload))  {
+        DLOGI(TAG, "record truncated (%d tasks), not published", (int)tasks);
+        return;
+    }
+    mqtt_pub_send(TELEMETRY_TOPIC, payload, n, TELEMETRY_QOS, 0);
+}
@@ -0,0 +1,40 @@
+/*
+ * telemetry.h
+ *
+ * periodic device health record, published in place of the old "ping" so
+ * performance regressions show up across nodes without a debugger attached.
+ *
+ * one compact json object on TELEMETRY_TOPIC:
+ *   {"up":<s>,"heap":<bytes>,"heap_min":<bytes>,"rssi":<dBm>,"outbox":<bytes>,
+ *    "isr":<n>,"frames":<n>,"skipped":<n>,
+ *    "i2c":[<errors>,<nacks>,<timeouts>,<recoveries>],"overruns":<n>,
+ *    "pub":[<messages>,<outbox copies>,<failed>,<pool empty>],
+ *    "sched":[<bursts>,<held back>,<burst buffer full>,<radio wakes>,<radio-on mS per hour>],
+ *    "mqtt":[<connects>,<attempts>,<last connect mS>,<last first publish mS>,<session resumed>],
+ *    "wifi":[<links>,<attempts>,<fast links>,<last link mS>,<max link mS>,<last disconnect reason>],
+ *    "boot":[<mS>,...],"collect_us":<uS>,
+ *    "tasks":[["<name>",<stack free bytes>,<cpu %>],...]}
+ * counters are totals since boot.  the task cpu % is the share of one core over
+ * the last interval, and is only there when the build has run time stats
+ * (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, see sdkconfig.defaults); otherwise -1.
+ * boot is when each startup phase was reached, in BOOT_PHASE_TABLE order (-1: not yet).
+ * collect_us is what gathering the record cost, to keep an eye on it staying well
+ * under 1% of the interval.
+ */
+
+#ifndef __TELEMETRY_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"  // for types (at least)
+
+#define TELEMETRY_TOPIC "esp32/telemetry"
+#define TELEMETRY_QOS 0
+#define TELEMETRY_INTERVAL_MS 3000
+#define TELEMETRY_TASKS_MAX 32      // with more tasks than this the task list is left empty
+#define TELEMETRY_PAYLOAD_LEN 1536
+
+void telemetry_publish(void);
+
+#define __TELEMETRY_H__
+#endif
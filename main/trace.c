@@ -0,0 +1,218 @@
+/*
+ * trace.c
+ *
+ * per-core binary event rings and the task that dumps them (see trace.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "mqtt_client.h"
+
+#include "mqtt_local.h"
+#include "mqtt_pub.h"
+#include "trace.h"
+#include "app_tasks.h"
+
+static const char *TAG = "trace";  // for logging
+
+#define TRACE_RING_MASK (TRACE_RING_EVENTS - 1)
+
+typedef struct {
+    uint32_t head;  // events ever reserved on this core (slot = head & TRACE_RING_MASK)
+    trace_rec_t rec[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static DRAM_ATTR trace_ring_t rings[portNUM_PROCESSORS];
+static volatile DRAM_ATTR bool trace_enabled = false;  // off until trace_init(), and while dumping
+static volatile DRAM_ATTR uint32_t trace_mask = TRACE_MASK_ALL;
+
+static TaskHandle_t trace_task_handle = NULL;
+static volatile trace_sink_t trace_sink = TRACE_SINK_SERIAL;
+
+#define TRACE_NAME(name, label) label,
+static const char *const trace_names[TRACE_EVENT_COUNT] = {
+    TRACE_EVENT_TABLE(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+static const char trace_phase_char[] = { 'B', 'E', 'I' };
+
+/*
+ * record one event on the calling core's ring
+ * (isr safe: an isr that interrupts a task mid-record just takes the next slot)
+ */
+void IRAM_ATTR trace_record(trace_event_t id, trace_phase_t phase, uint16_t arg)  {
+    trace_ring_t *ring;
+    trace_rec_t *r;
+    uint32_t slot;
+
+    if(!trace_enabled || !(trace_mask & (1UL << id)))
+        return;
+
+    ring = &rings[xPortGetCoreID()];
+    slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED) & TRACE_RING_MASK;
+    r = &ring->rec[slot];
+    r->ts_us = (uint32_t)esp_timer_get_time();
+    r->id = (uint8_t)id;
+    r->phase = (uint8_t)phase;
+    r->arg = arg;
+}
+
+/*
+ * choose which events are recorded (bit n for event id n), e.g. to leave out the
+ * fast isr so the rings cover a longer stretch of the slower tasks
+ */
+void trace_set_mask(uint32_t mask)  {
+    trace_mask = mask & TRACE_MASK_ALL;
+    ESP_LOGI(TAG, "event mask 0x%08" PRIx32, trace_mask);
+}
+
+/*
+ * dump output: whole lines, either printed or gathered into mqtt sized chunks
+ */
+static char chunk[TRACE_CHUNK_LEN];
+static size_t chunk_len = 0;
+static bool chunk_dropped = false;  // the outbox didn't drain (or the broker went away)
+
+/*
+ * a QoS 1 chunk stays copied in the outbox until it is acknowledged, so each one waits
+ * for the outbox to come down to TRACE_OUTBOX_MAX first.  once that times out the rest
+ * of the dump is dropped rather than sent with a hole in it
+ */
+static void chunk_flush(void)  {
+    uint32_t waited_ms = 0;
+
+    if((chunk_len > 0) && !chunk_dropped)  {
+        while(mqtt_is_connected() && (mqtt_outbox_size() > TRACE_OUTBOX_MAX) && (waited_ms < TRACE_DRAIN_TIMEOUT_MS))  {
+            vTaskDelay(pdMS_TO_TICKS(TRACE_DRAIN_POLL_MS));
+            waited_ms += TRACE_DRAIN_POLL_MS;
+        }
+        if(mqtt_is_connected() && (mqtt_outbox_size() <= TRACE_OUTBOX_MAX))
+            mqtt_pub_send_now(TRACE_TOPIC, chunk, chunk_len, TRACE_QOS, 0);
+        else
+            chunk_dropped = true;
+    }
+    chunk_len = 0;
+}
+
+static void dump_line(trace_sink_t sink, const char *line, int len)  {
+    if(sink == TRACE_SINK_SERIAL)  {
+        printf("%s\n", line);
+        return;
+    }
+    if((chunk_len + len + 1) > sizeof(chunk))
+        chunk_flush();
+    memcpy(&chunk[chunk_len], line, len);
+    chunk_len += len;
+    chunk[chunk_len++] = '\n';
+}
+
+static void dump_rings(trace_sink_t sink)  {
+    char line[TRACE_LINE_LEN];
+    uint32_t head[portNUM_PROCESSORS], count[portNUM_PROCESSORS];
+    uint32_t events = 0, lost = 0;
+    const trace_rec_t *r;
+    int len;
+
+    chunk_dropped = false;
+    for(int c = 0; c < portNUM_PROCESSORS; c++)  {
+        head[c] = __atomic_load_n(&rings[c].head, __ATOMIC_ACQUIRE);
+        count[c] = (head[c] > TRACE_RING_EVENTS) ? TRACE_RING_EVENTS : head[c];
+        events += count[c];
+        lost += head[c] - count[c];
+    }
+
+    len = snprintf(line, sizeof(line), "TB %d %d %" PRIu32 " %" PRIu32, TRACE_VERSION, portNUM_PROCESSORS, events, lost);
+    dump_line(sink, line, len);
+    for(int i = 0; i < TRACE_EVENT_COUNT; i++)  {
+        len = snprintf(line, sizeof(line), "TN %d %s", i, trace_names[i]);
+        dump_line(sink, line, len);
+    }
+    for(int c = 0; c < portNUM_PROCESSORS; c++)  {
+        for(uint32_t n = head[c] - count[c]; n != head[c]; n++)  {
+            r = &rings[c].rec[n & TRACE_RING_MASK];
+            len = snprintf(line, sizeof(line), "T %d %" PRIu32 " %u %c %u", c, r->ts_us, r->id,
+                           trace_phase_char[r->phase % sizeof(trace_phase_char)], r->arg);
+            dump_line(sink, line, len);
+        }
+    }
+    dump_line(sink, "TE", 2);
+    if(sink == TRACE_SINK_MQTT)
+        chunk_flush();
+
+    if(chunk_dropped)
+        ESP_LOGI(TAG, "dump to %s incomplete: the mqtt outbox didn't drain", TRACE_TOPIC);
+    else
+        ESP_LOGI(TAG, "dumped %" PRIu32 " events (%" PRIu32 " overwritten) to %s", events, lost,
+                 (sink == TRACE_SINK_SERIAL) ? "serial" : TRACE_TOPIC);
+}
+
+/*
+ * wait for a dump request.  recording is paused for the dump so the rings hold
+ * still; the tick of delay lets a writer that was mid-record finish its slot
+ */
+static void trace_task(void *pvParameters)  {
+    while(1)  {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        trace_enabled = false;
+        vTaskDelay(1);
+        dump_rings(trace_sink);
+        trace_enabled = true;
+    }
+}
+
+/*
+ * start recording and the dump task (call early, before the traced tasks start)
+ */
+void trace_init(void)  {
+    if(trace_task_handle != NULL)
+        return;
+    memset(rings, 0, sizeof(rings));
+    trace_task_handle = app_task_create(APP_TASK_TRACE, trace_task, NULL);
+    trace_enabled = true;
+    ESP_LOGI(TAG, "tracing %d events per core, dump with \"serial\" or \"mqtt\" on %s", TRACE_RING_EVENTS, TRACE_CMD_TOPIC);
+}
+
+/*
+ * ask the trace task for a dump, false if it isn't running
+ */
+bool trace_dump(trace_sink_t sink)  {
+    if(trace_task_handle == NULL)
+        return(false);
+    trace_sink = sink;
+    xTaskNotifyGive(trace_task_handle);
+    return(true);
+}
+
+/*
+ * payload of a TRACE_CMD_TOPIC message (not nul terminated):
+ *   "serial" or "mqtt"  dump the rings there
+ *   "mask <n>"          set the event mask (decimal or 0x hex)
+ */
+void trace_command(const char *data, int len)  {
+    char cmd[24];
+
+    if((data == NULL) || (len <= 0) || (len >= (int)sizeof(cmd)))  {
+        ESP_LOGI(TAG, "ignoring trace command (length %d)", len);
+        return;
+    }
+    memcpy(cmd, data, len);
+    cmd[len] = '\0';
+
+    if(strcmp(cmd, "serial") == 0)
+        trace_dump(TRACE_SINK_SERIAL);
+    else if(strcmp(cmd, "mqtt") == 0)
+        trace_dump(TRACE_SINK_MQTT);
+    else if(strncmp(cmd, "mask ", 5) == 0)
+        trace_set_mask((uint32_t)strtoul(&cmd[5], NULL, 0));
+    else
+        ESP_LOGI(TAG, "unknown trace command <%s>", cmd);
+}
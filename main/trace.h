@@ -0,0 +1,97 @@
+/*
+ * trace.h
+ *
+ * lightweight event tracer: a timeline of what each core was doing, to replace
+ * watching the instrumentation gpios on a scope.
+ *
+ * each core has its own ring of compact binary events (8 bytes: uS timestamp, event id,
+ * phase, 16 bit argument).  a writer reserves its slot with one atomic add on the ring
+ * head, so recording takes no lock and is safe from isrs as well as tasks.  the rings
+ * always run (they are compiled in); when one wraps the oldest events are overwritten,
+ * so a dump is the last TRACE_RING_EVENTS events per core.
+ *
+ * a dump is requested with trace_dump() (or by publishing "serial" or "mqtt" to
+ * TRACE_CMD_TOPIC).  recording is paused while the trace task prints the rings as
+ * text lines, either on the console or published in chunks of whole lines to
+ * TRACE_TOPIC (at QoS 1, each chunk waits for the client's outbox to drain below
+ * TRACE_OUTBOX_MAX, so a dump doesn't pile ~50 KB of copies into the heap):
+ *   TB <version> <cores> <events> <lost>     begin: events to follow, events overwritten
+ *   TN <id> <name>                           one per event id
+ *   T <core> <ts_us> <id> <phase> <arg>      one per event, oldest first per core
+ *   TE                                       end
+ * phase is B (begin), E (end) or I (instant).  ts_us is the low 32 bits of esp_timer
+ * (it wraps every ~71 minutes).
+ *
+ * tools/trace2chrome.py turns a captured dump (a console log or the concatenated
+ * mqtt payloads) into chrome trace json for chrome://tracing or ui.perfetto.dev.
+ */
+
+#ifndef __TRACE_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"  // for types (at least)
+
+#define TRACE_VERSION 1
+#define TRACE_TOPIC "esp32/trace"
+#define TRACE_CMD_TOPIC "esp32/trace/cmd"
+#define TRACE_QOS 1             // a lost chunk would leave a hole in the timeline
+#define TRACE_RING_EVENTS 1024  // per core (power of 2)
+#define TRACE_CHUNK_LEN 1024    // mqtt payload size for a dump
+#define TRACE_OUTBOX_MAX (2 * TRACE_CHUNK_LEN)  // outbox bytes a chunk waits for
+#define TRACE_DRAIN_POLL_MS 20
+#define TRACE_DRAIN_TIMEOUT_MS 5000  // outbox still full after this: the rest of the dump is dropped
+#define TRACE_LINE_LEN 48
+
+/*
+ * event ids: (name, label in the dump)
+ */
+#define TRACE_EVENT_TABLE(X) \
+    X(FAST_ISR,        "fast_isr")        /* fast acquisition timer isr */                 \
+    X(DISPLAY_RENDER,  "display_render")  /* fast bargraph update */                      \
+    X(DISPLAY_REFRESH, "display_refresh") /* frame sent to the strip */                   \
+    X(ACQ_CYCLE,       "acq_cycle")       /* sensor group cycle, arg = group */           \
+    X(ACQ_SAMPLE,      "acq_sample")      /* sample stored, arg = sensor */               \
+    X(I2C_XFER,        "i2c_xfer")        /* one bus transaction, arg = device */         \
+    X(MQTT_PUBLISH,    "mqtt_publish")    /* publish handed to the client, arg = length */\
+    X(STREAM_BLOCK,    "stream_block")    /* fast stream block encoded, arg = length */
+
+#define TRACE_ID(name, label) TRACE_##name,
+typedef enum {
+    TRACE_EVENT_TABLE(TRACE_ID)
+    TRACE_EVENT_COUNT,
+} trace_event_t;
+#undef TRACE_ID
+
+#define TRACE_MASK_ALL ((1UL << TRACE_EVENT_COUNT) - 1)
+
+typedef enum {
+    TRACE_PH_BEGIN,
+    TRACE_PH_END,
+    TRACE_PH_INSTANT,
+} trace_phase_t;
+
+typedef enum {
+    TRACE_SINK_SERIAL,
+    TRACE_SINK_MQTT,
+} trace_sink_t;
+
+typedef struct {
+    uint32_t ts_us;
+    uint8_t id;
+    uint8_t phase;
+    uint16_t arg;
+} trace_rec_t;
+
+void trace_init(void);
+void trace_record(trace_event_t id, trace_phase_t phase, uint16_t arg);
+void trace_set_mask(uint32_t mask);
+bool trace_dump(trace_sink_t sink);
+void trace_command(const char *data, int len);
+
+#define TRACE_BEGIN(name, arg)   trace_record(TRACE_##name, TRACE_PH_BEGIN, (uint16_t)(arg))
+#define TRACE_END(name, arg)     trace_record(TRACE_##name, TRACE_PH_END, (uint16_t)(arg))
+#define TRACE_INSTANT(name, arg) trace_record(TRACE_##name, TRACE_PH_INSTANT, (uint16_t)(arg))
+
+#define __TRACE_H__
+#endif
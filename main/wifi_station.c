@@ -14,6 +14,7 @@
  * CONDITIONS OF ANY KIND, either express or implied.
  */
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
@@ -22,11 +23,19 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_mac.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
 #include "wifi_station.h"
+#include "boot_phase.h"
+#include "app_tasks.h"
+#include "monitoring_zimknives.h"
+#include "mqtt_pub.h"
 
 /*
  * locally remember some things about the network interface
@@ -37,39 +46,241 @@ esp_netif_t * myNetif;
  * FreeRTOS event group to signal when we are connected
  */
 static EventGroupHandle_t s_wifi_event_group;
+static StaticEventGroup_t s_wifi_event_group_buf;
 
 /* The event group allows multiple bits for each event, but we only care about two events:
  * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries
+ * - we failed to connect after the maximum amount of retries (and are still trying)
  */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
 static const char *TAG = "wifi station"; // logging
 
-static int s_retry_num = 0; // counter for connect retry
+static int s_retry_num = 0; // failed attempts in a row
 
+/*
+ * events for the supervisor task (notification bits)
+ */
+#define WIFI_SUP_START        0x01
+#define WIFI_SUP_DISCONNECTED 0x02
+#define WIFI_SUP_GOT_IP       0x04
+
+/*
+ * the last AP as kept in nvs
+ */
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_cache_t;
+
+static TaskHandle_t sup_task;
+static wifi_config_t wifi_config;       // as last given to the driver
+static wifi_cache_t cache;
+static bool cache_valid = false;
+static bool fast_attempt = false;       // the attempt in progress uses the cache
+static uint32_t backoff_step = 0;
+static int64_t down_since_us;           // start of the current outage
+static uint32_t outage_attempts = 0;
+static wifi_link_stats_t link_stats;
+static portMUX_TYPE link_lock = portMUX_INITIALIZER_UNLOCKED;
 
+/*
+ * the driver's events, passed on to the supervisor (the event loop task isn't
+ * held up by nvs writes or backoff)
+ */
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        xTaskNotify(sup_task, WIFI_SUP_START, eSetBits);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-        }
-        ESP_LOGI(TAG,"connect to the AP fail");
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        link_stats.last_reason = event->reason;
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        xTaskNotify(sup_task, WIFI_SUP_DISCONNECTED, eSetBits);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
+        ESP_LOGI(TAG, "got ip:" IPSTR " from SSID:%s", IP2STR(&event->ip_info.ip), EXAMPLE_ESP_WIFI_SSID);
+        boot_mark(BOOT_PHASE_WIFI_UP);
+        xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        xTaskNotify(sup_task, WIFI_SUP_GOT_IP, eSetBits);
+    }
+}
+
+/*
+ * the bssid/channel of the last link, false if there isn't one
+ */
+static bool cache_load(wifi_cache_t *c)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(*c);
+    esp_err_t ret;
+
+    if(nvs_open(WIFI_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return(false);
+    ret = nvs_get_blob(nvs, WIFI_CACHE_KEY, c, &len);
+    nvs_close(nvs);
+    return((ret == ESP_OK) && (len == sizeof(*c)) && (c->channel != 0));
+}
+
+static void cache_save(const wifi_cache_t *c)
+{
+    nvs_handle_t nvs;
+    esp_err_t ret;
+
+    if((ret = nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &nvs)) == ESP_OK)  {
+        if((ret = nvs_set_blob(nvs, WIFI_CACHE_KEY, c, sizeof(*c))) == ESP_OK)
+            ret = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if(ret != ESP_OK)
+        ESP_LOGE(TAG, "error: AP cache not saved (%s)", esp_err_to_name(ret));
+}
+
+/*
+ * the next backoff: WIFI_BACKOFF_MIN_MS doubling up to WIFI_BACKOFF_MAX_MS,
+ * of which the upper half is random
+ */
+static uint32_t backoff_ms(void)
+{
+    uint32_t step = WIFI_BACKOFF_MIN_MS;
+
+    for(uint32_t n = 0; (n < backoff_step) && (step < WIFI_BACKOFF_MAX_MS); n++)
+        step *= 2;
+    if(step > WIFI_BACKOFF_MAX_MS)
+        step = WIFI_BACKOFF_MAX_MS;
+    backoff_step++;
+    return((step / 2) + (esp_random() % ((step / 2) + 1)));
+}
+
+/*
+ * one connection attempt: the first of an outage on the cached AP and channel
+ * (no scan), the rest with a full scan
+ */
+static void connect_attempt(bool fast)
+{
+    fast = fast && cache_valid;
+    if(fast != fast_attempt)  {
+        wifi_config.sta.bssid_set = fast;
+        if(fast)  {
+            memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+            wifi_config.sta.channel = cache.channel;
+            wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        }
+        else  {
+            wifi_config.sta.channel = 0;
+            wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        }
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+        fast_attempt = fast;
     }
+
+    taskENTER_CRITICAL(&link_lock);
+    link_stats.attempts++;
+    taskEXIT_CRITICAL(&link_lock);
+    outage_attempts++;
+    if(fast)
+        ESP_LOGI(TAG, "connecting to " MACSTR " on channel %d", MAC2STR(cache.bssid), cache.channel);
+    esp_wifi_connect();
+}
+
+/*
+ * got an address: time the outage, remember the AP if it's a new one
+ */
+static void link_up(void)
+{
+    uint32_t link_ms = (uint32_t)((esp_timer_get_time() - down_since_us) / 1000);
+    wifi_ap_record_t ap;
+
+    taskENTER_CRITICAL(&link_lock);
+    link_stats.links++;
+    if(fast_attempt)
+        link_stats.fast_links++;
+    link_stats.last_attempts = outage_attempts;
+    link_stats.last_link_ms = link_ms;
+    if(link_ms > link_stats.max_link_ms)
+        link_stats.max_link_ms = link_ms;
+    taskEXIT_CRITICAL(&link_lock);
+    ESP_LOGI(TAG, "link up in %" PRIu32 " mS, %" PRIu32 " attempt(s)%s", link_ms, outage_attempts,
+             fast_attempt ? ", cached AP" : "");
+    s_retry_num = 0;
+    backoff_step = 0;
+    outage_attempts = 0;
+
+    if(esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return;
+    if(!cache_valid || (cache.channel != ap.primary) || (memcmp(cache.bssid, ap.bssid, sizeof(cache.bssid)) != 0))  {
+        memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+        cache.channel = ap.primary;
+        cache_valid = true;
+        cache_save(&cache);
+        ESP_LOGI(TAG, "AP cache: " MACSTR " channel %d", MAC2STR(cache.bssid), cache.channel);
+    }
+}
+
+/*
+ * keeps the link up: makes every connection attempt, backs off between failed ones,
+ * and never gives up (see wifi_station.h)
+ */
+static void wifi_supervisor_task(void *pvParameters)
+{
+    TickType_t wait = portMAX_DELAY;  // until the next attempt
+    bool up = false;
+    uint32_t events;
+    uint32_t delay_ms;
+
+    for(;;)  {
+        if(xTaskNotifyWait(0, UINT32_MAX, &events, wait) == pdFALSE)  {
+            wait = portMAX_DELAY;
+            connect_attempt(false);
+            continue;
+        }
+
+        if(events & WIFI_SUP_START)
+            connect_attempt(true);
+
+        if((events & WIFI_SUP_GOT_IP) && !up)  {
+            up = true;
+            wait = portMAX_DELAY;
+            link_up();
+        }
+
+        if((events & WIFI_SUP_DISCONNECTED) && !(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT))  {
+            if(up)  {
+                // link lost: straight back to the AP we had, no scan
+                up = false;
+                down_since_us = esp_timer_get_time();
+                ESP_LOGI(TAG, "link lost (reason %d)", link_stats.last_reason);
+                connect_attempt(true);
+                continue;
+            }
+            if(++s_retry_num == EXAMPLE_ESP_MAXIMUM_RETRY)  {
+                xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+                ESP_LOGI(TAG, "Failed to connect to SSID:%s, still trying", EXAMPLE_ESP_WIFI_SSID);
+            }
+            if(fast_attempt)  {
+                ESP_LOGI(TAG, "cached AP not reached (reason %d), scanning", link_stats.last_reason);
+                connect_attempt(false);
+                continue;
+            }
+            delay_ms = backoff_ms();
+            wait = pdMS_TO_TICKS(delay_ms);
+            ESP_LOGI(TAG, "connect to the AP fail (reason %d), next attempt in %" PRIu32 " mS",
+                     link_stats.last_reason, delay_ms);
+        }
+    }
+}
+
+/*
+ * link timing totals (see wifi_link_stats_t)
+ */
+void wifi_get_link_stats(wifi_link_stats_t *stats)
+{
+    taskENTER_CRITICAL(&link_lock);
+    *stats = link_stats;
+    taskEXIT_CRITICAL(&link_lock);
 }
 
 void get_wifi_key(char *net_ifkey, size_t n)
@@ -78,11 +289,13 @@ void get_wifi_key(char *net_ifkey, size_t n)
 }
 
 /*
- * initialize the wifi station instance and connect to AP
+ * initialize the wifi station instance and start connecting to the AP
+ * (doesn't wait: the connection comes up in the background, see wifi_connect_status()
+ * or the IP_EVENT_STA_GOT_IP event)
  */
 void wifi_init_sta(void)
 {
-    s_wifi_event_group = xEventGroupCreate();
+    s_wifi_event_group = xEventGroupCreateStatic(&s_wifi_event_group_buf);
 
     ESP_ERROR_CHECK(esp_netif_init());
 
@@ -105,7 +318,7 @@ void wifi_init_sta(void)
                                                         NULL,
                                                         &instance_got_ip));
 
-    wifi_config_t wifi_config = {
+    wifi_config = (wifi_config_t){
         .sta = {
             .ssid = EXAMPLE_ESP_WIFI_SSID,
             .password = EXAMPLE_ESP_WIFI_PASS,
@@ -120,43 +333,31 @@ void wifi_init_sta(void)
             .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
         },
     };
+
+    /*
+     * the first attempt goes to the cached AP, set up in the supervisor's first
+     * connect_attempt(); the config here is the full scan one
+     */
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+#if PUB_SCHED_ENABLE
+    wifi_config.sta.listen_interval = MQTT_PUB_LISTEN_INTERVAL;  // modem sleep between publish bursts (kept by every attempt)
+#endif
+    cache_valid = cache_load(&cache);
+    down_since_us = esp_timer_get_time();
+    sup_task = app_task_create(APP_TASK_WIFI_SUP, wifi_supervisor_task, NULL);
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
     ESP_ERROR_CHECK(esp_wifi_start() );
 
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-    /* 
-     * Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) 
-     */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* 
-     * xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. 
-     */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    }
+    ESP_LOGI(TAG, "wifi_init_sta finished, connecting to SSID:%s", EXAMPLE_ESP_WIFI_SSID);
 }
 
 /*
  * return the connection status of wifi
  *
  * return:  1  connected
- *          0  not connected
- *          -1 unexpected error
+ *          0  not connected (still connecting, or gave up)
  */
 int8_t wifi_connect_status(bool verbose)  {
     int8_t status = 0;
@@ -164,9 +365,8 @@ int8_t wifi_connect_status(bool verbose)  {
     /* 
      * Read whether the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
      * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above).
-     * This function should be called after initialization of the connection, so one or ther other
-     * bits should be set and the function should return immediately.  However, include the 1 tick timeout so
-     * that this function won't block indefinitely in this case.
+     * Neither bit is set while the first connection is still being made (wifi_init_sta() doesn't wait for it).
+     * The 1 tick timeout keeps this from blocking.
      */
     EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
             WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
@@ -189,9 +389,20 @@ int8_t wifi_connect_status(bool verbose)  {
             ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
                     EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
     } else {
-        status = -1;
+        status = 0;
         if(verbose)
-            ESP_LOGE(TAG, "UNEXPECTED EVENT");
+            ESP_LOGI(TAG, "connecting to SSID:%s", EXAMPLE_ESP_WIFI_SSID);
     }
     return(status);
-}
\ No newline at end of file
+}
+
+/*
+ * signal strength of the current access point (dBm), 0 if not associated
+ */
+int8_t wifi_rssi(void)  {
+    wifi_ap_record_t ap;
+
+    if(esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return(0);
+    return(ap.rssi);
+}
@@ -64,9 +64,44 @@
 #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WAPI_PSK
 #endif
 
+/*
+ * link supervision: the wifi_sup task (app_tasks.h) makes every connection attempt
+ * and never gives up.  after a failed attempt or a lost link it waits a backoff of
+ * WIFI_BACKOFF_MIN_MS doubling up to WIFI_BACKOFF_MAX_MS (upper half random, so a
+ * site full of nodes doesn't come back in lock step) and tries again.
+ * EXAMPLE_ESP_MAXIMUM_RETRY failures in a row only set WIFI_FAIL_BIT (reported by
+ * wifi_connect_status()), the retries go on.
+ *
+ * fast connect: the bssid and channel of the last link are kept in nvs
+ * (WIFI_CACHE_NAMESPACE) and the first attempt of each outage, and of each boot, goes
+ * straight to that AP on that channel without a scan.  if it fails the rest of the
+ * outage uses a full scan; the cache is rewritten when a link comes up on a
+ * different AP.
+ */
+#define WIFI_BACKOFF_MIN_MS 250
+#define WIFI_BACKOFF_MAX_MS 60000
+#define WIFI_CACHE_NAMESPACE "wifi_cache"
+#define WIFI_CACHE_KEY "ap"
+
+/*
+ * link timing, for telemetry.  an outage is timed from wifi_init_sta() (the first
+ * link) or the disconnect to got ip
+ */
+typedef struct {
+    uint32_t links;          // got an address
+    uint32_t attempts;       // connection attempts
+    uint32_t fast_links;     // links made on the cached bssid/channel
+    uint32_t last_attempts;  // attempts the last outage took
+    uint32_t last_link_ms;   // last outage: down to got ip
+    uint32_t max_link_ms;    // longest outage so far
+    uint8_t last_reason;     // reason of the last disconnect (wifi_err_reason_t)
+} wifi_link_stats_t;
+
 void wifi_init_sta(void);
 int8_t wifi_connect_status(bool verbose);
+int8_t wifi_rssi(void);
 void get_wifi_key(char *net_ifkey, size_t n);
+void wifi_get_link_stats(wifi_link_stats_t *stats);
 
 #define __WIFI_STATION_H
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+/*
+ * test_pub_sched.c
+ *
+ * host unit test of the publish burst schedule and radio-on estimate (main/pub_sched.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pub_sched.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                                \
+        if(!(cond))  {                                                  \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                 \
+        }                                                               \
+    } while(0)
+
+/*
+ * bursts land on the grid from the epoch, and pub_sched_wait_ms() counts down to them
+ */
+static void test_grid(void)  {
+    pub_sched_t s;
+
+    pub_sched_init(&s, 5000, 200, 3, 1000);
+    CHECK(pub_sched_wait_ms(&s, 1000) == 0);  // the first burst is due at the epoch
+    CHECK(pub_sched_open(&s, 1000));
+    CHECK(s.bursts == 1);
+    CHECK(s.next_ms == 6000);
+    CHECK(pub_sched_wait_ms(&s, 1500) == 4500);
+
+    // opened late within the period: the next one is still on the grid
+    CHECK(pub_sched_open(&s, 6040));
+    CHECK(s.next_ms == 11000);
+    CHECK(s.bursts == 2);
+    CHECK(pub_sched_wait_ms(&s, 6300) == 4700);
+}
+
+/*
+ * a burst missed altogether isn't made up: the next is the next grid point after now
+ */
+static void test_missed(void)  {
+    pub_sched_t s;
+
+    pub_sched_init(&s, 5000, 200, 3, 0);
+    CHECK(pub_sched_open(&s, 0));
+    CHECK(pub_sched_wait_ms(&s, 23000) == 0);  // overdue
+    CHECK(pub_sched_open(&s, 23000));
+    CHECK(s.bursts == 2);  // one burst, not the four missed
+    CHECK(s.next_ms == 25000);
+    CHECK(pub_sched_wait_ms(&s, 23500) == 1500);
+}
+
+/*
+ * a burst is open for window_ms, then closed until the next; pub_sched_is_open()
+ * never opens one
+ */
+static void test_window(void)  {
+    pub_sched_t s;
+
+    pub_sched_init(&s, 5000, 200, 3, 0);
+    CHECK(!pub_sched_is_open(&s, 0));
+    CHECK(pub_sched_open(&s, 0));
+    CHECK(pub_sched_is_open(&s, 199));
+    CHECK(pub_sched_wait_ms(&s, 199) == 0);
+    CHECK(!pub_sched_is_open(&s, 200));
+    CHECK(!pub_sched_open(&s, 200));
+    CHECK(pub_sched_wait_ms(&s, 200) == 4800);
+    CHECK(!pub_sched_is_open(&s, 5000));  // due, but not opened yet
+    CHECK(s.bursts == 1);
+
+    // interval 0: no schedule, always open
+    pub_sched_init(&s, 0, 0, 1, 0);
+    CHECK(pub_sched_is_open(&s, 12345));
+    CHECK(pub_sched_open(&s, 12345));
+    CHECK(pub_sched_wait_ms(&s, 12345) == 0);
+}
+
+/*
+ * radio-on estimate: one wake per burst, the current hour scaled up until a whole one
+ * has passed, then the last whole hour
+ */
+static void test_estimate(void)  {
+    pub_sched_t s, idle;
+    uint32_t part, hour, beacons;
+
+    // nothing sent: beacon listens only
+    pub_sched_init(&idle, 5000, 200, 3, 0);
+    beacons = (uint32_t)((PUB_SCHED_HOUR_MS / (3 * PUB_SCHED_BEACON_TU_MS)) * PUB_SCHED_BEACON_MS);
+    CHECK(abs((int)pub_sched_radio_ms_per_hour(&idle, PUB_SCHED_HOUR_MS / 2) - (int)beacons) <= 1);
+
+    // two sends in one burst: one wake, the second extends the tail
+    pub_sched_init(&s, 5000, 200, 3, 0);
+    pub_sched_note_send(&s, 0, 0);
+    pub_sched_note_send(&s, 10, 0);
+    CHECK(s.wakes == 1);
+    CHECK(s.on_ms == (float)(PUB_SCHED_WAKE_MS + PUB_SCHED_TAIL_MS + 10));
+    pub_sched_note_send(&s, 1000, 0);
+    CHECK(s.wakes == 2);
+
+    // a burst every 5 s for half an hour: the estimate is scaled to an hour
+    pub_sched_init(&s, 5000, 200, 3, 0);
+    for(int64_t t = 0; t < (PUB_SCHED_HOUR_MS / 2); t += 5000)
+        pub_sched_note_send(&s, t, 1000);
+    part = pub_sched_radio_ms_per_hour(&s, PUB_SCHED_HOUR_MS / 2);
+    CHECK(s.wakes == 360);
+    CHECK(part > 720 * (PUB_SCHED_WAKE_MS + PUB_SCHED_TAIL_MS));
+
+    // roll_hour(): once the hour is over it is reported as is, and the new one starts empty
+    for(int64_t t = PUB_SCHED_HOUR_MS / 2; t < PUB_SCHED_HOUR_MS; t += 5000)
+        pub_sched_note_send(&s, t, 1000);
+    hour = pub_sched_radio_ms_per_hour(&s, PUB_SCHED_HOUR_MS + 1);
+    CHECK(s.hour_start_ms == PUB_SCHED_HOUR_MS);
+    CHECK(s.on_ms == 0);
+    CHECK(abs((int)hour - (int)part) <= 2);
+    CHECK(pub_sched_radio_ms_per_hour(&s, (PUB_SCHED_HOUR_MS * 3) / 2) == hour);
+
+    // an idle hour after it replaces it
+    CHECK(abs((int)pub_sched_radio_ms_per_hour(&s, 2 * PUB_SCHED_HOUR_MS) - (int)beacons) <= 1);
+
+    // bursts beat the same traffic sent as it comes
+    pub_sched_init(&idle, 0, 0, 3, 0);
+    for(int64_t t = 0; t < PUB_SCHED_HOUR_MS; t += 1000)
+        pub_sched_note_send(&idle, t, 200);
+    CHECK(pub_sched_radio_ms_per_hour(&idle, PUB_SCHED_HOUR_MS) > hour);
+}
+
+int main(void)  {
+    test_grid();
+    test_missed();
+    test_window();
+    test_estimate();
+
+    if(failures > 0)  {
+        printf("pub_sched: %d check(s) failed\n", failures);
+        return(1);
+    }
+    printf("pub_sched: ok\n");
+    return(0);
+}
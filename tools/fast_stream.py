@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""
+fast_stream.py
+
+decoder for the compressed waveform blocks of the monitoring node (see
+main/fast_stream.h), usable as a library or from the command line.
+
+as a library:
+    dec = Decoder()
+    blk = dec.decode(payload)           # payload of esp32/waveform (bytes)
+blk is a dict: seq, first_index, t_us, period_us, order, coding ("varint" or
+"rice"), samples [int], lost (samples the node dropped before this block),
+missed (blocks lost on the way), restart (the sequence went backwards, so the
+node rebooted) and raw_bytes/encoded_bytes for the ratio.
+
+from the command line the input is one hex encoded payload per line, e.g.
+    mosquitto_sub -h <broker> -p <port> -t esp32/waveform -F %x > blocks.txt
+    python3 tools/fast_stream.py blocks.txt
+prints one line per block and the overall compression ratio (raw int16 bytes /
+bytes sent, headers included); with --samples the decoded samples are printed
+as "index value" lines instead (gaps where samples were lost).
+"""
+
+import argparse
+import struct
+import sys
+
+VERSION = 1
+ENC_VARINT = 0x00
+ENC_RICE = 0x01
+RICE_K_BITS = 4
+RICE_PARTITION = 32
+RICE_ESCAPE = 15
+ZZ_BITS = 18
+HEADER = struct.Struct("<BBIIqHHh")  # version, encoding, seq, first index, t_us, period, count, first sample
+
+
+class DecodeError(Exception):
+    pass
+
+
+def unzigzag(zz):
+    return (zz >> 1) ^ -(zz & 1)
+
+
+class BitReader:
+    """
+    msb first, as the node's rice coder packs them
+    """
+
+    def __init__(self, data, pos):
+        self.data = data
+        self.bit = pos * 8
+
+    def read(self, nbits):
+        value = 0
+        for _ in range(nbits):
+            byte = self.bit >> 3
+            if byte >= len(self.data):
+                raise DecodeError("truncated rice data")
+            value = (value << 1) | ((self.data[byte] >> (7 - (self.bit & 7))) & 1)
+            self.bit += 1
+        return value
+
+    def end(self):
+        return (self.bit + 7) >> 3
+
+
+def residuals_varint(data, pos, n):
+    out = []
+    for _ in range(n):
+        value = shift = 0
+        while True:
+            if pos >= len(data):
+                raise DecodeError("truncated varint")
+            b = data[pos]
+            pos += 1
+            value |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        out.append(value)
+    return out, pos
+
+
+def residuals_rice(data, pos, n):
+    br = BitReader(data, pos)
+    out = []
+    k = 0
+    for i in range(n):
+        if i % RICE_PARTITION == 0:
+            k = br.read(RICE_K_BITS)
+        q = 0
+        while q < RICE_ESCAPE and br.read(1):
+            q += 1
+        if q == RICE_ESCAPE:
+            out.append(br.read(ZZ_BITS))
+        else:
+            out.append((q << k) | br.read(k))
+    return out, br.end()
+
+
+class Decoder:
+    """
+    keeps the sequence and sample index of the previous block to report losses
+    """
+
+    def __init__(self):
+        self.next_seq = None
+        self.next_index = None
+
+    def decode(self, data):
+        if len(data) < HEADER.size:
+            raise DecodeError("short block (%d bytes)" % len(data))
+        version, enc, seq, first_index, t_us, period_us, count, first = HEADER.unpack_from(data, 0)
+        if version != VERSION:
+            raise DecodeError("version %d, this decoder knows %d" % (version, VERSION))
+        coding, order = enc & 0x0F, enc >> 4
+        if coding not in (ENC_VARINT, ENC_RICE) or order not in (1, 2) or count == 0:
+            raise DecodeError("bad encoding 0x%02x or count %d" % (enc, count))
+
+        n = count - 1
+        if coding == ENC_RICE:
+            zz, pos = residuals_rice(data, HEADER.size, n)
+        else:
+            zz, pos = residuals_varint(data, HEADER.size, n)
+        if pos != len(data):
+            raise DecodeError("block length %d, decoded %d" % (len(data), pos))
+
+        samples = [first]
+        for i, z in enumerate(zz):
+            d = unzigzag(z)
+            if i == 0 or order == 1:
+                samples.append(samples[-1] + d)  # the first residual is always a plain delta
+            else:
+                samples.append(d + 2 * samples[-1] - samples[-2])
+
+        missed = lost = 0
+        restart = False
+        if self.next_seq is not None:
+            missed = (seq - self.next_seq) & 0xFFFFFFFF
+            lost = (first_index - self.next_index) & 0xFFFFFFFF
+            if missed >= 0x80000000 or lost >= 0x80000000:  # went backwards: the node restarted
+                missed = lost = 0
+                restart = True
+        self.next_seq = (seq + 1) & 0xFFFFFFFF
+        self.next_index = (first_index + count) & 0xFFFFFFFF
+        return {"seq": seq, "first_index": first_index, "t_us": t_us, "period_us": period_us,
+                "order": order, "coding": "rice" if coding == ENC_RICE else "varint",
+                "samples": samples, "lost": lost, "missed": missed, "restart": restart,
+                "raw_bytes": 2 * count, "encoded_bytes": len(data)}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("input", nargs="?", help="hex payloads, one per line (default stdin)")
+    ap.add_argument("--samples", action="store_true", help="print the decoded samples")
+    args = ap.parse_args()
+
+    dec = Decoder()
+    src = open(args.input) if args.input else sys.stdin
+    total_raw = total_enc = 0
+    for n, line in enumerate(src, 1):
+        line = line.strip()
+        if not line:
+            continue
+        try:
+            blk = dec.decode(bytes.fromhex(line))
+        except (ValueError, DecodeError) as e:
+            print("line %d: %s" % (n, e), file=sys.stderr)
+            continue
+        total_raw += blk["raw_bytes"]
+        total_enc += blk["encoded_bytes"]
+        if args.samples:
+            for i, v in enumerate(blk["samples"]):
+                print("%d %d" % (blk["first_index"] + i, v))
+            continue
+        if blk["restart"]:
+            print("# stream restarted")
+        elif blk["missed"] or blk["lost"]:
+            print("# %d block(s) missed, %d sample(s) lost before #%d" % (blk["missed"], blk["lost"], blk["seq"]))
+        print("#%d index %d t %.6f %d samples order %d %s %d bytes (ratio %.2f)" % (
+            blk["seq"], blk["first_index"], blk["t_us"] / 1e6, len(blk["samples"]), blk["order"], blk["coding"],
+            blk["encoded_bytes"], blk["raw_bytes"] / blk["encoded_bytes"]))
+    if total_enc and not args.samples:
+        print("# raw %d bytes, sent %d bytes, ratio %.2f" % (total_raw, total_enc, total_raw / total_enc))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+sensor_record.py
+
+decoder for the binary sensor records of the monitoring node (see
+main/sensor_record.h), usable as a library or from the command line.
+
+as a library:
+    dec = Decoder(schema_json)          # payload of esp32/sensors/schema (optional)
+    for rec in dec.decode(payload):     # payload of esp32/sensors (bytes)
+        ...
+each record is a dict: schema, group, seq, t_ms (None until the decoder has an
+absolute timestamp for that group), values [(index, label, value or None)] and
+gap (records missed before this one).
+
+from the command line the input is one hex encoded payload per line, e.g.
+    mosquitto_sub -h <broker> -p <port> -t esp32/sensors -F %x > records.txt
+    mosquitto_sub -h <broker> -p <port> -t esp32/sensors/schema -C 1 > schema.json
+    python3 tools/sensor_record.py records.txt --schema schema.json
+with --compare the size of each record is shown next to the same record as json.
+"""
+
+import argparse
+import json
+import math
+import struct
+import sys
+
+SCHEMA_ID = 1
+F_SYNC = 0x01
+HEADER = struct.Struct("<BBBBH")  # schema, flags, group, entries, seq
+ENTRY = struct.Struct("<Bf")      # sensor index, value
+
+
+class DecodeError(Exception):
+    pass
+
+
+def varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise DecodeError("truncated varint")
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, pos
+
+
+class Decoder:
+    """
+    keeps the per group timing state the delta coded timestamps need
+    """
+
+    def __init__(self, schema=None):
+        self.labels = {}
+        self.groups = {}  # group -> (seq, t_ms)
+        if schema is not None:
+            self.set_schema(schema)
+
+    def set_schema(self, schema):
+        if isinstance(schema, (bytes, str)):
+            schema = json.loads(schema)
+        if schema.get("schema") != SCHEMA_ID:
+            raise DecodeError("schema id %r, this decoder knows %d" % (schema.get("schema"), SCHEMA_ID))
+        self.labels = {i: s[0] for i, s in enumerate(schema["sensors"])}
+
+    def decode(self, data):
+        """
+        decode one payload (a record per payload today; returns a list so a
+        future schema can batch)
+        """
+        if len(data) < HEADER.size:
+            raise DecodeError("short record (%d bytes)" % len(data))
+        schema, flags, group, count, seq = HEADER.unpack_from(data, 0)
+        if schema != SCHEMA_ID:
+            raise DecodeError("schema id %d, this decoder knows %d" % (schema, SCHEMA_ID))
+        ts, pos = varint(data, HEADER.size)
+        if len(data) != pos + count * ENTRY.size:
+            raise DecodeError("record length %d, expected %d" % (len(data), pos + count * ENTRY.size))
+
+        prev = self.groups.get(group)
+        gap = 0 if prev is None else (seq - prev[0] - 1) & 0xFFFF
+        if flags & F_SYNC:
+            t_ms = ts
+        elif prev is not None and prev[1] is not None and gap == 0:
+            t_ms = prev[1] + ts
+        else:
+            t_ms = None  # lost step, wait for the next sync record
+        self.groups[group] = (seq, t_ms)
+
+        values = []
+        for _ in range(count):
+            index, value = ENTRY.unpack_from(data, pos)
+            pos += ENTRY.size
+            values.append((index, self.labels.get(index, "sensor%d" % index), None if math.isnan(value) else value))
+        return [{"schema": schema, "group": group, "seq": seq, "t_ms": t_ms, "values": values, "gap": gap}]
+
+
+def as_json(rec):
+    """
+    the same record as the json a text encoding would carry (the size baseline)
+    """
+    return json.dumps({"group": rec["group"], "seq": rec["seq"], "t_ms": rec["t_ms"],
+                       "sensors": {label: (None if v is None else round(v, 2)) for _, label, v in rec["values"]}},
+                      separators=(",", ":"))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("input", nargs="?", help="hex payloads, one per line (default stdin)")
+    ap.add_argument("--schema", help="schema json (payload of esp32/sensors/schema)")
+    ap.add_argument("--compare", action="store_true", help="show each record's size against json")
+    args = ap.parse_args()
+
+    dec = Decoder()
+    if args.schema:
+        with open(args.schema) as f:
+            dec.set_schema(f.read())
+
+    src = open(args.input) if args.input else sys.stdin
+    total_bin = total_json = 0
+    for n, line in enumerate(src, 1):
+        line = line.strip()
+        if not line:
+            continue
+        try:
+            data = bytes.fromhex(line)
+            records = dec.decode(data)
+        except (ValueError, DecodeError) as e:
+            print("line %d: %s" % (n, e), file=sys.stderr)
+            continue
+        for rec in records:
+            if rec["gap"]:
+                print("# group %d: %d record(s) missed" % (rec["group"], rec["gap"]))
+            vals = " ".join("%s=%s" % (label, "nan" if v is None else "%.2f" % v) for _, label, v in rec["values"])
+            t = "?" if rec["t_ms"] is None else "%.3f" % (rec["t_ms"] / 1000.0)
+            if args.compare:
+                j = len(as_json(rec))
+                total_bin += len(data)
+                total_json += j
+                print("%s g%d #%d %s  (%d bytes, json %d)" % (t, rec["group"], rec["seq"], vals, len(data), j))
+            else:
+                print("%s g%d #%d %s" % (t, rec["group"], rec["seq"], vals))
+    if args.compare and total_json:
+        print("# binary %d bytes, json %d bytes (%.1f%%)" % (total_bin, total_json, 100.0 * total_bin / total_json))
+
+
+if __name__ == "__main__":
+    main()
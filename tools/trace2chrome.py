@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+trace2chrome.py
+
+convert a trace dump from the monitoring node (see main/trace.h) to chrome trace
+json, to load in chrome://tracing or https://ui.perfetto.dev
+
+the input is any text holding the dump lines: a captured console log (other log
+lines are skipped) or the payloads of esp32/trace, e.g.
+    mosquitto_sub -h <broker> -p <port> -t esp32/trace > trace.txt
+    python3 tools/trace2chrome.py trace.txt -o trace.json
+
+each core is shown as a thread; the event argument is kept in "args".
+"""
+
+import argparse
+import json
+import sys
+
+PHASES = {"B": "B", "E": "E", "I": "i"}
+
+
+def parse(lines):
+    names = {}
+    events = []
+    header = None
+    for line in lines:
+        f = line.split()
+        if not f:
+            continue
+        # console lines may carry a log prefix, find the record tag
+        for i, tok in enumerate(f):
+            if tok in ("TB", "TN", "T", "TE"):
+                f = f[i:]
+                break
+        else:
+            continue
+        if f[0] == "TB" and len(f) >= 5:
+            header = {"version": int(f[1]), "cores": int(f[2]), "events": int(f[3]), "lost": int(f[4])}
+        elif f[0] == "TN" and len(f) >= 3:
+            names[int(f[1])] = f[2]
+        elif f[0] == "T" and len(f) >= 6 and f[4] in PHASES:
+            events.append((int(f[1]), int(f[2]), int(f[3]), f[4], int(f[5])))
+    return header, names, events
+
+
+def unwrap(events):
+    """
+    the timestamps are the low 32 bits of a uS clock shared by the cores.  the rings
+    span much less than half a wrap, so anything far below the newest timestamp
+    happened after the clock wrapped
+    """
+    if not events:
+        return events
+    newest = max(e[1] for e in events)
+    if newest < (1 << 31):
+        return events
+    # newest is from before the wrap, push the small (after the wrap) stamps up
+    return [(c, ts + (1 << 32) if ts < newest - (1 << 31) else ts, eid, ph, arg)
+            for c, ts, eid, ph, arg in events]
+
+
+def to_chrome(names, events):
+    trace = []
+    cores = sorted({e[0] for e in events})
+    for core in cores:
+        trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": core, "args": {"name": "core %d" % core}})
+    if events:
+        t0 = min(e[1] for e in events)
+    for core, ts, eid, ph, arg in sorted(events, key=lambda e: e[1]):
+        ev = {"name": names.get(eid, "event_%d" % eid), "ph": PHASES[ph], "pid": 0, "tid": core,
+              "ts": ts - t0, "args": {"arg": arg}}
+        if ph == "I":
+            ev["s"] = "t"
+        trace.append(ev)
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+def main():
+    ap = argparse.ArgumentParser(description="convert a node trace dump to chrome trace json")
+    ap.add_argument("input", nargs="?", help="dump text (default stdin)")
+    ap.add_argument("-o", "--output", help="json file (default stdout)")
+    args = ap.parse_args()
+
+    src = open(args.input) if args.input else sys.stdin
+    header, names, events = parse(src)
+    if header is None:
+        sys.exit("no trace header (TB) found")
+    events = unwrap(events)
+    if header["lost"]:
+        sys.stderr.write("note: %d older events were overwritten before the dump\n" % header["lost"])
+    if len(events) != header["events"]:
+        sys.stderr.write("warning: expected %d events, found %d\n" % (header["events"], len(events)))
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(to_chrome(names, events), out)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()